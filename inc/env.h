@@ -13,7 +13,7 @@ extern physaddr_t kern_cr3;
 
 // An environment ID 'envid_t' has three parts:
 //
-// +1+---------------21-----------------+--------10--------+
+// +1+------------(31 - LOG2NENV)-------+----LOG2NENV------+
 // |0|          Uniqueifier             |   Environment    |
 // | |                                  |      Index       |
 // +------------------------------------+------------------+
@@ -26,11 +26,24 @@ extern physaddr_t kern_cr3;
 // All real environments are greater than 0 (so the sign bit is zero).
 // envid_ts less than 0 signify errors.  The envid_t == 0 is special, and
 // stands for the current environment.
+//
+// NENV is the maximum number of environments; the kernel grows 'envs[]'
+// on demand up to that size (see env_alloc()).  Slots that were never
+// handed out read as free through UENVS.
 
-#define LOG2NENV    5
+#ifndef LOG2NENV
+#define LOG2NENV 12
+#endif
 #define NENV        (1 << LOG2NENV)
 #define ENVX(envid) ((envid) & (NENV - 1))
 
+// Number of scheduling priority levels.  Level 0 is the most important
+// one; see sys_env_set_priority() and kern/sched.c.
+#define NPRIO 4
+
+// Words in a message of sys_ipc_send()
+#define IPC_MSG_WORDS 4
+
 // Values of env_status in struct Env
 enum {
   ENV_FREE = 0,
@@ -40,6 +53,14 @@ enum {
   ENV_NOT_RUNNABLE
 };
 
+// Scheduling classes, see sys_env_set_sched_class()
+enum {
+  SCHED_MLFQ = 0, // Multi-level feedback queue (default)
+  SCHED_FAIR,     // Fair share by weighted virtual runtime
+  SCHED_DEADLINE, // Earliest deadline first with CPU reservations
+  NSCHEDCLASSES
+};
+
 // Special environment types
 enum EnvType {
   ENV_TYPE_IDLE = 0,
@@ -48,7 +69,7 @@ enum EnvType {
 };
 
 struct Env {
-  struct Trapframe env_tf; // Saved registers
+  struct Trapframe *env_tf; // Saved registers, at the top of env_kstack
   struct Env *env_link;    // Next free Env
   envid_t env_id;          // Unique environment identifier
   envid_t env_parent_id;   // env_id of this env's parent
@@ -60,6 +81,66 @@ struct Env {
   // Address space
   pml4e_t *env_pml4e; // Kernel virtual address of page dir
   physaddr_t env_cr3;
+
+  // Scheduling
+  int env_sched_class;      // SCHED_MLFQ, SCHED_FAIR, ...
+  int env_priority;         // Base priority level (0 is the highest)
+  int env_sched_level;      // Current multi-level feedback queue level
+  uint32_t env_slice_ticks; // Clock ticks used at the current level
+  bool env_on_rq;           // Whether the env is linked into a run queue
+  struct Env *env_rq_next;  // Run queue links
+  struct Env *env_rq_prev;
+  int env_cpu;              // CPU whose run queue the env belongs to
+  int env_last_cpu;         // CPU the env last ran on (-1 if never)
+  bool env_sleeping;        // Blocked in sys_sleep_ns() (ENV_NOT_RUNNABLE)
+
+  // CPU time accounting, in TSC cycles
+  uint64_t env_exec_start;    // TSC when the env was last put on the CPU
+  uint64_t env_last_ran;      // TSC when the env last left the CPU
+  uint64_t env_sum_exec;      // Total time spent running
+  uint64_t env_vruntime;      // Weighted runtime (SCHED_FAIR)
+  struct Env *env_fair_left;  // SCHED_FAIR run queue tree links
+  struct Env *env_fair_right;
+  int env_fair_height;
+
+  // SCHED_DEADLINE reservation and state, in TSC cycles
+  uint64_t env_dl_runtime;      // CPU time reserved every period
+  uint64_t env_dl_deadline;     // Relative deadline
+  uint64_t env_dl_period;
+  uint64_t env_dl_abs_deadline; // Deadline of the current period
+  int64_t env_dl_budget;        // Runtime left in the current period
+  bool env_dl_throttled;        // Budget used up, waiting for the next period
+  uint32_t env_dl_misses;       // Deadlines passed with budget left
+  uint32_t env_dl_overruns;     // Times the budget was used up
+
+  // Synchronous IPC, see kern/ipc.c
+  bool env_ipc_recving;         // Blocked in sys_ipc_recv()
+  envid_t env_ipc_from;         // Sender it waits for, 0 for any
+  uintptr_t env_ipc_dstva;      // Where it wants a page mapped, UTOP for none
+  int env_ipc_perm;             // Perm of the page it got, 0 if none
+  bool env_ipc_page;            // Its pending message carries a page
+  struct Env *env_ipc_target;   // Receiver it is blocked sending to
+  struct Env *env_ipc_senders;  // Envs blocked sending to it, in FIFO order
+  struct Env *env_ipc_next;     // Next on the env_ipc_senders list
+
+  // Futex wait queue, see kern/futex.c
+  bool env_futex_waiting;       // Blocked in sys_futex_wait()
+  physaddr_t env_futex_pa;      // Physical address of the futex word
+  struct Env *env_futex_next;   // Next waiter in the hash bucket
+
+  // Kernel stack, kept with the envs[] slot, see env_kstack_alloc()
+  struct PageInfo *env_kstack[ENV_KSTKSIZE / PGSIZE];
+
+  // FPU and vector registers, see kern/fpu.c
+  struct PageInfo *env_fpu;     // Save area, kept with the envs[] slot
+  bool env_fpu_used;            // The save area holds its state
+  int env_fpu_cpu;              // CPU whose registers hold it, -1 if none
+
+  // System call tracing, see kern/systrace.c
+  bool env_systrace;            // Record its system calls
+
+  // Page of its struct Sysring, see sys_sysring_setup()
+  struct PageInfo *env_sysring;
 };
 
 #endif // !JOS_INC_ENV_H
@@ -16,6 +16,8 @@ enum {
   E_FAULT       = 7, // Memory fault
   E_INVALID_EXE = 8, // Invalid executable
   E_NO_SYS      = 9, // Unimplemented system call
+  E_BUSY        = 10, // Resource is busy or has no capacity left
+  E_AGAIN       = 11, // Value changed, try again
 
   MAXERROR
 };
@@ -16,6 +16,7 @@
 #include <inc/env.h>
 #include <inc/memlayout.h>
 #include <inc/syscall.h>
+#include <inc/time.h>
 
 #ifdef SANITIZE_USER_SHADOW_BASE
 // asan unpoison routine used for whitelisting regions.
@@ -47,6 +48,57 @@ void sys_cputs(const char *string, size_t len);
 int sys_cgetc(void);
 envid_t sys_getenvid(void);
 int sys_env_destroy(envid_t);
+int sys_env_set_priority(envid_t env, int priority);
+int sys_env_set_sched_class(envid_t env, int sched_class);
+int sys_env_set_deadline(envid_t env, uint64_t runtime_ns,
+                         uint64_t deadline_ns, uint64_t period_ns);
+#ifndef JOS_PROG
+void sys_yield(void);
+#endif
+int sys_sleep_ns(uint64_t ns);
+int sys_ipc_send(envid_t to, const uint64_t msg[IPC_MSG_WORDS]);
+int sys_ipc_send_page(envid_t to, void *srcva, int perm, uint64_t w0, uint64_t w1);
+int sys_ipc_recv(envid_t from, envid_t *from_store, uint64_t msg[IPC_MSG_WORDS]);
+int sys_ipc_recv_page(envid_t from, void *dstva, envid_t *from_store,
+                      uint64_t msg[IPC_MSG_WORDS]);
+int sys_shm_get(uint32_t key, size_t npages);
+int sys_shm_map(int id, void *va, int perm);
+int sys_shm_remove(int id);
+int sys_futex_wait(volatile uint32_t *addr, uint32_t expected);
+int sys_futex_wake(volatile uint32_t *addr, int n);
+int sys_sysring_setup(struct Sysring *ring);
+int sys_enter(uint32_t n);
+envid_t sys_spawn(const char *name, const char **argv);
+
+// ring.c
+// A byte stream from one environment to another through shared
+// memory.  The producer owns the first cache line, the consumer the
+// second one.
+struct Ring {
+  volatile uint32_t head __attribute__((aligned(64))); // Bytes written
+  volatile uint32_t closed;       // No more data will come
+  volatile uint32_t prod_waiting; // Producer sleeps on a full ring
+  volatile uint32_t cons_wake;    // Bumped to wake the consumer
+  volatile uint32_t tail __attribute__((aligned(64))); // Bytes read
+  volatile uint32_t cons_waiting; // Consumer sleeps on an empty ring
+  volatile uint32_t prod_wake;    // Bumped to wake the producer
+  uint32_t size __attribute__((aligned(64))); // Bytes of data, a power of 2
+  uint8_t data[] __attribute__((aligned(64)));
+};
+
+int ring_init(struct Ring *r, size_t len);
+size_t ring_write(struct Ring *r, const void *buf, size_t n);
+size_t ring_read(struct Ring *r, void *buf, size_t n);
+void ring_close(struct Ring *r);
+
+// sysring.c
+int sysring_queue(uint64_t user_data, int num, uint64_t a1, uint64_t a2,
+                  uint64_t a3, uint64_t a4, uint64_t a5);
+int sysring_submit(void);
+bool sysring_reap(uint64_t *user_data, int64_t *ret);
+
+// time.c
+int64_t clock_gettime_ns(int clock);
 
 /* File open modes */
 #define O_RDONLY  0x0000 /* open for reading only */
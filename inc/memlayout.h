@@ -16,9 +16,9 @@
 #define GD_KD   0x10 // kernel data
 #define GD_KT32 0x18 // kernel text 32bit
 #define GD_KD32 0x20 // kernel data 32bit
-#define GD_UT   0x28 // user text
 #define GD_UD   0x30 // user data
-#define GD_TSS0 0x38 // Task segment selector for CPU 0
+#define GD_UT   0x38 // user text; sysretq needs it right after GD_UD
+#define GD_TSS0 0x40 // Task segment selector for CPU 0
 
 /*
  * Virtual memory map:                                Permissions
@@ -53,8 +53,12 @@
  *                     .                              .        400 * PTSIZE
  *                     .                              .
  *    UPAGES    ---->  +------------------------------+ 0x8000dc0000
- *                     |           RO ENVS            | R-/R-  PTSIZE
- * UENVS ----------->  +------------------------------+ 0x8000da0000
+ *                     |           RO ENVS            | R-/R-  UENVS_SIZE
+ * UENVS ----------->  +------------------------------+
+ *                     |           RW ENVS            | RW/--  UENVS_SIZE
+ * KENVS ----------->  +------------------------------+
+ *                     |           RO TIME            | R-/R-  PGSIZE
+ * UTIME ----------->  +------------------------------+
  *                     |                              |
  *                     |                              |
  *                     ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -102,6 +106,10 @@
 #define IOPHYSMEM  0x0A0000
 #define EXTPHYSMEM 0x100000
 
+// Physical address of the startup code of the application processors
+// (kern/mpentry.S); must be below 1MB and page aligned.
+#define MPENTRY_PADDR 0x7000
+
 // Amount of memory mapped by entrypgdir.
 #define BOOTMEMSIZE (256 * 1024 * 1024)
 
@@ -110,6 +118,10 @@
 #define PSTKSIZE  (2 * PGSIZE)  // size of a process stack
 #define KSTKSIZE  (16 * PGSIZE) // size of a kernel stack
 #define KSTKGAP   (8 * PGSIZE)  // size of a kernel stack guard
+// Size of the kernel stack of an environment.  While the environment
+// runs on a CPU, the stack shows through the top of that CPU's kernel
+// stack, see kern/cpu.h.
+#define ENV_KSTKSIZE (4 * PGSIZE)
 
 // Memory-mapped IO.
 #define MMIOLIM  (KSTACKTOP - PTSIZE)
@@ -138,8 +150,13 @@
 // Read-only copies of the Page structures (sizeof == 400 * PTSIZE so that all
 // struct PageInfo of up to 512GiB pages can fit here).
 #define UPAGES (ULIM - UPAGES_SIZE)
-// Read-only copies of the global env structures
-#define UENVS (UPAGES - PTSIZE)
+// Read-only copies of the global env structures, room for NENV of them
+#define UENVS_SIZE (32 * PTSIZE)
+#define UENVS      (UPAGES - UENVS_SIZE)
+// Kernel read-write mapping of the same env structures
+#define KENVS (UENVS - UENVS_SIZE)
+// Read-only time page, a struct TimePage (see inc/time.h)
+#define UTIME (KENVS - PGSIZE)
 
 /*
  * Top of user VM. User can manipulate VA from UTOP-1 and down!
@@ -110,9 +110,21 @@
 #define CR4_VME 0x00000001 // V86 Mode Extensions
 
 //x86_64 related changes
-#define CR4_PAE  0x00000020
-#define EFER_MSR 0xC0000080
-#define EFER_LME 8
+#define CR4_PAE   0x00000020
+#define CR4_PCIDE 0x00020000 // Process-context identifiers (long mode only)
+#define CR4_OSFXSR     0x00000200 // FXSAVE/FXRSTOR and SSE enabled
+#define CR4_OSXMMEXCPT 0x00000400 // SIMD exceptions raise #XM
+#define CR4_OSXSAVE    0x00040000 // XSAVE and XCR0 enabled
+#define EFER_MSR  0xC0000080
+#define EFER_LME  8
+#define EFER_LMA  10
+#define EFER_SCE  0 // syscall/sysret enable
+
+#define MSR_GS_BASE        0xC0000101 // Base of GS
+#define MSR_KERNEL_GS_BASE 0xC0000102 // Exchanged with MSR_GS_BASE by swapgs
+#define MSR_STAR           0xC0000081 // Segment selectors of syscall/sysret
+#define MSR_LSTAR          0xC0000082 // Entry point of syscall in 64-bit mode
+#define MSR_SFMASK         0xC0000084 // RFLAGS bits cleared by syscall
 
 // Eflags register
 #define FL_CF        0x00000001 // Carry Flag
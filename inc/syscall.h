@@ -1,13 +1,58 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/types.h>
+
 /* system call numbers */
 enum {
   SYS_cputs = 0,
   SYS_cgetc,
   SYS_getenvid,
   SYS_env_destroy,
+  SYS_env_set_priority,
+  SYS_env_set_sched_class,
+  SYS_env_set_deadline,
+  SYS_yield,
+  SYS_sleep_ns,
+  SYS_ipc_send,
+  SYS_ipc_send_page,
+  SYS_ipc_recv,
+  SYS_shm_get,
+  SYS_shm_map,
+  SYS_shm_remove,
+  SYS_futex_wait,
+  SYS_futex_wake,
+  SYS_sysring_setup,
+  SYS_enter,
+  SYS_spawn,
   NSYSCALLS
 };
 
+// Batched system calls, see sys_enter().  An environment queues calls
+// at sq_tail and the kernel takes them from sq_head; the kernel posts
+// their results at cq_tail and the environment reaps them from
+// cq_head.  The indices run freely: entry i is at i % SYSRING_ENTRIES.
+#define SYSRING_ENTRIES 32
+
+struct SysringSqe {
+  uint64_t num;       // SYS_*
+  uint64_t args[5];
+  uint64_t user_data; // Passed on to the completion
+  uint64_t pad;
+};
+
+struct SysringCqe {
+  uint64_t user_data;
+  int64_t ret;
+};
+
+struct Sysring {
+  volatile uint32_t sq_head; // Written by the kernel
+  volatile uint32_t sq_tail; // Written by the environment
+  volatile uint32_t cq_head; // Written by the environment
+  volatile uint32_t cq_tail; // Written by the kernel
+  struct SysringSqe sq[SYSRING_ENTRIES];
+  struct SysringCqe cq[SYSRING_ENTRIES];
+};
+
 #endif /* !JOS_INC_SYSCALL_H */
@@ -0,0 +1,29 @@
+#ifndef JOS_INC_TIME_H
+#define JOS_INC_TIME_H
+
+#include <inc/types.h>
+
+// The kernel keeps the clocks on a read-only page at UTIME, so that
+// environments can read the time without a system call:
+//
+//   ns = base_ns + ((tsc - base_tsc) * mult) >> shift
+//
+// with a 128-bit product.  The TSC is calibrated once at boot, so the
+// kernel writes the page once, before the first environment starts,
+// and never changes it.
+struct TimePage {
+  uint32_t shift;
+  uint64_t mult;
+  uint64_t tsc_freq;      // TSC cycles per second
+  uint64_t base_tsc;      // TSC at the base
+  uint64_t mono_base_ns;  // CLOCK_MONOTONIC at base_tsc: ns since boot
+  uint64_t wall_base_ns;  // CLOCK_REALTIME at base_tsc: ns since the epoch
+};
+
+// Clocks of clock_gettime_ns()
+enum {
+  CLOCK_REALTIME = 0,
+  CLOCK_MONOTONIC,
+};
+
+#endif /* !JOS_INC_TIME_H */
@@ -40,6 +40,12 @@
 #define IRQ_IDE      14
 #define IRQ_ERROR    19
 
+// Local APIC timer of the application processors.  (IRQ_OFFSET + 16
+// would collide with T_SYSCALL.)
+#define IRQ_LAPIC_TIMER 17
+// Inter-processor interrupt that wakes up an idle CPU.
+#define IRQ_WAKEUP      18
+
 #ifndef __ASSEMBLER__
 
 #include <inc/types.h>
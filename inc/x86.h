@@ -293,6 +293,48 @@ read_tsc(void) {
   return res;
 }
 
+static inline uint64_t
+rdmsr(uint32_t msr) {
+  uint32_t lo, hi;
+  __asm __volatile("rdmsr"
+                   : "=a"(lo), "=d"(hi)
+                   : "c"(msr));
+  return (uint64_t)lo | ((uint64_t)hi << 32);
+}
+
+static inline void
+wrmsr(uint32_t msr, uint64_t val) {
+  __asm __volatile("wrmsr" ::"c"(msr), "a"((uint32_t)val), "d"((uint32_t)(val >> 32)));
+}
+
+// CPUID with a sub-leaf in ECX, e.g. for leaf 0xD.
+static inline void
+cpuid_count(uint32_t info, uint32_t subleaf, uint32_t *eaxp, uint32_t *ebxp,
+            uint32_t *ecxp, uint32_t *edxp) {
+  uint32_t eax, ebx, ecx, edx;
+  asm volatile("cpuid"
+               : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+               : "a"(info), "c"(subleaf));
+  if (eaxp)
+    *eaxp = eax;
+  if (ebxp)
+    *ebxp = ebx;
+  if (ecxp)
+    *ecxp = ecx;
+  if (edxp)
+    *edxp = edx;
+}
+
+static inline void
+xsetbv(uint32_t xcr, uint64_t val) {
+  __asm __volatile("xsetbv" ::"c"(xcr), "a"((uint32_t)val), "d"((uint32_t)(val >> 32)));
+}
+
+static inline void
+clts(void) {
+  __asm __volatile("clts");
+}
+
 static inline uint32_t
 xchg(volatile uint32_t *addr, uint32_t newval) {
   uint32_t result;
@@ -305,6 +347,16 @@ xchg(volatile uint32_t *addr, uint32_t newval) {
   return result;
 }
 
+// Atomically add 'inc' to *addr and return the old value.
+static inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t inc) {
+  asm volatile("lock; xaddl %0, %1"
+               : "+r"(inc), "+m"(*addr)
+               :
+               : "memory", "cc");
+  return inc;
+}
+
 #define NMI_LOCK 0x80
 
 static inline void
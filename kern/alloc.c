@@ -10,6 +10,8 @@ static Header base = {.s = {.next = (Header *)space, .prev = (Header *)space, .s
 
 static Header *freep = NULL; /* start of free list */
 
+static struct spinlock alloc_lock = SPINLOCK_INITIALIZER(alloc_lock, LOCK_ORDER_NONE);
+
 static void
 check_list(void) {
   Header *p, *prevp;
@@ -35,7 +37,7 @@ test_alloc(uint8_t nbytes) {
 
   // Make allocator thread-safe with the help of spin_lock/spin_unlock.
   // LAB 5 code
-  spin_lock(&kernel_lock);
+  spin_lock(&alloc_lock);
   // LAB 5 code end
 
   nunits = (nbytes + sizeof(Header) - 1) / sizeof(Header) + 1;
@@ -60,13 +62,13 @@ test_alloc(uint8_t nbytes) {
         p += p->s.size;
         p->s.size = nunits;
       }
-      spin_unlock(&kernel_lock);
+      spin_unlock(&alloc_lock);
       return (void *)(p + 1);
     }
     if (p == freep) { /* wrapped around free list */
 
       // LAB 5 code
-      spin_unlock(&kernel_lock);
+      spin_unlock(&alloc_lock);
       // LAB 5 code end
 
       return NULL;
@@ -82,7 +84,7 @@ test_free(void *ap) {
 
   // Make allocator thread-safe with the help of spin_lock/spin_unlock.
   // LAB 5 code
-  spin_lock(&kernel_lock);
+  spin_lock(&alloc_lock);
   // LAB 5 code end
 
   for (p = freep; !(bp > p && bp < p->s.next); p = p->s.next)
@@ -111,6 +113,6 @@ test_free(void *ap) {
   check_list();
 
   // LAB 5 code
-  spin_unlock(&kernel_lock);
+  spin_unlock(&alloc_lock);
   // LAB 5 code end
 }
@@ -7,6 +7,7 @@
 #include <inc/assert.h>
 
 #include <kern/console.h>
+#include <kern/spinlock.h>
 #include <inc/uefi.h>
 
 static bool graphics_exists = false;
@@ -17,7 +18,6 @@ static uint32_t crt_cols;
 static uint32_t crt_size;
 
 static void cons_intr(int (*proc)(void));
-static void cons_putc(int c);
 
 // Stupid I/O delay routine necessitated by historical PC design flaws
 static void
@@ -503,12 +503,16 @@ static void
 cons_intr(int (*proc)(void)) {
   int c;
 
+  // The device is polled without cons_lock: kbd_proc_data() may
+  // cprintf().
   while ((c = (*proc)()) != -1) {
     if (c == 0)
       continue;
+    spin_lock(&cons_lock);
     cons.buf[cons.wpos++] = c;
     if (cons.wpos == CONSBUFSIZE)
       cons.wpos = 0;
+    spin_unlock(&cons_lock);
   }
 }
 
@@ -524,17 +528,19 @@ cons_getc(void) {
   kbd_intr();
 
   // grab the next character from the input buffer.
+  c = 0;
+  spin_lock(&cons_lock);
   if (cons.rpos != cons.wpos) {
     c = cons.buf[cons.rpos++];
     if (cons.rpos == CONSBUFSIZE)
       cons.rpos = 0;
-    return c;
   }
-  return 0;
+  spin_unlock(&cons_lock);
+  return c;
 }
 
 // output a character to the console
-static void
+void
 cons_putc(int c) {
   serial_putc(c);
   lpt_putc(c);
@@ -553,9 +559,31 @@ cons_init(void) {
 
 // `High'-level console I/O.  Used by readline and cprintf.
 
+// Take cons_lock for a run of cons_putc() calls, so that the output of
+// different CPUs is not interleaved.  After a panic the lock is left
+// alone: the panicking CPU may already hold it.
+bool
+cons_lock_output(void) {
+  extern const char *panicstr;
+
+  if (panicstr)
+    return 0;
+  spin_lock(&cons_lock);
+  return 1;
+}
+
+void
+cons_unlock_output(bool locked) {
+  if (locked)
+    spin_unlock(&cons_lock);
+}
+
 void
 cputchar(int c) {
+  bool locked = cons_lock_output();
+
   cons_putc(c);
+  cons_unlock_output(locked);
 }
 
 int
@@ -16,6 +16,10 @@
 void cons_init(void);
 void fb_init(void);
 int cons_getc(void);
+void cons_putc(int c); // Called with cons_lock held, see cons_lock_output()
+
+bool cons_lock_output(void);
+void cons_unlock_output(bool locked);
 
 void kbd_intr(void);    // irq 1
 void serial_intr(void); // irq 4
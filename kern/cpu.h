@@ -1,4 +1,3 @@
-
 #ifndef JOS_INC_CPU_H
 #define JOS_INC_CPU_H
 
@@ -7,23 +6,91 @@
 #include <inc/mmu.h>
 #include <inc/env.h>
 
-#define NCPU 1
+// Maximum number of CPUs
+#define NCPU 8
+
+// Values of status in struct CpuInfo
+enum {
+  CPU_UNUSED = 0,
+  CPU_STARTED,
+  CPU_HALTED,
+};
+
+// Per-CPU state
+struct CpuInfo {
+  struct CpuInfo *cpu_self;       // This struct, see thiscpu; must come first
+  uintptr_t cpu_kstack_top;       // Top of the kernel stack for syscall_entry
+  uintptr_t cpu_user_rsp;         // User rsp while syscall_entry switches stacks
+  int cpu_num;                    // Index into cpus[]
+  uint8_t cpu_id;                 // Local APIC ID
+  volatile unsigned cpu_status;   // The status of the CPU
+  struct Env *cpu_env;            // The currently-running environment.
+  struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+  bool cpu_preempt;               // cpu_env is being preempted, see sched_tick()
+  bool cpu_in_intr;               // Handling an interrupt
+  bool cpu_in_clk_intr;           // Handling a clock interrupt
+  bool cpu_tickless;              // Idle with the periodic tick stopped
+  uint64_t cpu_idle_start;        // TSC when the CPU went idle
+  bool cpu_tick_on;               // Local APIC timer is ticking periodically
+  uint64_t cpu_tick_deadline;     // TSC of its next tick in TSC-deadline mode
+  struct Env *cpu_kstack_env;     // Env whose kernel stack is mapped at the top
+  pte_t *cpu_kstack_pte;          // PTEs of that mapping, see env_kstack_map()
+  struct Env *cpu_fpu_env;        // Env whose FPU state the registers hold
+};
+
+// Initialized in mpconfig.c
+extern struct CpuInfo cpus[NCPU];
+extern int ncpu;                 // Total number of CPUs in the system
+extern struct CpuInfo *bootcpu;  // The boot-strap processor (BSP)
+extern physaddr_t lapicaddr;     // Physical MMIO address of the local APIC
+
+// Per-CPU kernel stacks
+extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
 
-extern struct Taskstate cpu_ts; // Used by x86 to find stack for interrupt
+// The CpuInfo of the running CPU.  The kernel keeps the GS base
+// pointed at it (see percpu_init()), so a field of this_cpu is a
+// single %gs-relative access.  User mode has its own GS base, which
+// swapgs exchanges with the kernel one on every kernel entry and exit
+// (see kern/trapentry.S and env_pop_tf()).
+#define this_cpu (*(struct CpuInfo __seg_gs *)0)
+#define thiscpu  (this_cpu.cpu_self)
+
+static inline int
+cpunum(void) {
+  return this_cpu.cpu_num;
+}
+
+// Top of the kernel stack of CPU 'i', see inc/memlayout.h.  Once the
+// CPU runs environments, its top ENV_KSTKSIZE bytes map the kernel
+// stack of the environment it runs, so traps from user mode save the
+// registers right into its env_tf.  A guard page separates that from
+// the CPU's own stack below, where the scheduler runs.
+#define KSTACKTOP_CPU(i) (KSTACKTOP - (uintptr_t)(i) * (KSTKSIZE + KSTKGAP))
+#define CPUSTACKTOP(i)   (KSTACKTOP_CPU(i) - ENV_KSTKSIZE - PGSIZE)
+
+void percpu_init(struct CpuInfo *c);
+void mp_init(void);
+void lapic_init(void);
+void lapic_startap(uint8_t apicid, uint32_t addr);
+void lapic_eoi(void);
+void lapic_ipi(int vector);
+void lapic_ipi_cpu(int cpu, int vector);
+bool lapic_timer_available(void);
+void lapic_timer_periodic(void);
+void lapic_timer_oneshot(uint64_t ns);
+void lapic_timer_stop(void);
+void lapic_timer_handle(void);
 
 //kernel stack
 extern unsigned char kstack[KSTKSIZE];
 
-extern char in_intr;
-extern bool in_clk_intr;
-
 static inline bool
 in_interrupt(void) {
-  return !!in_intr;
+  return this_cpu.cpu_in_intr;
 }
 
 static inline bool
 in_clock_interrupt(void) {
-  return in_intr && in_clk_intr;
+  return this_cpu.cpu_in_intr && this_cpu.cpu_in_clk_intr;
 }
 #endif
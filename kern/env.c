@@ -12,22 +12,31 @@
 #include <kern/trap.h>
 #include <kern/monitor.h>
 #include <kern/sched.h>
+#include <kern/ipc.h>
+#include <kern/futex.h>
+#include <kern/fpu.h>
+#include <kern/kworker.h>
 #include <kern/cpu.h>
 #include <kern/kdebug.h>
+#include <kern/spinlock.h>
 #include <kern/macro.h>
 
 #ifdef CONFIG_KSPACE
 struct Env env_array[NENV];
-struct Env *curenv = NULL;
-struct Env *envs   = env_array; // All environments
+struct Env *envs = env_array; // All environments
 #else
-struct Env *envs   = NULL; // All environments
-struct Env *curenv = NULL; // The current env
+struct Env *envs = (struct Env *)KENVS; // All environments
 #endif
+size_t nenvs;                     // Number of slots in envs[]
 static struct Env *env_free_list; // Free environment list
                                   // (linked by Env->env_link)
 
-#define ENVGENSHIFT 12 // >= LOGNENV
+#define ENVGENSHIFT LOG2NENV // >= LOG2NENV
+
+// Number of slots added to envs[] whenever it runs out of free ones.
+#define ENV_GROW 32
+
+static_assert(NENV * sizeof(struct Env) <= UENVS_SIZE, "NENV too big for UENVS");
 
 // Global descriptor table.
 //
@@ -44,7 +53,7 @@ static struct Env *env_free_list; // Free environment list
 // definition of gdt specifies the Descriptor Privilege Level (DPL)
 // of that descriptor: 0 for kernel and 3 for user.
 //
-struct Segdesc gdt[2 * NCPU + 7] =
+struct Segdesc gdt[2 * NCPU + 8] =
     {
         // 0x0 - unused (always faults -- for trapping NULL far pointers)
         SEG_NULL,
@@ -61,17 +70,23 @@ struct Segdesc gdt[2 * NCPU + 7] =
         // 0x20 - kernel data segment 32bit
         [GD_KD32 >> 3] = SEG(STA_W, 0x0, 0xffffffff, 0),
 
-        // 0x28 - user code segment
-        [GD_UT >> 3] = SEG64(STA_X | STA_R, 0x0, 0xffffffff, 3),
+        // 0x28 - unused: sysretq to 32-bit code would take it (see
+        // trap_init_percpu())
 
         // 0x30 - user data segment
         [GD_UD >> 3] = SEG64(STA_W, 0x0, 0xffffffff, 3),
 
+        // 0x38 - user code segment.  sysretq loads it from STAR without
+        // looking here, so it must follow GD_UD.  Execute-only, so that
+        // loading it into a data segment register faults as it used to
+        // when the first TSS was in this slot.
+        [GD_UT >> 3] = SEG64(STA_X, 0x0, 0xffffffff, 3),
+
         // Per-CPU TSS descriptors (starting from GD_TSS0) are initialized
         // in trap_init_percpu()
         [GD_TSS0 >> 3] = SEG_NULL,
 
-        [8] = SEG_NULL //last 8 bytes of the tss since tss is 16 bytes long
+        [9] = SEG_NULL //last 8 bytes of the tss since tss is 16 bytes long
 };
 
 struct Pseudodesc gdt_pd = {
@@ -102,6 +117,10 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm) {
   // to ensure that the envid is not stale
   // (i.e., does not refer to a _previous_ environment
   // that used the same slot in the envs[] array).
+  if (ENVX(envid) >= nenvs) {
+    *env_store = 0;
+    return -E_BAD_ENV;
+  }
   e = &envs[ENVX(envid)];
   if (e->env_status == ENV_FREE || e->env_id != envid) {
     *env_store = 0;
@@ -122,38 +141,87 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm) {
   return 0;
 }
 
-// Mark all environments in 'envs' as free, set their env_ids to 0,
-// and insert them into the env_free_list.
-// Make sure the environments are in the free list in the same order
-// they are in the envs array (i.e., so that the first call to
-// env_alloc() returns envs[0]).
+// Add up to ENV_GROW slots to the envs array, mapping fresh pages both
+// at KENVS (where the kernel's 'envs' points) and read-only at UENVS in
+// place of the zero page.  The new slots are put on the env_free_list
+// in the order they are in the array.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if the array already holds NENV envs
+//	-E_NO_MEM on memory exhaustion
+static int
+env_table_grow(void) {
+  size_t mapped = ROUNDUP(nenvs * sizeof(struct Env), PGSIZE);
+  size_t want   = MIN(nenvs + ENV_GROW, (size_t)NENV);
+  size_t n;
+
+  if (nenvs == NENV)
+    return -E_NO_FREE_ENV;
+
+#ifndef CONFIG_KSPACE
+  while (mapped < want * sizeof(struct Env)) {
+    struct PageInfo *pp = page_alloc(ALLOC_ZERO);
+    pte_t *pte;
+
+    if (!pp)
+      break;
+    if (page_insert(kern_pml4e, pp, (void *)(KENVS + mapped), PTE_W) < 0) {
+      page_free(pp);
+      break;
+    }
+    // mem_init() mapped the zero page here without taking a reference.
+    pte  = pml4e_walk(kern_pml4e, (void *)(UENVS + mapped), 0);
+    *pte = page2pa(pp) | PTE_U | PTE_P;
+    pp->pp_ref++;
+    invlpg((void *)(UENVS + mapped));
+    mapped += PGSIZE;
+  }
+  want = MIN(want, mapped / sizeof(struct Env));
+  if (want == nenvs)
+    return -E_NO_MEM;
+#endif
+
+  for (n = want; n > nenvs; n--) {
+    envs[n - 1].env_status = ENV_FREE;
+    envs[n - 1].env_id     = 0;
+    envs[n - 1].env_link   = env_free_list;
+    env_free_list          = &envs[n - 1];
+  }
+  nenvs = want;
+  return 0;
+}
+
+// Set up the first slots of the envs array and insert them into the
+// env_free_list, in the order they are in the array (i.e., so that the
+// first call to env_alloc() returns envs[0]).
 //
 void
 env_init(void) {
   // Set up envs array
-    
+
   // LAB 3 code
   env_free_list = NULL; // NULLing new env_list
-  for (int i = NENV - 1; i >= 0; i--) {
-    // initialization in for loop every new environment till max env met
-    envs[i].env_status = ENV_FREE;
-    envs[i].env_link = env_free_list;
-    envs[i].env_id   = 0;
-    env_free_list    = &envs[i];
-  }
+  nenvs         = 0;
+  if (env_table_grow() < 0)
+    panic("env_init: no memory for envs");
   env_init_percpu();
   // LAB 3 code end
-    
+
 }
 
 // Load GDT and segment descriptors.
 void
 env_init_percpu(void) {
+  // Loading GS resets its base, which points to the per-CPU data
+  // of this CPU (see percpu_init()).
+  uint64_t gs_base = rdmsr(MSR_GS_BASE);
+
   lgdt(&gdt_pd);
-  // The kernel never uses GS or FS, so we leave those set to
-  // the user data segment.
+  // The kernel only uses GS through its base, so we leave GS and FS
+  // set to the user data segment.
   asm volatile("movw %%ax,%%gs" ::"a"(GD_UD | 3));
   asm volatile("movw %%ax,%%fs" ::"a"(GD_UD | 3));
+  wrmsr(MSR_GS_BASE, gs_base);
   // The kernel does use ES, DS, and SS.  We'll change between
   // the kernel and user data segments as needed.
   asm volatile("movw %%ax,%%es" ::"a"(GD_KD));
@@ -209,12 +277,33 @@ env_setup_vm(struct Env *e) {
   e->env_cr3 = page2pa(p);
 
   e->env_pml4e[1] = kern_pml4e[1];
-  pa2page(PTE_ADDR(kern_pml4e[1]))->pp_ref++;
+  page_incref(pa2page(PTE_ADDR(kern_pml4e[1])));
 
   e->env_pml4e[2] = e->env_cr3 | PTE_P | PTE_U;
   return 0;
 }
 
+// Give 'e' a kernel stack, unless its envs[] slot has one already,
+// and point env_tf at its top.  The pages stay with the slot when the
+// env is freed, since CPUs may still have them mapped (see
+// env_kstack_map()).
+static int
+env_kstack_alloc(struct Env *e) {
+  struct PageInfo *pp;
+
+  for (int i = 0; i < ENV_KSTKSIZE / PGSIZE; i++) {
+    if (e->env_kstack[i])
+      continue;
+    if (!(pp = page_alloc(0)))
+      return -E_NO_MEM;
+    page_incref(pp);
+    e->env_kstack[i] = pp;
+  }
+  pp        = e->env_kstack[ENV_KSTKSIZE / PGSIZE - 1];
+  e->env_tf = (struct Trapframe *)((uint8_t *)page2kva(pp) + PGSIZE) - 1;
+  return 0;
+}
+
 //
 // Allocates and initializes a new environment.
 // On success, the new environment is stored in *newenv_store.
@@ -229,13 +318,23 @@ env_alloc(struct Env **newenv_store, envid_t parent_id) {
   int r;
   struct Env *e;
 
-  if (!(e = env_free_list)) {
-    return -E_NO_FREE_ENV;
+  spin_lock(&env_lock);
+  if (!env_free_list && (r = env_table_grow()) < 0) {
+    spin_unlock(&env_lock);
+    return r;
   }
+  e             = env_free_list;
+  env_free_list = e->env_link;
+  spin_unlock(&env_lock);
 
   // Allocate and set up the page directory for this environment.
-  if ((r = env_setup_vm(e)) < 0)
+  if ((r = env_kstack_alloc(e)) < 0 || (r = env_setup_vm(e)) < 0) {
+    spin_lock(&env_lock);
+    e->env_link   = env_free_list;
+    env_free_list = e;
+    spin_unlock(&env_lock);
     return r;
+  }
 
   // Generate an env_id for this environment.
   generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
@@ -250,14 +349,40 @@ env_alloc(struct Env **newenv_store, envid_t parent_id) {
 #else
   e->env_type      = ENV_TYPE_USER;
 #endif
-  e->env_status = ENV_RUNNABLE;
+  // Not runnable until the caller has loaded its code, see env_create().
+  e->env_status = ENV_NOT_RUNNABLE;
   e->env_runs   = 0;
 
+  // New environments start at the most important level.
+  e->env_priority    = 0;
+  e->env_sched_level = 0;
+  e->env_slice_ticks = 0;
+  e->env_sched_class = SCHED_MLFQ;
+  e->env_exec_start  = 0;
+  e->env_last_ran    = 0;
+  e->env_cpu         = sched_select_cpu();
+  e->env_last_cpu    = -1;
+  e->env_sleeping    = 0;
+  e->env_sum_exec    = 0;
+  e->env_vruntime    = 0;
+  e->env_dl_runtime   = 0;
+  e->env_dl_period    = 0;
+  e->env_dl_throttled = 0;
+  e->env_ipc_recving  = 0;
+  e->env_ipc_target   = NULL;
+  e->env_ipc_senders  = NULL;
+  e->env_ipc_perm     = 0;
+  e->env_futex_waiting = 0;
+  e->env_systrace      = 0;
+  e->env_sysring       = NULL;
+  e->env_fpu_used      = 0;
+  e->env_fpu_cpu       = -1;
+
   // Clear out all the saved register state,
   // to prevent the register values
   // of a prior environment inhabiting this Env structure
   // from "leaking" into our new environment.
-  memset(&e->env_tf, 0, sizeof(e->env_tf));
+  memset(e->env_tf, 0, sizeof(*e->env_tf));
 
   // Set up appropriate initial values for the segment registers.
   // GD_UD is the user data (KD - kernel data) segment selector in the GDT, and
@@ -268,30 +393,28 @@ env_alloc(struct Env **newenv_store, envid_t parent_id) {
   // checks involving the RPL and the Descriptor Privilege Level
   // (DPL) stored in the descriptors themselves.
 #ifdef CONFIG_KSPACE
-  e->env_tf.tf_ds = GD_KD | 0;
-  e->env_tf.tf_es = GD_KD | 0;
-  e->env_tf.tf_ss = GD_KD | 0;
-  e->env_tf.tf_cs = GD_KT | 0;
+  e->env_tf->tf_ds = GD_KD | 0;
+  e->env_tf->tf_es = GD_KD | 0;
+  e->env_tf->tf_ss = GD_KD | 0;
+  e->env_tf->tf_cs = GD_KT | 0;
 
   // LAB 3 code
   static int STACK_TOP = 0x2000000;
-  e->env_tf.tf_rsp = STACK_TOP - (e - envs) * 2 * PGSIZE;
+  e->env_tf->tf_rsp = STACK_TOP - (e - envs) * 2 * PGSIZE;
   // LAB 3 code end
     
 #else
-  e->env_tf.tf_ds  = GD_UD | 3;
-  e->env_tf.tf_es  = GD_UD | 3;
-  e->env_tf.tf_ss  = GD_UD | 3;
-  e->env_tf.tf_rsp = USTACKTOP;
-  e->env_tf.tf_cs  = GD_UT | 3;
+  e->env_tf->tf_ds  = GD_UD | 3;
+  e->env_tf->tf_es  = GD_UD | 3;
+  e->env_tf->tf_ss  = GD_UD | 3;
+  e->env_tf->tf_rsp = USTACKTOP;
+  e->env_tf->tf_cs  = GD_UT | 3;
 #endif
 
-  e->env_tf.tf_rflags |= FL_IF;
+  e->env_tf->tf_rflags |= FL_IF;
 
-  // You will set e->env_tf.tf_rip later.
+  // You will set e->env_tf->tf_rip later.
 
-  // commit the allocation
-  env_free_list = e->env_link;
   *newenv_store = e;
 
   cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
@@ -304,9 +427,10 @@ env_alloc(struct Env **newenv_store, envid_t parent_id) {
 // and map it at virtual address va in the environment's address space.
 // Does not zero or otherwise initialize the mapped pages in any way.
 // Pages should be writable by user and kernel.
-// Panic if any allocation attempt fails.
+// Returns -E_NO_MEM if any allocation attempt fails; the pages mapped
+// so far are freed with the environment.
 //
-static void
+static int
 region_alloc(struct Env *e, void *va, size_t len) {
   // (But only if you need it for load_icode.)
   //
@@ -321,10 +445,15 @@ region_alloc(struct Env *e, void *va, size_t len) {
 	struct PageInfo *pi;
 
 	while (va < end) {
-    pi = page_alloc(0);
-    page_insert(e->env_pml4e, pi, va, PTE_U | PTE_W);
+    if (!(pi = page_alloc(0)))
+      return -E_NO_MEM;
+    if (page_insert(e->env_pml4e, pi, va, PTE_U | PTE_W) < 0) {
+      page_free(pi);
+      return -E_NO_MEM;
+    }
     va += PGSIZE;
   }
+  return 0;
 }
 
 #ifdef SANITIZE_USER_SHADOW_BASE
@@ -409,8 +538,6 @@ bind_functions(struct Env *e, uint8_t *binary) {
 //
 // Set up the initial program binary, stack, and processor flags
 // for a user process.
-// This function is ONLY called during kernel initialization,
-// before running the first environment.
 //
 // This function loads all loadable segments from the ELF binary image
 // into the environment's user memory, starting at the appropriate
@@ -425,10 +552,11 @@ bind_functions(struct Env *e, uint8_t *binary) {
 //
 // Finally, this function maps one page for the program's initial stack.
 //
-// load_icode panics if it encounters problems.
-//  - How might load_icode fail?  What might be wrong with the given input?
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVALID_EXE if binary is not an ELF image.
+//	-E_NO_MEM on memory exhaustion.
 //
-static void
+static int
 load_icode(struct Env *e, uint8_t *binary) {
   // Hints:
   //  Load each program segment into memory
@@ -461,9 +589,11 @@ load_icode(struct Env *e, uint8_t *binary) {
   // LAB 3 code, modified in LAB 8
   // из чего состоит Elf и Proghdr смотри в Elf64.h. Elf - это структура выполняемого фаила
   struct Elf *elf = (struct Elf *)binary; // binary приодится к типу указателя на структуру ELF
-  if (elf->e_magic != ELF_MAGIC) {
-    panic("Unexpected ELF format! What magic is this?\n");
-  }
+  physaddr_t cr3  = rcr3();
+  int r;
+
+  if (elf->e_magic != ELF_MAGIC)
+    return -E_INVALID_EXE;
 
   struct Proghdr *ph = (struct Proghdr *)(binary + elf->e_phoff); // Proghdr = prog header. Он лежит со смещением elf->e_phoff относительно начала фаила
 
@@ -477,31 +607,70 @@ load_icode(struct Env *e, uint8_t *binary) {
       size_t memsz  = ph[i].p_memsz;
       size_t filesz = MIN(ph[i].p_filesz, memsz);
 
-      region_alloc(e, (void*) dst, memsz);
+      if ((r = region_alloc(e, (void *)dst, memsz)) < 0) {
+        lcr3(cr3);
+        return r;
+      }
 
       memcpy(dst, src, filesz);                // копируем в dst <- src  размера filesz
       memset(dst + filesz, 0, memsz - filesz); // обнуление памяти по адресу dst + filesz, где количество нулей = memsz - filesz. Т.е. зануляем всю выделенную память сегмента кода, оставшуюяся после копирования src. Возможно, эта строка не нужна
     }
   }
 
-  lcr3(PADDR(kern_pml4e));
-  e->env_tf.tf_rip = elf->e_entry; //Виртуальный адрес точки входа, которому система передает управление при запуске процесса. в регистр rip записываем адрес точки входа для выполнения процесса
+  // Back to the address space of the caller, which may be a system call.
+  lcr3(cr3);
+  e->env_tf->tf_rip = elf->e_entry; //Виртуальный адрес точки входа, которому система передает управление при запуске процесса. в регистр rip записываем адрес точки входа для выполнения процесса
 #ifdef CONFIG_KSPACE
   bind_functions(e, binary); // Вызывается bind_functions, который связывает все что мы сделали выше (инициализация среды) с "кодом" самого процесса
 #endif
   // LAB 3 code end
 
   // LAB 8 code
-  region_alloc(e, (void *) (USTACKTOP - USTACKSIZE), USTACKSIZE);
+  if ((r = region_alloc(e, (void *)(USTACKTOP - USTACKSIZE), USTACKSIZE)) < 0)
+    return r;
   // LAB 8 code end
 
 #ifdef SANITIZE_USER_SHADOW_BASE
-  region_alloc(e, (void*) SANITIZE_USER_SHADOW_BASE, SANITIZE_USER_SHADOW_SIZE);
-  region_alloc(e, (void*) SANITIZE_USER_EXTRA_SHADOW_BASE, SANITIZE_USER_EXTRA_SHADOW_SIZE);
-  region_alloc(e, (void*) SANITIZE_USER_FS_SHADOW_BASE, SANITIZE_USER_FS_SHADOW_SIZE);
-  region_alloc(e, (void*) SANITIZE_USER_STACK_SHADOW_BASE, SANITIZE_USER_STACK_SHADOW_SIZE);
-  region_alloc(e, (void*) SANITIZE_USER_VPT_SHADOW_BASE, SANITIZE_USER_VPT_SHADOW_SIZE);
+  if ((r = region_alloc(e, (void *)SANITIZE_USER_SHADOW_BASE, SANITIZE_USER_SHADOW_SIZE)) < 0 ||
+      (r = region_alloc(e, (void *)SANITIZE_USER_EXTRA_SHADOW_BASE, SANITIZE_USER_EXTRA_SHADOW_SIZE)) < 0 ||
+      (r = region_alloc(e, (void *)SANITIZE_USER_FS_SHADOW_BASE, SANITIZE_USER_FS_SHADOW_SIZE)) < 0 ||
+      (r = region_alloc(e, (void *)SANITIZE_USER_STACK_SHADOW_BASE, SANITIZE_USER_STACK_SHADOW_SIZE)) < 0 ||
+      (r = region_alloc(e, (void *)SANITIZE_USER_VPT_SHADOW_BASE, SANITIZE_USER_VPT_SHADOW_SIZE)) < 0)
+    return r;
 #endif
+  return 0;
+}
+
+// Returns the ELF image of the user program 'name' embedded in the
+// kernel (see env_binaries[]), or NULL if there is none.
+uint8_t *
+env_binary(const char *name) {
+  for (const struct EnvBinary *b = env_binaries; b->name; b++)
+    if (!strcmp(b->name, name))
+      return b->start;
+  return NULL;
+}
+
+//
+// Allocates a new env with parent 'parent_id' and loads the ELF image
+// 'binary' into it.  The env is left ENV_NOT_RUNNABLE, for the caller
+// to finish setting it up.
+//
+// Returns 0 on success, < 0 on error, see env_alloc() and load_icode().
+//
+int
+env_load(struct Env **newenv_store, uint8_t *binary, envid_t parent_id) {
+  struct Env *e;
+  int r;
+
+  if ((r = env_alloc(&e, parent_id)) < 0)
+    return r;
+  if ((r = load_icode(e, binary)) < 0) {
+    env_free(e);
+    return r;
+  }
+  *newenv_store = e;
+  return 0;
 }
 
 //
@@ -516,23 +685,23 @@ env_create(uint8_t *binary, enum EnvType type) {
     
   // LAB 3 code
   struct Env *newenv;
-  if (env_alloc(&newenv, 0) < 0) {
-    panic("Can't allocate new environment");  // попытка выделить среду – если нет – вылет по панике ядра
-  }
-      
-  newenv->env_type = type;
+  int r;
 
-  load_icode(newenv, binary); // load instruction code
+  if ((r = env_load(&newenv, binary, 0)) < 0)
+    panic("env_create: %i", r);
+  newenv->env_type = type;
   // LAB 3 code end
+
+  sched_wakeup(newenv);
     
 }
 
-//
-// Frees env e and all memory it uses.
-//
-void
-env_free(struct Env *e) {
 #ifndef CONFIG_KSPACE
+// Free the user part of the address space with page map level 4
+// 'pml4e', and the PML4 itself.  No CPU may be using it.
+static void
+env_free_vm(void *pml4e_) {
+  pml4e_t *pml4e = pml4e_;
   pdpe_t *pdpe;
   pde_t *pgdir;
   pte_t *pt;
@@ -540,22 +709,11 @@ env_free(struct Env *e) {
   uint64_t pdeno, pteno, pdpeno;
   physaddr_t pa;
 
-  // If freeing the current environment, switch to kern_pgdir
-  // before freeing the page directory, just in case the page
-  // gets reused.
-  if (e == curenv)
-    lcr3(kern_cr3);
-#endif
-
-  // Note the environment's demise.
-  cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
-
-#ifndef CONFIG_KSPACE
   // Flush all mapped pages in the user portion of the address space
   static_assert(UTOP % PTSIZE == 0, "Misaligned UTOP");
 
   //UTOP < PDPE[1] start, so all mapped memory should be in first PDPE
-  pdpe = KADDR(PTE_ADDR(e->env_pml4e[0]));
+  pdpe = KADDR(PTE_ADDR(pml4e[0]));
   for (pdpeno = 0; pdpeno <= PDPE(UTOP); pdpeno++) {
     // only look at mapped page directory pointer index
     if (!(pdpe[pdpeno] & PTE_P))
@@ -576,8 +734,8 @@ env_free(struct Env *e) {
       // unmap all PTEs in this page table
       for (pteno = 0; pteno <= PTX(~0); pteno++) {
         if (pt[pteno] & PTE_P)
-          page_remove(e->env_pml4e, PGADDR((uint64_t)0,
-                                           pdpeno, pdeno, pteno, 0));
+          page_remove(pml4e, PGADDR((uint64_t)0,
+                                    pdpeno, pdeno, pteno, 0));
       }
 
       // free the page table itself
@@ -591,40 +749,114 @@ env_free(struct Env *e) {
     page_decref(pa2page(pa));
   }
   // free the page directory pointer
-  page_decref(pa2page(PTE_ADDR(e->env_pml4e[0])));
+  page_decref(pa2page(PTE_ADDR(pml4e[0])));
   // free the page map level 4 (PML4)
-  e->env_pml4e[0] = 0;
-  pa              = e->env_cr3;
-  e->env_pml4e    = 0;
-  e->env_cr3      = 0;
-  page_decref(pa2page(pa));
+  pml4e[0] = 0;
+  page_decref(pa2page(PADDR(pml4e)));
+}
 #endif
+
+//
+// Frees env e and all memory it uses.
+//
+void
+env_free(struct Env *e) {
+  int cpu;
+#ifndef CONFIG_KSPACE
+  pml4e_t *pml4e;
+
+  // If freeing the current environment, switch to kern_pgdir
+  // before freeing the page directory, just in case the page
+  // gets reused.
+  if (e == curenv)
+    lcr3(kern_cr3);
+#endif
+
+  // Note the environment's demise.
+  cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
+
+#ifndef CONFIG_KSPACE
+  // The address space is no one's from now on: leave tearing it down,
+  // which takes a while for large ones, to a kernel worker.
+  pml4e        = e->env_pml4e;
+  e->env_pml4e = 0;
+  e->env_cr3   = 0;
+  if (queue_work(env_free_vm, pml4e) < 0)
+    env_free_vm(pml4e);
+#endif
+  if (e->env_sysring) {
+    page_decref(e->env_sysring);
+    e->env_sysring = NULL;
+  }
+
   // return the environment to the free list
+  fpu_exit(e);
+  futex_exit(e);
+  spin_lock(&env_lock);
+  ipc_exit(e);
+  cpu = sched_lock_env(e);
+  sched_exit(e);
   e->env_status = ENV_FREE;
+  sched_unlock_cpu(cpu);
   e->env_link   = env_free_list;
   env_free_list = e;
+  spin_unlock(&env_lock);
 }
 
-//
-// Frees environment e.
-// If e was the current env, then runs a new environment (and does not return
-// to the caller).
-//
-void
-env_destroy(struct Env *e) {
+// The body of env_destroy(), called with the lock of the run queue
+// of CPU 'cpu', which 'e' belongs to, held.  Releases it.
+static void
+env_destroy_locked(struct Env *e, int cpu) {
   // If e is currently running on other CPUs, we change its state to
   // ENV_DYING. A zombie environment will be freed the next time
   // it traps to the kernel.
     
   // LAB 3 code
+  if (e->env_status == ENV_FREE ||
+      ((e->env_status == ENV_RUNNING || e->env_status == ENV_DYING) &&
+       curenv != e)) {
+    if (e->env_status != ENV_FREE)
+      e->env_status = ENV_DYING;
+    sched_unlock_cpu(cpu);
+    return;
+  }
+
   e->env_status = ENV_DYING;
-  if (e == curenv) {
-    env_free(e);
+  sched_dequeue(e);
+  sched_unlock_cpu(cpu);
+  // We run on the kernel stack of the current env: let sched_yield()
+  // free it from the stack of the CPU.
+  if (e == curenv)
     sched_yield();
-  }
+  env_free(e);
   // LAB 3 code end
 }
 
+//
+// Frees environment e.
+// If e was the current env, then runs a new environment (and does not return
+// to the caller).
+//
+void
+env_destroy(struct Env *e) {
+  env_destroy_locked(e, sched_lock_env(e));
+}
+
+// Same as env_destroy(), for 'e' as envid2env() found it for 'envid'
+// without a lock held.
+//
+// Returns 0 on success, or -E_BAD_ENV if 'e' was freed (and maybe
+// reused for another environment) since.
+int
+env_destroy_id(struct Env *e, envid_t envid) {
+  int cpu;
+
+  if ((cpu = sched_lock_envid(e, envid)) < 0)
+    return cpu;
+  env_destroy_locked(e, cpu);
+  return 0;
+}
+
 #ifdef CONFIG_KSPACE
 void
 csys_exit(void) {
@@ -633,7 +865,7 @@ csys_exit(void) {
 
 void
 csys_yield(struct Trapframe *tf) {
-  memcpy(&curenv->env_tf, tf, sizeof(struct Trapframe));
+  memcpy(curenv->env_tf, tf, sizeof(struct Trapframe));
   sched_yield();
 }
 #endif
@@ -700,7 +932,10 @@ env_pop_tf(struct Trapframe *tf) {
                    "movw 8(%%rsp),%%ds\n"
                    "addq $16,%%rsp\n"
                    "\taddq $16,%%rsp\n" /* skip tf_trapno and tf_errcode */
-                   "\tiretq"
+                   "\ttestb $3,8(%%rsp)\n" /* returning to user mode? */
+                   "\tjz 1f\n"
+                   "\tswapgs\n"
+                   "1:\tiretq"
                    :
                    : "g"(tf)
                    : "memory");
@@ -708,10 +943,97 @@ env_pop_tf(struct Trapframe *tf) {
   panic("BUG"); /* mostly to placate the compiler */
 }
 
+// Carry on with fn(arg), which must not return, on the kernel stack of
+// this CPU, dropping the stack we are on.  That may be the kernel stack
+// of an environment, which can be freed, or run and trap into the
+// kernel on another CPU, as soon as the run queue lock is released.
+void
+env_stack_call(void (*fn)(void *), void *arg) {
+  asm volatile("movq %%rcx,%%rsp\n"
+               "\txorl %%ebp,%%ebp\n"
+               "\tcall *%%rax\n"
+               :
+               : "c"(CPUSTACKTOP(cpunum())), "a"(fn), "D"(arg)
+               : "memory");
+  panic("env_stack_call: %p returned", fn);
+}
+
+#ifndef CONFIG_KSPACE
+// Map the kernel stack of 'e' at the top of the kernel stack of this
+// CPU, where traps from user mode push their frame: into e->env_tf.
+// Must not be called on that part of the stack.
+static void
+env_kstack_map(struct Env *e) {
+  uintptr_t va = KSTACKTOP_CPU(cpunum()) - ENV_KSTKSIZE;
+  pte_t *pte   = this_cpu.cpu_kstack_pte;
+
+  // The first time, turn the page below into a guard.
+  if (!this_cpu.cpu_kstack_env) {
+    *pml4e_walk(kern_pml4e, (void *)(va - PGSIZE), 0) = 0;
+    invlpg((void *)(va - PGSIZE));
+  }
+
+  for (int i = 0; i < ENV_KSTKSIZE / PGSIZE; i++) {
+    pte[i] = page2pa(e->env_kstack[i]) | PTE_W | PTE_P;
+    invlpg((void *)(va + i * PGSIZE));
+  }
+  this_cpu.cpu_kstack_env = e;
+}
+
+static void
+env_run_remap(void *e) {
+  env_kstack_map(e);
+  env_run(e);
+}
+#endif
+
+// Make 'e' the current environment of this CPU and release the lock of
+// its run queue, on the way to entering it.  See env_run().
+static void
+env_switch(struct Env *e) {
+  // LAB 3 code
+  // A zombie curenv has already been freed by sched_yield().
+  assert(sched_holding_this() && e->env_cpu == cpunum());
+  if (curenv && curenv != e)
+    fpu_save();
+  if (curenv) {  // if curenv == False, значит, какого-нибудь исполняемого процесса нет
+    if (curenv->env_status == ENV_RUNNING && curenv != e) { // если процесс можем запустить
+      curenv->env_status = ENV_RUNNABLE;  // запускаем процесс
+      sched_enqueue(curenv); // back to the tail of its run queue
+    }
+  }
+
+  sched_dequeue(e);
+  e->env_last_cpu = e->env_cpu;
+  curenv = e;  // текущая среда – е
+  curenv->env_status = ENV_RUNNING; // устанавливаем статус среды на "выполняется"
+  curenv->env_runs++; // обновляем количество работающих контекстов
+
+  // LAB 8 code
+  // Reloading the same cr3 would only flush the TLB for nothing.  A
+  // CPU only keeps the cr3 of an env that is still alive: env_free(),
+  // sched_block() and sched_halt() load kern_cr3 before the page
+  // tables can be freed, so an equal cr3 can't be a reused PML4 page
+  // with stale TLB entries.
+  if (rcr3() != curenv->env_cr3)
+    lcr3(curenv->env_cr3);
+  // LAB 8 code end
+
+  sched_set_curr(curenv);
+  fpu_switch(curenv);
+
+  // Start charging CPU time to the env, see sched_update_curr()
+  curenv->env_exec_start = read_tsc();
+
+  sched_unlock_this();
+}
+
 //
 // Context switch from curenv to env e.
 // Note: if this is the first call to env_run, curenv is NULL.
 //
+// Called with the run queue lock of this CPU, which 'e' belongs to,
+// held; it is released right before entering the environment.
 // This function does not return.
 //
 void
@@ -740,30 +1062,55 @@ env_run(struct Env *e) {
   //	e->env_tf to sensible values.
   //
     
-  // LAB 3 code
-  if (curenv) {  // if curenv == False, значит, какого-нибудь исполняемого процесса нет
-    if (curenv->env_status == ENV_DYING) { // если процесс стал зомби
-      struct Env *old = curenv;  // ставим старый адрес
-      env_free(curenv);  // самурай запятнал свой env – убираем его в ножны дабы стереть кровь
-      if (old == e) { // e - аргумент функции, который к нам пришел
-        sched_yield();  // переключение системными вызовами
-      }
-    } else if (curenv->env_status == ENV_RUNNING) { // если процесс можем запустить
-      curenv->env_status = ENV_RUNNABLE;  // запускаем процесс
-    }
-  }
-      
-  curenv = e;  // текущая среда – е
-  curenv->env_status = ENV_RUNNING; // устанавливаем статус среды на "выполняется"
-  curenv->env_runs++; // обновляем количество работающих контекстов
+#ifndef CONFIG_KSPACE
+  // Map the kernel stack of 'e' first if need be, which can only be
+  // done on the stack of the CPU.
+  if (this_cpu.cpu_kstack_env != e)
+    env_stack_call(env_run_remap, e);
+#endif
 
-  // LAB 8 code
-  lcr3(curenv->env_cr3);
-  // LAB 8 code end
+  env_switch(e);
 
   // LAB 3 code
-  env_pop_tf(&curenv->env_tf);
+  env_pop_tf(curenv->env_tf);
   // LAB 3 code end
 
   while(1) {}
 }
+
+#ifndef CONFIG_KSPACE
+//
+// Like env_pop_tf(), but returns with sysretq, for a Trapframe saved
+// by syscall_entry.  sysretq takes RIP from %rcx and RFLAGS from %r11,
+// so the values of those two in the Trapframe are lost.
+//
+static void __attribute__((noreturn))
+env_pop_tf_sysret(struct Trapframe *tf) {
+  __asm __volatile("movq %0,%%rsp\n" POPA
+                   "\tmovq 32(%%rsp),%%rcx\n" /* tf_rip */
+                   "\tmovq 48(%%rsp),%%r11\n" /* tf_rflags */
+                   "\tmovq 56(%%rsp),%%rsp\n" /* tf_rsp */
+                   "\tswapgs\n"
+                   "\tsysretq"
+                   :
+                   : "g"(tf)
+                   : "memory");
+  __builtin_unreachable();
+}
+
+//
+// Return to 'e', which entered the kernel with the syscall
+// instruction and still has the CPU.  Called with the run queue lock
+// of this CPU held.
+//
+void
+env_run_sysret(struct Env *e) {
+  env_switch(e);
+
+  // sysretq would fault in kernel mode, on the user stack, with a
+  // non-canonical RIP.  Let iretq deal with anything but user text.
+  if (e->env_tf->tf_rip < UTOP && e->env_tf->tf_cs == (GD_UT | 3))
+    env_pop_tf_sysret(e->env_tf);
+  env_pop_tf(e->env_tf);
+}
+#endif
@@ -7,7 +7,8 @@
 #include <kern/cpu.h>
 
 extern struct Env *envs; // All environments
-extern struct Env *curenv;
+extern size_t nenvs;     // Number of slots in envs[]
+#define curenv (this_cpu.cpu_env) // Current env
 extern struct Segdesc gdt[];
 
 void env_init(void);
@@ -15,11 +16,16 @@ void env_init_percpu(void);
 int env_alloc(struct Env **e, envid_t parent_id);
 void env_free(struct Env *e);
 void env_create(uint8_t *binary, enum EnvType type);
+int env_load(struct Env **newenv_store, uint8_t *binary, envid_t parent_id);
+uint8_t *env_binary(const char *name);
 void env_destroy(struct Env *e); // Does not return if e == curenv
+int env_destroy_id(struct Env *e, envid_t envid);
 
 int envid2env(envid_t envid, struct Env **env_store, bool checkperm);
-// The following two functions do not return
+// The following functions do not return
 void env_run(struct Env *e) __attribute__((noreturn));
+void env_run_sysret(struct Env *e) __attribute__((noreturn));
+void env_stack_call(void (*fn)(void *), void *arg) __attribute__((noreturn));
 void env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
 
 static inline int
@@ -32,6 +38,16 @@ extern void sys_exit(void);
 extern void sys_yield(void);
 #endif
 
+// A program image embedded in the kernel, see env_binary().
+struct EnvBinary {
+  const char *name; // File name, e.g. "hello" for user/hello
+  uint8_t *start;
+  uint8_t *end;
+};
+
+// Generated by kern/Makefrag, ends with a NULL name.
+extern const struct EnvBinary env_binaries[];
+
 // Without this extra macro, we couldn't pass macros like TEST to
 // ENV_CREATE because of the C pre-processor's argument prescan rule.
 #define ENV_PASTE3(x, y, z) x##y##z
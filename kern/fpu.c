@@ -0,0 +1,184 @@
+// Lazy switching of the FPU, SSE and AVX registers.
+//
+// The kernel never uses these registers itself (it is built with
+// -mno-sse), so they only ever hold the state of one environment,
+// this_cpu.cpu_fpu_env.  Environments run with CR0.TS set unless the
+// registers hold their state: the first FPU or vector instruction
+// traps with #NM, and fpu_trap() then loads the state of the
+// environment, giving it a fresh one the first time.  Environments
+// that never use the FPU never pay for it.
+//
+// When an environment that may have changed its registers leaves a CPU
+// (fpu_save(), with the run queue lock of the CPU held, so before it
+// can run on another CPU) they are saved with XSAVEOPT, which skips the parts unchanged
+// since the last restore.  If it comes back to the same CPU and no one
+// else has loaded their state there since, fpu_switch() just clears
+// TS: no trap and no restore.
+//
+// The save areas hold what is enabled in XCR0, the x87, SSE and AVX
+// state as far as the CPU has them, sized from CPUID leaf 0xD.  CPUs
+// without XSAVE fall back to FXSAVE, x87 and SSE only.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/x86.h>
+#include <kern/env.h>
+#include <kern/fpu.h>
+#include <kern/pmap.h>
+
+#define CPUID_1_EDX_FXSR       (1 << 24)
+#define CPUID_1_ECX_XSAVE      (1 << 26)
+#define CPUID_D_1_EAX_XSAVEOPT (1 << 0)
+
+// State components of XCR0
+#define XFEATURE_X87 (1 << 0)
+#define XFEATURE_SSE (1 << 1)
+#define XFEATURE_AVX (1 << 2)
+
+// Initial control words, in the legacy part of a save area
+#define FPU_FCW_INIT   0x037f
+#define FPU_MXCSR_INIT 0x1f80
+
+struct FxsaveHeader {
+  uint16_t fcw;
+  uint16_t fsw;
+  uint8_t ftw;
+  uint8_t reserved;
+  uint16_t fop;
+  uint64_t fip;
+  uint64_t fdp;
+  uint32_t mxcsr;
+  uint32_t mxcsr_mask;
+};
+
+static bool fpu_xsave;    // XSAVE/XRSTOR, rather than FXSAVE/FXRSTOR
+static bool fpu_xsaveopt; // XSAVEOPT
+static uint32_t fpu_size; // Bytes of a save area
+
+static inline void
+stts(void) {
+  lcr0(rcr0() | CR0_TS);
+}
+
+// Enable the FPU and vector registers on this CPU, and trap their
+// first use by an environment.
+void
+fpu_init_percpu(void) {
+  uint32_t eax, ebx, ecx, edx;
+  uint64_t xfeatures;
+
+  cpuid(1, NULL, NULL, &ecx, &edx);
+  if (!(edx & CPUID_1_EDX_FXSR))
+    panic("fpu_init_percpu: no FXSAVE");
+  lcr4(rcr4() | CR4_OSFXSR | CR4_OSXMMEXCPT |
+       (ecx & CPUID_1_ECX_XSAVE ? CR4_OSXSAVE : 0));
+
+  fpu_size = 512;
+  if (ecx & CPUID_1_ECX_XSAVE) {
+    cpuid_count(0xD, 0, &eax, NULL, NULL, NULL);
+    xfeatures = eax & (XFEATURE_X87 | XFEATURE_SSE | XFEATURE_AVX);
+    xsetbv(0, xfeatures);
+    // EBX is the size needed for what XCR0 enables now.
+    cpuid_count(0xD, 0, NULL, &ebx, NULL, NULL);
+    cpuid_count(0xD, 1, &eax, NULL, NULL, NULL);
+    fpu_xsave    = 1;
+    fpu_xsaveopt = eax & CPUID_D_1_EAX_XSAVEOPT;
+    fpu_size     = ebx;
+  }
+  assert(fpu_size <= PGSIZE);
+
+  lcr0((rcr0() | CR0_MP | CR0_TS) & ~CR0_EM);
+  this_cpu.cpu_fpu_env = NULL;
+}
+
+static void
+fpu_save_area(void *area) {
+  if (fpu_xsaveopt)
+    asm volatile("xsaveopt64 (%0)" ::"r"(area), "a"(-1), "d"(-1) : "memory");
+  else if (fpu_xsave)
+    asm volatile("xsave64 (%0)" ::"r"(area), "a"(-1), "d"(-1) : "memory");
+  else
+    asm volatile("fxsave64 (%0)" ::"r"(area) : "memory");
+}
+
+static void
+fpu_restore_area(void *area) {
+  if (fpu_xsave)
+    asm volatile("xrstor64 (%0)" ::"r"(area), "a"(-1), "d"(-1) : "memory");
+  else
+    asm volatile("fxrstor64 (%0)" ::"r"(area) : "memory");
+}
+
+// Handle #NM: curenv used the FPU with CR0.TS set.  The registers hold
+// some other state, already saved by fpu_save(), if any.
+void
+fpu_trap(void) {
+  struct Env *e = curenv;
+  struct PageInfo *pp;
+  struct FxsaveHeader *fx;
+
+  // The save area stays with the envs[] slot, like the kernel stack.
+  if (!e->env_fpu) {
+    if (!(pp = page_alloc(0))) {
+      cprintf("[%08x] no memory for the FPU state\n", e->env_id);
+      env_destroy(e);
+      return;
+    }
+    page_incref(pp);
+    e->env_fpu = pp;
+  }
+
+  // A zeroed XSAVE header puts all components in their initial state;
+  // only MXCSR is loaded from the legacy area regardless.
+  if (!e->env_fpu_used) {
+    fx = page2kva(e->env_fpu);
+    memset(fx, 0, fpu_size);
+    fx->fcw        = FPU_FCW_INIT;
+    fx->mxcsr      = FPU_MXCSR_INIT;
+    e->env_fpu_used = 1;
+  }
+
+  clts();
+  fpu_restore_area(page2kva(e->env_fpu));
+  this_cpu.cpu_fpu_env = e;
+  e->env_fpu_cpu       = cpunum();
+}
+
+// Save the FPU state of the environment leaving this CPU, if it may
+// have changed it, and trap the next use.  Called with the run queue
+// lock of this CPU held.
+void
+fpu_save(void) {
+  struct Env *e = this_cpu.cpu_fpu_env;
+
+  if (rcr0() & CR0_TS)
+    return;
+  if (e)
+    fpu_save_area(page2kva(e->env_fpu));
+  stts();
+}
+
+// Set CR0.TS for 'e', about to run on this CPU: clear unless the
+// registers hold its state.
+void
+fpu_switch(struct Env *e) {
+  bool mine = this_cpu.cpu_fpu_env == e && e->env_fpu_cpu == cpunum();
+
+  if (mine && (rcr0() & CR0_TS))
+    clts();
+  else if (!mine && !(rcr0() & CR0_TS))
+    stts();
+}
+
+// Forget the FPU state of 'e', which is being freed on this CPU.  If
+// this CPU ran it last, the registers may hold that state unsaved.
+// Other CPUs only hold saved copies, which env_alloc() marks stale for
+// the next env in the slot (env_fpu_cpu = -1).
+void
+fpu_exit(struct Env *e) {
+  if (this_cpu.cpu_fpu_env == e) {
+    this_cpu.cpu_fpu_env = NULL;
+    stts();
+  }
+}
@@ -0,0 +1,19 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_FPU_H
+#define JOS_KERN_FPU_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+
+void fpu_init_percpu(void);
+void fpu_trap(void);
+void fpu_save(void);
+void fpu_switch(struct Env *e);
+void fpu_exit(struct Env *e);
+
+#endif // !JOS_KERN_FPU_H
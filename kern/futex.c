@@ -0,0 +1,149 @@
+// Fast user-space mutexes.
+//
+// Environments sharing memory synchronize in user space and only come
+// to the kernel to sleep until a word changes (sys_futex_wait) or to
+// wake whoever sleeps on one (sys_futex_wake).  Waiters are keyed by
+// the physical address of the word, so environments that map the same
+// page at different addresses still meet, and are kept on FIFO wait
+// queues in a hash table, each bucket with its own lock.
+//
+// A waiter checks the word and queues itself under the bucket lock,
+// then takes the run queue lock of its CPU before letting the bucket
+// go, so a waker that finds it on the queue can't try to wake it
+// before it is blocked.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/memlayout.h>
+#include <kern/env.h>
+#include <kern/futex.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+
+#define FUTEX_HASH_BITS 6
+#define FUTEX_HASH_SIZE (1 << FUTEX_HASH_BITS)
+
+struct FutexBucket {
+  struct spinlock lock;
+  struct Env *head; // Waiters, linked through env_futex_next
+  struct Env *tail;
+};
+
+static struct FutexBucket futex_table[FUTEX_HASH_SIZE] = {
+    [0 ... FUTEX_HASH_SIZE - 1] = {
+        .lock = SPINLOCK_INITIALIZER(futex_bucket, LOCK_ORDER_FUTEX)}};
+
+static struct FutexBucket *
+futex_bucket(physaddr_t pa) {
+  return &futex_table[((pa >> 2) * 0x9E3779B97F4A7C15ULL) >> (64 - FUTEX_HASH_BITS)];
+}
+
+// Physical address of the futex word at 'addr' in the current
+// environment, which must be aligned and mapped for user access.
+static int
+futex_key(uint32_t *addr, physaddr_t *pa_store) {
+  struct PageInfo *pp;
+
+  if ((uintptr_t)addr % sizeof(uint32_t) ||
+      user_mem_check(curenv, addr, sizeof(uint32_t), PTE_U) < 0)
+    return -E_INVAL;
+  if (!(pp = page_lookup(curenv->env_pml4e, addr, NULL)))
+    return -E_INVAL;
+  *pa_store = page2pa(pp) + PGOFF(addr);
+  return 0;
+}
+
+static void
+futex_unlink(struct FutexBucket *b, struct Env *e) {
+  struct Env **pp, *prev = NULL;
+
+  for (pp = &b->head; *pp != e; pp = &(*pp)->env_futex_next)
+    prev = *pp;
+  *pp = e->env_futex_next;
+  if (b->tail == e)
+    b->tail = prev;
+  e->env_futex_next    = NULL;
+  e->env_futex_waiting = 0;
+}
+
+// Block the current environment until futex_wake() on 'addr', unless
+// the word at 'addr' no longer holds 'expected'.
+//
+// Returns 0 once woken up, < 0 on error.  Errors are:
+//	-E_AGAIN if the word does not hold 'expected'.
+//	-E_INVAL if addr is misaligned or not mapped for user access.
+int
+futex_wait(uint32_t *addr, uint32_t expected) {
+  struct Env *cur = curenv;
+  struct FutexBucket *b;
+  physaddr_t pa;
+  int r;
+
+  if ((r = futex_key(addr, &pa)) < 0)
+    return r;
+
+  b = futex_bucket(pa);
+  spin_lock(&b->lock);
+  // The address space of the current env is loaded.
+  if (*(volatile uint32_t *)addr != expected) {
+    spin_unlock(&b->lock);
+    return -E_AGAIN;
+  }
+
+  cur->env_futex_waiting = 1;
+  cur->env_futex_pa      = pa;
+  cur->env_futex_next    = NULL;
+  if (b->tail)
+    b->tail->env_futex_next = cur;
+  else
+    b->head = cur;
+  b->tail = cur;
+  cur->env_tf->tf_regs.reg_rax = 0;
+
+  sched_lock_this();
+  spin_unlock(&b->lock);
+  sched_block();
+}
+
+// Wake up to 'n' environments waiting on 'addr', oldest first.
+//
+// Returns the number of environments woken up, < 0 on error.  Errors are:
+//	-E_INVAL if addr is misaligned or not mapped for user access.
+int
+futex_wake(uint32_t *addr, int n) {
+  struct FutexBucket *b;
+  struct Env *e, *next;
+  physaddr_t pa;
+  int r, woken = 0;
+
+  if ((r = futex_key(addr, &pa)) < 0)
+    return r;
+
+  b = futex_bucket(pa);
+  spin_lock(&b->lock);
+  for (e = b->head; e && woken < n; e = next) {
+    next = e->env_futex_next;
+    if (e->env_futex_pa != pa)
+      continue;
+    futex_unlink(b, e);
+    sched_wakeup(e);
+    woken++;
+  }
+  spin_unlock(&b->lock);
+  return woken;
+}
+
+// Take a dying environment off its futex wait queue, if it is on one.
+void
+futex_exit(struct Env *e) {
+  struct FutexBucket *b;
+
+  if (!e->env_futex_waiting)
+    return;
+  b = futex_bucket(e->env_futex_pa);
+  spin_lock(&b->lock);
+  if (e->env_futex_waiting)
+    futex_unlink(b, e);
+  spin_unlock(&b->lock);
+}
@@ -0,0 +1,17 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_FUTEX_H
+#define JOS_KERN_FUTEX_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+
+int futex_wait(uint32_t *addr, uint32_t expected);
+int futex_wake(uint32_t *addr, int n);
+void futex_exit(struct Env *e);
+
+#endif // !JOS_KERN_FUTEX_H
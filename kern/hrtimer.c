@@ -0,0 +1,251 @@
+// High-resolution kernel timers.
+//
+// Pending timers are kept on a binary min-heap ordered by deadline,
+// so adding, rearming and cancelling a timer are O(log n) and the next
+// one to expire is always on top.  Expired timers are run from the
+// clock interrupts (see trap_dispatch()): while the scheduling timer is
+// hpet0 the HPET one-shot comparator is kept programmed for the earliest
+// deadline, otherwise timers fire on the next periodic tick of some CPU.
+// A CPU going idle without its tick wakes up for the earliest deadline
+// too, see sched_idle_enter().
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/env.h>
+#include <inc/stdio.h>
+#include <inc/x86.h>
+#include <kern/hrtimer.h>
+#include <kern/spinlock.h>
+#include <kern/timer.h>
+#include <kern/tsc.h>
+
+// Enough for a timer per environment and a few for the kernel.
+#define NHRTIMERS (NENV + 64)
+
+static struct hrtimer *hrtimer_heap[NHRTIMERS];
+static uint32_t hrtimer_count;
+
+// Deadline the one-shot comparator is programmed for, 0 if none.
+static uint64_t hrtimer_programmed;
+
+static struct {
+  uint64_t adds;        // timer_add() and timer_rearm() calls
+  uint64_t cancels;     // Pending timers cancelled
+  uint64_t expired;     // Callbacks run
+  uint64_t max_late_ns; // Worst delay of a callback past its deadline
+  uint32_t max_pending; // Most timers pending at once
+} hrtimer_stats;
+
+// Current time on the timer clock: nanoseconds of TSC since reset.
+uint64_t
+timer_now_ns(void) {
+  return tsc_to_ns(read_tsc());
+}
+
+static void
+heap_set(uint32_t i, struct hrtimer *t) {
+  hrtimer_heap[i] = t;
+  t->heap_pos     = i + 1;
+}
+
+static void
+heap_sift_up(uint32_t i) {
+  struct hrtimer *t = hrtimer_heap[i];
+
+  while (i > 0) {
+    uint32_t parent = (i - 1) / 2;
+
+    if (hrtimer_heap[parent]->deadline <= t->deadline)
+      break;
+    heap_set(i, hrtimer_heap[parent]);
+    i = parent;
+  }
+  heap_set(i, t);
+}
+
+static void
+heap_sift_down(uint32_t i) {
+  struct hrtimer *t = hrtimer_heap[i];
+
+  for (;;) {
+    uint32_t child = 2 * i + 1;
+
+    if (child >= hrtimer_count)
+      break;
+    if (child + 1 < hrtimer_count &&
+        hrtimer_heap[child + 1]->deadline < hrtimer_heap[child]->deadline)
+      child++;
+    if (t->deadline <= hrtimer_heap[child]->deadline)
+      break;
+    heap_set(i, hrtimer_heap[child]);
+    i = child;
+  }
+  heap_set(i, t);
+}
+
+// Restore the heap order around 't' after its deadline changed.
+static void
+heap_fix(struct hrtimer *t) {
+  heap_sift_up(t->heap_pos - 1);
+  heap_sift_down(t->heap_pos - 1);
+}
+
+static void
+heap_remove(struct hrtimer *t) {
+  struct hrtimer *last = hrtimer_heap[--hrtimer_count];
+  uint32_t i           = t->heap_pos - 1;
+
+  t->heap_pos = 0;
+  if (last != t) {
+    heap_set(i, last);
+    heap_fix(last);
+  }
+}
+
+// Keep the one-shot comparator programmed for the earliest deadline.
+static void
+hrtimer_program(void) {
+  uint64_t next, now;
+
+  assert(spin_holding(&hrtimer_lock));
+  if (!hpet_oneshot_enabled())
+    return;
+
+  next = hrtimer_count ? hrtimer_heap[0]->deadline : 0;
+  if (next == hrtimer_programmed)
+    return;
+  hrtimer_programmed = next;
+
+  if (next) {
+    now = timer_now_ns();
+    hpet_oneshot_start(next > now ? next - now : 0);
+  } else {
+    hpet_oneshot_stop();
+  }
+}
+
+// Queue 't' to call fn(t) once timer_now_ns() reaches 'deadline_ns'.
+// A timer that is already pending is moved to the new deadline.
+// Returns -E_NO_MEM if too many timers are pending.
+int
+timer_add(struct hrtimer *t, uint64_t deadline_ns, hrtimer_fn fn, void *arg) {
+  assert(fn);
+
+  // Claim the comparator the first time it's needed, if the
+  // scheduling timer leaves it free.
+  if (!hpet_oneshot_enabled())
+    hpet_oneshot_init();
+
+  spin_lock(&hrtimer_lock);
+  if (!t->heap_pos && hrtimer_count == NHRTIMERS) {
+    spin_unlock(&hrtimer_lock);
+    return -E_NO_MEM;
+  }
+
+  t->fn       = fn;
+  t->arg      = arg;
+  // 0 means "no deadline" to the rest of the kernel.
+  t->deadline = deadline_ns ? deadline_ns : 1;
+  if (t->heap_pos) {
+    heap_fix(t);
+  } else {
+    heap_set(hrtimer_count++, t);
+    heap_sift_up(hrtimer_count - 1);
+  }
+
+  hrtimer_stats.adds++;
+  if (hrtimer_count > hrtimer_stats.max_pending)
+    hrtimer_stats.max_pending = hrtimer_count;
+  hrtimer_program();
+  spin_unlock(&hrtimer_lock);
+  return 0;
+}
+
+// Queue 't' again, with the callback it was last added with.
+int
+timer_rearm(struct hrtimer *t, uint64_t deadline_ns) {
+  return timer_add(t, deadline_ns, t->fn, t->arg);
+}
+
+// Dequeue 't' if it is pending.  Returns whether it was.  A callback
+// already running on another CPU is not waited for.
+bool
+timer_cancel(struct hrtimer *t) {
+  bool pending;
+
+  spin_lock(&hrtimer_lock);
+  if ((pending = t->heap_pos != 0)) {
+    heap_remove(t);
+    hrtimer_stats.cancels++;
+    hrtimer_program();
+  }
+  spin_unlock(&hrtimer_lock);
+  return pending;
+}
+
+// Deadline of the earliest pending timer, 0 if none.
+uint64_t
+timer_next_deadline(void) {
+  uint64_t next;
+
+  spin_lock(&hrtimer_lock);
+  next = hrtimer_count ? hrtimer_heap[0]->deadline : 0;
+  spin_unlock(&hrtimer_lock);
+  return next;
+}
+
+// Run the callbacks of all timers whose deadline has passed.
+// Called from the clock interrupts.
+void
+timer_run_expired(void) {
+  struct hrtimer *t;
+  uint64_t now;
+
+  // Deadlines past 'now' wait for the next call, even if they pass
+  // meanwhile, so a callback that keeps rearming its timer can't
+  // keep the CPU here.
+  spin_lock(&hrtimer_lock);
+  now = timer_now_ns();
+  while (hrtimer_count && (t = hrtimer_heap[0])->deadline <= now) {
+    hrtimer_fn fn = t->fn;
+
+    heap_remove(t);
+    hrtimer_stats.expired++;
+    if (now - t->deadline > hrtimer_stats.max_late_ns)
+      hrtimer_stats.max_late_ns = now - t->deadline;
+
+    spin_unlock(&hrtimer_lock);
+    fn(t);
+    spin_lock(&hrtimer_lock);
+  }
+
+  // The comparator has fired, or is about to for a timer that has
+  // just run; either way it must be programmed again.  This also
+  // covers a comparator that fired a little early by the TSC.
+  if (hrtimer_programmed && hrtimer_programmed <= now)
+    hrtimer_programmed = 0;
+  hrtimer_program();
+  spin_unlock(&hrtimer_lock);
+}
+
+void
+timer_print_stats(void) {
+  uint64_t next;
+
+  spin_lock(&hrtimer_lock);
+  next = hrtimer_count ? hrtimer_heap[0]->deadline : 0;
+  cprintf("hrtimers: %u pending (max %u), one-shot %s\n",
+          hrtimer_count, hrtimer_stats.max_pending,
+          hpet_oneshot_enabled() ? "hpet1" : "none, tick resolution");
+  cprintf("  adds %lu cancels %lu expired %lu max late %lu ns\n",
+          (unsigned long)hrtimer_stats.adds,
+          (unsigned long)hrtimer_stats.cancels,
+          (unsigned long)hrtimer_stats.expired,
+          (unsigned long)hrtimer_stats.max_late_ns);
+  if (next) {
+    uint64_t now = timer_now_ns();
+
+    cprintf("  next in %ld ns\n", (long)(next - now));
+  }
+  spin_unlock(&hrtimer_lock);
+}
@@ -0,0 +1,41 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_HRTIMER_H
+#define JOS_KERN_HRTIMER_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct hrtimer;
+
+// Called once the deadline of 't' has passed, from a clock interrupt
+// on any CPU, with interrupts disabled and no locks held.  It may
+// rearm 't'.
+typedef void (*hrtimer_fn)(struct hrtimer *t);
+
+// A kernel timer.  Its owner embeds it wherever the timer is needed
+// (it must stay put while pending) and finds its data through 'arg'.
+// A zeroed struct hrtimer is a valid, idle timer.
+struct hrtimer {
+  uint64_t deadline; // Expiry time in ns, see timer_now_ns()
+  hrtimer_fn fn;
+  void *arg;
+  uint32_t heap_pos; // 1 + index in the timer heap, 0 if not pending
+};
+
+uint64_t timer_now_ns(void);
+int timer_add(struct hrtimer *t, uint64_t deadline_ns, hrtimer_fn fn, void *arg);
+int timer_rearm(struct hrtimer *t, uint64_t deadline_ns);
+bool timer_cancel(struct hrtimer *t);
+uint64_t timer_next_deadline(void);
+void timer_run_expired(void);
+void timer_print_stats(void);
+
+static inline bool
+timer_pending(struct hrtimer *t) {
+  return t->heap_pos != 0;
+}
+
+#endif // !JOS_KERN_HRTIMER_H
@@ -5,6 +5,7 @@
 #include <inc/assert.h>
 #include <inc/uefi.h>
 #include <inc/memlayout.h>
+#include <inc/x86.h>
 
 #include <kern/monitor.h>
 #include <kern/tsc.h>
@@ -18,6 +19,10 @@
 #include <kern/picirq.h>
 #include <kern/kclock.h>
 #include <kern/kdebug.h>
+#include <kern/kworker.h>
+#include <kern/spinlock.h>
+
+static void boot_aps(void);
 
 void
 timers_init(void) {
@@ -26,6 +31,7 @@ timers_init(void) {
   timertab[2] = timer_acpipm;
   timertab[3] = timer_hpet0;
   timertab[4] = timer_hpet1;
+  timertab[5] = timer_lapic;
 
   for (int i = 0; i < MAX_TIMERS; i++) {
     if (timertab[i].timer_init != NULL) {
@@ -109,6 +115,10 @@ void
 i386_init(void) {
   extern char end[];
 
+  // The boot CPU is CPU 0.  Everything using thiscpu, curenv or
+  // spinlocks relies on this.
+  percpu_init(&cpus[0]);
+
   early_boot_pml4_init();
 
   // Initialize the console.
@@ -137,6 +147,7 @@ i386_init(void) {
 
   pic_init();
   rtc_init();
+  time_init();
 #ifdef SANITIZE_SHADOW_BASE
   kasan_mem_init();
 #endif
@@ -149,12 +160,24 @@ i386_init(void) {
 
   // user environment initialization functions
   env_init();
+  sched_init();
   trap_init();
 
+#ifndef CONFIG_KSPACE
+  // Multiprocessor initialization functions
+  mp_init();
+  lapic_init();
+#endif
+
   // choose the timer used for scheduling: hpet or pit
-  timers_schedule("hpet0");
+  timers_schedule(SCHED_TIMER);
   clock_idt_init();
 
+#ifndef CONFIG_KSPACE
+  // Starting non-boot CPUs
+  boot_aps();
+#endif
+
 #ifdef CONFIG_KSPACE
   // Touch all you want.
   ENV_CREATE_KERNEL_TYPE(prog_test1);
@@ -191,10 +214,82 @@ i386_init(void) {
 
 #endif // TEST*
 
+#if defined(TEST) && defined(TEST_NENVS)
+  // Benchmarks that need several competing environments get
+  // TEST_NENVS copies of the test.
+  for (int i = 1; i < TEST_NENVS; i++)
+    ENV_CREATE(TEST, ENV_TYPE_USER);
+#endif
+
+#ifndef CONFIG_KSPACE
+  // After the environments above, which get the first envs[] slots.
+  kworker_init();
+#endif
+
   // Schedule and run the first user environment!
   sched_yield();
 }
 
+// Variable 'var' of mpentry.S in the copy of the startup code at 'code'.
+#define MPENTRY_SLOT(code, var) \
+  ((uint64_t *)((code) + ((unsigned char *)&(var) - mpentry_start)))
+
+// Start the non-boot (AP) processors.
+static void
+boot_aps(void) {
+  extern unsigned char mpentry_start[], mpentry_end[];
+  extern uint64_t mpentry_cr0, mpentry_cr3, mpentry_cr4, mpentry_efer, mpentry_kstack;
+  extern uint64_t mpentry_cpu;
+  unsigned char *code;
+  struct CpuInfo *c;
+
+  if (ncpu == 1)
+    return;
+
+  // Write entry code to unused memory at MPENTRY_PADDR
+  code = KADDR(MPENTRY_PADDR);
+  memmove(code, mpentry_start, mpentry_end - mpentry_start);
+
+  // The APs switch to long mode with the settings of this CPU,
+  // loading CR3 while still in 32-bit mode.
+  assert(kern_cr3 < 0x100000000ULL);
+  *MPENTRY_SLOT(code, mpentry_cr0)  = rcr0();
+  *MPENTRY_SLOT(code, mpentry_cr3)  = kern_cr3;
+  *MPENTRY_SLOT(code, mpentry_cr4)  = rcr4() & ~CR4_PCIDE;
+  *MPENTRY_SLOT(code, mpentry_efer) = rdmsr(EFER_MSR) & ~(1ULL << EFER_LMA);
+
+  // Boot each AP one at a time
+  for (c = cpus; c < cpus + ncpu; c++) {
+    if (c == bootcpu) // We've started already.
+      continue;
+
+    // Tell mpentry.S what stack to use and which CPU it is
+    *MPENTRY_SLOT(code, mpentry_kstack) = KSTACKTOP_CPU(c - cpus);
+    *MPENTRY_SLOT(code, mpentry_cpu)    = (uintptr_t)c;
+    // Start the CPU at mpentry_start
+    lapic_startap(c->cpu_id, PADDR(code));
+    // Wait for the CPU to finish some basic setup in mp_main()
+    while (c->cpu_status != CPU_STARTED)
+      asm volatile("pause");
+  }
+}
+
+// Setup code for APs
+void
+mp_main(struct CpuInfo *c) {
+  percpu_init(c);
+  cprintf("SMP: CPU %d starting\n", cpunum());
+
+  lapic_init();
+  env_init_percpu();
+  trap_init_percpu();
+  xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
+
+  // Now that we have finished some basic setup, call sched_yield()
+  // to start running processes on this CPU.
+  sched_yield();
+}
+
 /*
  * Variable panicstr contains argument to first call to panic; used as flag
  * to indicate that the kernel has already called panic.
@@ -0,0 +1,240 @@
+// Synchronous inter-environment messages.
+//
+// sys_ipc_send() and sys_ipc_recv() rendezvous: whichever side comes
+// first blocks until the other one shows up.  A message is a few words
+// carried in registers, the same ones on both sides: the sender passes
+// them as syscall arguments, and they are written straight into the
+// saved registers of the receiver, so nothing goes through memory.
+//
+// A message may also carry a page (sys_ipc_send_page): the frame the
+// sender has at some address is mapped at the address the receiver
+// asked for, so bulk data moves without copying.
+//
+// A sender that finds its receiver blocked switches to it directly on
+// its own CPU, handing it the rest of its time slice, rather than
+// queueing it and waiting for the scheduler to get to it.
+//
+// All IPC state is protected by ipc_lock.  An env that blocks takes
+// the run queue lock of its CPU before it lets ipc_lock go, so whoever
+// finds it waiting can't wake it up, or switch to it, before it is
+// blocked.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/stdio.h>
+#include <kern/env.h>
+#include <kern/ipc.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+
+static struct {
+  uint64_t direct;   // Messages handed to a waiting receiver
+  uint64_t blocked;  // Senders that had to wait for their receiver
+  uint64_t received; // Messages taken from a waiting sender
+} ipc_stats;
+
+static struct spinlock ipc_lock = SPINLOCK_INITIALIZER(ipc_lock, LOCK_ORDER_IPC);
+
+// Hand the message in the registers of 'src' (saved by sys_ipc_send)
+// to 'dst' as the return value of its sys_ipc_recv: the sender in DX,
+// the words in R10, BX, DI and SI, which sysretq leaves alone.  With a page, the
+// registers of 'src' hold its address and perm (see
+// sys_ipc_send_page()) followed by two words of message.
+//
+// Returns 0 on success, or -E_NO_MEM if the page can't be mapped; the
+// message is not delivered then.
+static int
+ipc_deliver(struct Env *dst, struct Env *src) {
+  struct PushRegs *d = &dst->env_tf->tf_regs, *s = &src->env_tf->tf_regs;
+  struct PageInfo *pp;
+  int r;
+
+  static_assert(IPC_MSG_WORDS == 4, "ipc_deliver() copies 4 words");
+  dst->env_ipc_perm = 0;
+  if (src->env_ipc_page) {
+    if (dst->env_ipc_dstva < UTOP) {
+      // Checked by ipc_check_page(), and the sender can't have
+      // changed its mappings while it waited.
+      pp = page_lookup(src->env_pml4e, (void *)s->reg_rcx, NULL);
+      assert(pp);
+      if ((r = page_insert(dst->env_pml4e, pp, (void *)dst->env_ipc_dstva,
+                           s->reg_rbx)) < 0)
+        return r;
+      dst->env_ipc_perm = s->reg_rbx;
+    }
+    d->reg_r10 = s->reg_rdi;
+    d->reg_rbx = s->reg_rsi;
+    d->reg_rdi = 0;
+    d->reg_rsi = 0;
+  } else {
+    d->reg_r10 = s->reg_rcx;
+    d->reg_rbx = s->reg_rbx;
+    d->reg_rdi = s->reg_rdi;
+    d->reg_rsi = s->reg_rsi;
+  }
+  d->reg_rax = 0;
+  d->reg_rdx = src->env_id;
+  return 0;
+}
+
+// Whether the current environment may send the page at 'srcva' with
+// permissions 'perm'.
+int
+ipc_check_page(void *srcva, int perm) {
+  pte_t *pte;
+
+  if ((uintptr_t)srcva >= UTOP || PGOFF(srcva))
+    return -E_INVAL;
+  if ((perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P) || (perm & ~PTE_SYSCALL))
+    return -E_INVAL;
+  if (!page_lookup(curenv->env_pml4e, srcva, &pte))
+    return -E_INVAL;
+  if ((perm & PTE_W) && !(*pte & PTE_W))
+    return -E_INVAL;
+  return 0;
+}
+
+static bool
+ipc_accepts(struct Env *dst, struct Env *src) {
+  return dst->env_ipc_recving &&
+         (!dst->env_ipc_from || dst->env_ipc_from == src->env_id);
+}
+
+// Send the message in the saved registers of the current environment
+// (the arguments of its sys_ipc_send or, if 'page' is set, of its
+// sys_ipc_send_page) to environment 'to', blocking until it is
+// received.
+//
+// Returns 0 once the message is received, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment 'to' doesn't exist, or exits before
+//		receiving the message.
+//	-E_INVAL if 'to' is the current environment.
+//	-E_NO_MEM if the page can't be mapped into a waiting receiver.
+int
+ipc_send(envid_t to, bool page) {
+  struct Env *cur = curenv, *e, **pp;
+  int r;
+
+  if ((r = envid2env(to, &e, 0)) < 0)
+    return r;
+  if (e == cur)
+    return -E_INVAL;
+
+  // ipc_exit() runs under ipc_lock after 'e' is marked as dying.
+  spin_lock(&ipc_lock);
+  if (e->env_id != to || e->env_status == ENV_FREE ||
+      e->env_status == ENV_DYING) {
+    spin_unlock(&ipc_lock);
+    return -E_BAD_ENV;
+  }
+
+  cur->env_tf->tf_regs.reg_rax = 0;
+  cur->env_ipc_page           = page;
+
+  if (ipc_accepts(e, cur)) {
+    if ((r = sched_lock_blocked(e)) < 0) {
+      spin_unlock(&ipc_lock);
+      return r;
+    }
+    if ((r = ipc_deliver(e, cur)) < 0) {
+      sched_unlock_this();
+      spin_unlock(&ipc_lock);
+      return r;
+    }
+    e->env_ipc_recving = 0;
+    ipc_stats.direct++;
+    spin_unlock(&ipc_lock);
+    // The current environment goes back to its run queue.
+    env_run(e);
+  }
+
+  for (pp = &e->env_ipc_senders; *pp; pp = &(*pp)->env_ipc_next)
+    ;
+  *pp                 = cur;
+  cur->env_ipc_next   = NULL;
+  cur->env_ipc_target = e;
+  ipc_stats.blocked++;
+  sched_lock_this();
+  spin_unlock(&ipc_lock);
+  sched_block();
+}
+
+// Wait for a message from environment 'from', or from anyone if it is
+// 0.  The message is returned in the saved registers of the current
+// environment, see ipc_deliver().  A page that comes with it is mapped
+// at 'dstva' if it is below UTOP, and dropped otherwise.
+//
+// Returns 0 on success, or does not return until a sender shows up.
+// Errors are:
+//	-E_INVAL if dstva is below UTOP but not page-aligned.
+//	-E_NO_MEM if the page of a waiting sender can't be mapped.
+int
+ipc_recv(envid_t from, void *dstva) {
+  struct Env *cur = curenv, *s, **pp;
+  int r;
+
+  if ((uintptr_t)dstva < UTOP && PGOFF(dstva))
+    return -E_INVAL;
+
+  spin_lock(&ipc_lock);
+  cur->env_ipc_dstva = (uintptr_t)dstva < UTOP ? (uintptr_t)dstva : UTOP;
+  for (pp = &cur->env_ipc_senders; (s = *pp); pp = &s->env_ipc_next)
+    if (!from || s->env_id == from)
+      break;
+
+  if (s) {
+    if ((r = ipc_deliver(cur, s)) < 0) {
+      spin_unlock(&ipc_lock);
+      return r;
+    }
+    *pp               = s->env_ipc_next;
+    s->env_ipc_next   = NULL;
+    s->env_ipc_target = NULL;
+    ipc_stats.received++;
+    sched_wakeup(s);
+    spin_unlock(&ipc_lock);
+    return 0;
+  }
+
+  cur->env_ipc_recving = 1;
+  cur->env_ipc_from    = from;
+  sched_lock_this();
+  spin_unlock(&ipc_lock);
+  sched_block();
+}
+
+// Take a dying environment out of every IPC rendezvous.  Senders
+// blocked on it fail with -E_BAD_ENV.
+void
+ipc_exit(struct Env *e) {
+  struct Env *s, **pp;
+
+  spin_lock(&ipc_lock);
+  e->env_ipc_recving = 0;
+
+  if (e->env_ipc_target) {
+    for (pp = &e->env_ipc_target->env_ipc_senders; *pp != e;
+         pp = &(*pp)->env_ipc_next)
+      ;
+    *pp               = e->env_ipc_next;
+    e->env_ipc_target = NULL;
+  }
+
+  while ((s = e->env_ipc_senders)) {
+    e->env_ipc_senders        = s->env_ipc_next;
+    s->env_ipc_next           = NULL;
+    s->env_ipc_target         = NULL;
+    s->env_tf->tf_regs.reg_rax = -E_BAD_ENV;
+    sched_wakeup(s);
+  }
+  spin_unlock(&ipc_lock);
+}
+
+// The counters are read without ipc_lock.
+void
+ipc_print_stats(void) {
+  cprintf("ipc: direct %lu, blocked senders %lu, received from waiting %lu\n",
+          (unsigned long)ipc_stats.direct, (unsigned long)ipc_stats.blocked,
+          (unsigned long)ipc_stats.received);
+}
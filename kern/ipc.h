@@ -0,0 +1,19 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_IPC_H
+#define JOS_KERN_IPC_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+
+int ipc_check_page(void *srcva, int perm);
+int ipc_send(envid_t to, bool page);
+int ipc_recv(envid_t from, void *dstva);
+void ipc_print_stats(void);
+void ipc_exit(struct Env *e);
+
+#endif // !JOS_KERN_IPC_H
@@ -19,6 +19,12 @@ rtc_timer_pic_interrupt(void) {
   irq_setmask_8259A(irq_mask_8259A & ~(1 << IRQ_CLOCK));
 }
 
+// The RTC keeps counting; its next interrupt is held off at the PIC.
+static void
+rtc_timer_pic_disable(void) {
+  irq_setmask_8259A(irq_mask_8259A | (1 << IRQ_CLOCK));
+}
+
 static void
 rtc_timer_pic_handle(void) {
   rtc_check_status();
@@ -28,8 +34,9 @@ rtc_timer_pic_handle(void) {
 struct Timer timer_rtc = {
     .timer_name        = "rtc",
     .timer_init        = rtc_timer_init,
-    .enable_interrupts = rtc_timer_pic_interrupt,
-    .handle_interrupts = rtc_timer_pic_handle,
+    .enable_interrupts  = rtc_timer_pic_interrupt,
+    .disable_interrupts = rtc_timer_pic_disable,
+    .handle_interrupts  = rtc_timer_pic_handle,
 };
 
 void
@@ -70,6 +77,60 @@ rtc_check_status(void) {
   return status;
 }
 
+// Days from 1970-01-01 to year 'y', month 'm' (1-12), day 'd' (1-31)
+// of the Gregorian calendar.
+static uint64_t
+days_from_civil(unsigned y, unsigned m, unsigned d) {
+  unsigned era, yoe, doy, doe;
+
+  y -= m <= 2;
+  era = y / 400;
+  yoe = y - era * 400;
+  doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return (uint64_t)era * 146097 + doe - 719468;
+}
+
+static unsigned
+rtc_bcd(unsigned val, uint8_t reg_b) {
+  return reg_b & RTC_BINARY ? val : (val >> 4) * 10 + (val & 0xF);
+}
+
+// Read the date and time kept by the RTC, taken as UTC, in seconds
+// since the Unix epoch.
+uint64_t
+rtc_read_time(void) {
+  unsigned sec, min, hour, day, mon, year;
+  uint8_t reg_b;
+  bool pm;
+
+  // Read outside of an update, until the seconds hold still.
+  do {
+    while (mc146818_read(RTC_AREG) & RTC_UPDATE_IN_PROGRESS)
+      ;
+    sec  = mc146818_read(RTC_SEC);
+    min  = mc146818_read(RTC_MIN);
+    hour = mc146818_read(RTC_HOUR);
+    day  = mc146818_read(RTC_DAY);
+    mon  = mc146818_read(RTC_MON);
+    year = mc146818_read(RTC_YEAR);
+  } while (sec != mc146818_read(RTC_SEC));
+  reg_b = mc146818_read(RTC_BREG);
+
+  pm   = hour & RTC_PM;
+  sec  = rtc_bcd(sec, reg_b);
+  min  = rtc_bcd(min, reg_b);
+  hour = rtc_bcd(hour & ~RTC_PM, reg_b);
+  day  = rtc_bcd(day, reg_b);
+  mon  = rtc_bcd(mon, reg_b);
+  year = rtc_bcd(year, reg_b);
+  if (!(reg_b & RTC_24H))
+    hour = hour % 12 + (pm ? 12 : 0);
+  year += year < 70 ? 2000 : 1900;
+
+  return ((days_from_civil(year, mon, day) * 24 + hour) * 60 + min) * 60 + sec;
+}
+
 unsigned
 mc146818_read(unsigned reg) {
   outb(IO_RTC_CMND, reg);
@@ -30,12 +30,17 @@
 
 #define RTC_UPDATE_IN_PROGRESS 0x80
 
+#define RTC_24H    0x02 /* Register B: hours in 24-hour mode */
+#define RTC_BINARY 0x04 /* Register B: binary, not BCD, values */
+#define RTC_PM     0x80 /* Hour register: PM in 12-hour mode */
+
 #define RTC_PIE 0x40
 #define RTC_AIE 0x20
 #define RTC_UIE 0x10
 
 void rtc_init(void);
 uint8_t rtc_check_status(void);
+uint64_t rtc_read_time(void);
 
 #define MC_NVRAM_START 0xe /* start of NVRAM: offset 14 */
 #define MC_NVRAM_SIZE  50  /* 50 bytes of NVRAM */
@@ -0,0 +1,210 @@
+// Kernel worker threads.
+//
+// Work that need not be done before the kernel returns to an
+// environment (e.g. tearing down the page tables of a dead one) is
+// handed to queue_work() and run later by a kernel worker, off the trap
+// and interrupt paths.
+//
+// Workers are environments of type ENV_TYPE_KERNEL, one per CPU, with
+// a kernel stack of their own and scheduled by sched_yield() like any
+// other environment, so their CPU time shows up in env_sum_exec.  They
+// run in ring 0 with interrupts disabled, like the rest of the kernel,
+// and are never preempted: a worker runs up to KWORK_BATCH queued
+// items, then yields if more are queued, or blocks until queue_work()
+// wakes it up.  Nothing is kept across a yield, so a worker restarts
+// from kworker_entry() with the Trapframe set up by kworker_init()
+// every time it is put on a CPU.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/stdio.h>
+#include <inc/x86.h>
+#include <kern/cpu.h>
+#include <kern/env.h>
+#include <kern/kworker.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+
+#define NWORK       256 // Work items queued at most
+#define KWORK_BATCH 16  // Items run before a worker yields
+
+struct Work {
+  void (*fn)(void *);
+  void *arg;
+  struct Work *next;
+};
+
+struct Kworker {
+  struct Env *env;
+  bool idle;        // Blocked, waiting for queue_work()
+  uint64_t items;   // Work items run
+  uint64_t cycles;  // TSC cycles spent in them
+  uint64_t wakeups; // Times queue_work() woke it up
+};
+
+// Protects the queue, the free items and the idle flags of workers.
+// An idle worker takes the run queue lock of its CPU before letting it
+// go, see kworker_main() and queue_work().
+static struct spinlock work_lock = SPINLOCK_INITIALIZER(work_lock, LOCK_ORDER_WORK);
+
+static struct Work work_pool[NWORK];
+static struct Work *work_free;
+static struct Work *work_head, *work_tail;
+static uint64_t work_queued, work_dropped;
+
+static struct Kworker kworkers[NCPU];
+static int nkworkers;
+
+static void
+kworker_main(struct Kworker *w) {
+  struct Work *item;
+  void (*fn)(void *);
+  void *arg;
+  uint64_t start;
+
+  for (int n = 0; n < KWORK_BATCH; n++) {
+    spin_lock(&work_lock);
+    if (!(item = work_head)) {
+      spin_unlock(&work_lock);
+      break;
+    }
+    if (!(work_head = item->next))
+      work_tail = NULL;
+    fn         = item->fn;
+    arg        = item->arg;
+    item->next = work_free;
+    work_free  = item;
+    spin_unlock(&work_lock);
+
+    start = read_tsc();
+    fn(arg);
+    w->cycles += read_tsc() - start;
+    w->items++;
+  }
+
+  // Workers never enter the kernel, which is where the running
+  // environment is normally charged for its time.
+  sched_update_curr();
+
+  spin_lock(&work_lock);
+  if (work_head) {
+    spin_unlock(&work_lock);
+    sched_yield();
+  }
+  w->idle = 1;
+  sched_lock_this();
+  spin_unlock(&work_lock);
+  sched_block();
+}
+
+// Where a worker starts, on the direct map alias of the top page of its
+// kernel stack.  Carry on below its Trapframe on the whole stack, which
+// env_run() mapped at the kernel stack of this CPU.
+static void __attribute__((noreturn))
+kworker_entry(struct Kworker *w) {
+  uintptr_t top = KSTACKTOP_CPU(cpunum()) - sizeof(struct Trapframe);
+
+  asm volatile("movq %0,%%rsp\n"
+               "\txorl %%ebp,%%ebp\n"
+               "\tcall *%1\n"
+               :
+               : "r"(ROUNDDOWN(top, 16)), "r"(kworker_main), "D"(w)
+               : "memory");
+  panic("kworker_main returned");
+}
+
+// Create the workers, blocked until there is work for them.
+void
+kworker_init(void) {
+  struct Kworker *w;
+  struct Env *e;
+  int r;
+
+  for (int i = 0; i < NWORK; i++) {
+    work_pool[i].next = work_free;
+    work_free         = &work_pool[i];
+  }
+
+  for (int i = 0; i < ncpu; i++) {
+    if ((r = env_alloc(&e, 0)) < 0)
+      panic("kworker_init: %i", r);
+    e->env_type = ENV_TYPE_KERNEL;
+    *e->env_tf  = (struct Trapframe){
+        .tf_ds           = GD_KD,
+        .tf_es           = GD_KD,
+        .tf_ss           = GD_KD,
+        .tf_cs           = GD_KT,
+        .tf_rip          = (uintptr_t)kworker_entry,
+        .tf_rsp          = ROUNDDOWN((uintptr_t)e->env_tf, 16) - 8,
+        .tf_regs.reg_rdi = (uintptr_t)&kworkers[i],
+    };
+
+    w       = &kworkers[i];
+    w->env  = e;
+    w->idle = 1;
+  }
+  nkworkers = ncpu;
+}
+
+// Have fn(arg) called soon by a kernel worker.  Must not be called with
+// a run queue lock held.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NO_MEM if too much work is queued already.
+//	-E_NO_FREE_ENV if there are no workers (yet).
+int
+queue_work(void (*fn)(void *), void *arg) {
+  struct Kworker *wake = NULL;
+  struct Work *item;
+
+  if (!nkworkers)
+    return -E_NO_FREE_ENV;
+
+  spin_lock(&work_lock);
+  if (!(item = work_free)) {
+    work_dropped++;
+    spin_unlock(&work_lock);
+    return -E_NO_MEM;
+  }
+  work_free  = item->next;
+  item->fn   = fn;
+  item->arg  = arg;
+  item->next = NULL;
+  if (work_tail)
+    work_tail->next = item;
+  else
+    work_head = item;
+  work_tail = item;
+  work_queued++;
+
+  for (int i = 0; i < nkworkers && !wake; i++)
+    if (kworkers[i].idle)
+      wake = &kworkers[i];
+  if (wake) {
+    wake->idle = 0;
+    wake->wakeups++;
+  }
+  spin_unlock(&work_lock);
+
+  // Busy workers look at the queue before they block again.
+  if (wake)
+    sched_wakeup(wake->env);
+  return 0;
+}
+
+void
+kworker_print_stats(void) {
+  spin_lock(&work_lock);
+  cprintf("work items queued %lu, dropped %lu\n",
+          (unsigned long)work_queued, (unsigned long)work_dropped);
+  for (int i = 0; i < nkworkers; i++) {
+    struct Kworker *w = &kworkers[i];
+
+    cprintf("  [%08x] %-7s runs %u, wakeups %lu, items %lu, %lu cycles in items, "
+            "%lu cycles total\n",
+            w->env->env_id, w->idle ? "idle" : "busy", w->env->env_runs,
+            (unsigned long)w->wakeups, (unsigned long)w->items,
+            (unsigned long)w->cycles, (unsigned long)w->env->env_sum_exec);
+  }
+  spin_unlock(&work_lock);
+}
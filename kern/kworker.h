@@ -0,0 +1,15 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KWORKER_H
+#define JOS_KERN_KWORKER_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+void kworker_init(void);
+int queue_work(void (*fn)(void *), void *arg);
+void kworker_print_stats(void);
+
+#endif // !JOS_KERN_KWORKER_H
@@ -0,0 +1,317 @@
+// The local APIC manages internal (non-I/O) interrupts.
+// See Chapter 10 of Intel 64 and IA-32 Architectures Software
+// Developer's Manual, Volume 3A.
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+#include <inc/trap.h>
+#include <inc/mmu.h>
+#include <inc/stdio.h>
+#include <inc/x86.h>
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/kclock.h>
+#include <kern/tsc.h>
+#include <kern/timer.h>
+
+// Local APIC registers, divided by 4 for use as uint32_t[] indices.
+#define ID    (0x0020 / 4) // ID
+#define VER   (0x0030 / 4) // Version
+#define TPR   (0x0080 / 4) // Task Priority
+#define EOI   (0x00B0 / 4) // EOI
+#define SVR   (0x00F0 / 4) // Spurious Interrupt Vector
+#define ENABLE 0x00000100  // Unit Enable
+#define ESR   (0x0280 / 4) // Error Status
+#define ICRLO (0x0300 / 4) // Interrupt Command
+#define INIT     0x00000500 // INIT/RESET
+#define STARTUP  0x00000600 // Startup IPI
+#define DELIVS   0x00001000 // Delivery status
+#define ASSERT   0x00004000 // Assert interrupt (vs deassert)
+#define DEASSERT 0x00000000
+#define LEVEL    0x00008000 // Level triggered
+#define BCAST    0x00080000 // Send to all APICs, including self.
+#define OTHERS   0x000C0000 // Send to all APICs, excluding self.
+#define BUSY     0x00001000
+#define FIXED    0x00000000
+#define ICRHI (0x0310 / 4) // Interrupt Command [63:32]
+#define TIMER (0x0320 / 4) // Local Vector Table 0 (TIMER)
+#define X1       0x0000000B // divide counts by 1
+#define PERIODIC 0x00020000 // Periodic
+#define DEADLINE 0x00040000 // TSC-deadline
+#define PCINT (0x0340 / 4) // Performance Counter LVT
+#define LINT0 (0x0350 / 4) // Local Vector Table 1 (LINT0)
+#define LINT1 (0x0360 / 4) // Local Vector Table 2 (LINT1)
+#define EXTINT   0x00000700 // Deliver as ExtINT (8259A virtual wire)
+#define NMI      0x00000400 // Deliver as NMI
+#define ERROR (0x0370 / 4) // Local Vector Table 3 (ERROR)
+#define MASKED   0x00010000 // Interrupt masked
+#define TICR  (0x0380 / 4) // Timer Initial Count
+#define TCCR  (0x0390 / 4) // Timer Current Count
+#define TDCR  (0x03E0 / 4) // Timer Divide Configuration
+
+// The application processors tick at the rate of the scheduling timer
+// of the BSP (see hpet_enable_interrupts_tim0()).
+#define LAPIC_TIMER_HZ 2
+
+#define MSR_TSC_DEADLINE   0x6E0
+#define CPUID_TSC_DEADLINE (1 << 24) // CPUID.1:ECX
+
+volatile uint32_t *lapic; // Mapped at lapicaddr (see mpconfig.c) by lapic_init()
+
+// Local APIC timer counts per second, measured on the BSP.
+static uint64_t lapic_timer_freq;
+
+// In TSC-deadline mode the timer fires when the TSC reaches the value
+// written to MSR_TSC_DEADLINE, which saves the MMIO count register
+// and makes one-shot events exact.
+static bool lapic_tsc_deadline;
+static uint64_t lapic_tick_tsc; // TSC cycles per tick
+
+static void
+lapicw(int index, int value) {
+  lapic[index] = value;
+  lapic[ID]; // wait for write to finish, by reading
+}
+
+// Spin for a given number of microseconds.
+static void
+microdelay(int us) {
+  uint64_t end = read_tsc() + tsc_calibrate() / 1000000 * us;
+
+  while (read_tsc() < end)
+    asm volatile("pause");
+}
+
+// Count how fast the local APIC timer runs against the HPET or the
+// PM timer (the TSC if there is neither), and see whether it
+// supports TSC-deadline mode.
+static void
+lapic_timer_calibrate(void) {
+  const uint32_t start = 0xFFFFFFFF;
+  uint32_t left, ecx;
+
+  lapicw(TDCR, X1);
+  lapicw(TIMER, MASKED | (IRQ_OFFSET + IRQ_LAPIC_TIMER));
+  lapicw(TICR, start);
+  if (!timer_ref_delay(10000))
+    microdelay(10000);
+  left = lapic[TCCR];
+  lapicw(TICR, 0);
+
+  lapic_timer_freq = (uint64_t)(start - left) * 100;
+
+  cpuid(1, NULL, NULL, &ecx, NULL);
+  lapic_tsc_deadline = !!(ecx & CPUID_TSC_DEADLINE);
+  lapic_tick_tsc     = ns_to_tsc(1000000000ULL / LAPIC_TIMER_HZ);
+}
+
+void
+lapic_init(void) {
+  if (!lapicaddr)
+    return;
+
+  // lapicaddr is the physical address of the LAPIC's 4K MMIO
+  // region.  Map it in to virtual memory so we can access it.
+  if (!lapic)
+    lapic = mmio_map_region(lapicaddr, 4096);
+
+  // Enable local APIC; set spurious interrupt vector.
+  lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
+
+  if (!lapic_timer_freq)
+    lapic_timer_calibrate();
+
+  // The BSP gets its clock ticks from the HPET through the 8259A.
+  // The timer of each AP counts down repeatedly at bus frequency
+  // from lapic[TICR] and then issues an interrupt.
+  if (thiscpu == bootcpu)
+    lapic_timer_stop();
+  else
+    lapic_timer_periodic();
+
+  // Leave LINT0 of the BSP in virtual wire mode so that it can get
+  // interrupts from the 8259A chip.  The other CPUs ignore it.
+  if (thiscpu != bootcpu)
+    lapicw(LINT0, MASKED);
+  else
+    lapicw(LINT0, EXTINT);
+
+  // Only the BSP handles NMIs.
+  lapicw(LINT1, thiscpu == bootcpu ? NMI : MASKED);
+
+  // Disable performance counter overflow interrupts
+  // on machines that provide that interrupt entry.
+  if (((lapic[VER] >> 16) & 0xFF) >= 4)
+    lapicw(PCINT, MASKED);
+
+  // We don't handle APIC errors.
+  lapicw(ERROR, MASKED);
+
+  // Clear error status register (requires back-to-back writes).
+  lapicw(ESR, 0);
+  lapicw(ESR, 0);
+
+  // Ack any outstanding interrupts.
+  lapicw(EOI, 0);
+
+  // Send an Init Level De-Assert to synchronize arbitration ID's.
+  lapicw(ICRHI, 0);
+  lapicw(ICRLO, BCAST | INIT | LEVEL);
+  while (lapic[ICRLO] & DELIVS)
+    ;
+
+  // Enable interrupts on the APIC (but not on the processor).
+  lapicw(TPR, 0);
+}
+
+// Acknowledge interrupt.
+void
+lapic_eoi(void) {
+  if (lapic)
+    lapicw(EOI, 0);
+}
+
+// The local APIC timer is the clock event device of each CPU: the
+// periodic tick of the APs, and the one-shot wakeup of any idle CPU
+// (see sched_idle_enter()).
+bool
+lapic_timer_available(void) {
+  return lapic && lapic_timer_freq;
+}
+
+static void
+lapic_timer_set_deadline(uint64_t tsc) {
+  // The MSR write must not pass the write of the timer LVT.
+  asm volatile("mfence" ::: "memory");
+  wrmsr(MSR_TSC_DEADLINE, tsc);
+}
+
+void
+lapic_timer_periodic(void) {
+  thiscpu->cpu_tick_on = 1;
+  if (lapic_tsc_deadline) {
+    // Emulated: lapic_timer_handle() sets the next deadline.
+    lapicw(TIMER, DEADLINE | (IRQ_OFFSET + IRQ_LAPIC_TIMER));
+    thiscpu->cpu_tick_deadline = read_tsc() + lapic_tick_tsc;
+    lapic_timer_set_deadline(thiscpu->cpu_tick_deadline);
+    return;
+  }
+  lapicw(TDCR, X1);
+  lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_LAPIC_TIMER));
+  lapicw(TICR, lapic_timer_freq / LAPIC_TIMER_HZ);
+}
+
+// Interrupt once, 'ns' nanoseconds from now, or as late as the
+// counter allows.
+void
+lapic_timer_oneshot(uint64_t ns) {
+  uint64_t count = (__uint128_t)ns * lapic_timer_freq / 1000000000ULL;
+
+  thiscpu->cpu_tick_on = 0;
+  if (lapic_tsc_deadline) {
+    lapicw(TIMER, DEADLINE | (IRQ_OFFSET + IRQ_LAPIC_TIMER));
+    lapic_timer_set_deadline(read_tsc() + ns_to_tsc(ns));
+    return;
+  }
+  lapicw(TDCR, X1);
+  lapicw(TIMER, IRQ_OFFSET + IRQ_LAPIC_TIMER);
+  lapicw(TICR, MAX(MIN(count, 0xFFFFFFFFULL), 1));
+}
+
+void
+lapic_timer_stop(void) {
+  thiscpu->cpu_tick_on = 0;
+  if (lapic_tsc_deadline)
+    wrmsr(MSR_TSC_DEADLINE, 0);
+  lapicw(TIMER, MASKED);
+  lapicw(TICR, 0);
+}
+
+// Acknowledge a local APIC timer interrupt and, in TSC-deadline mode,
+// set up the next periodic tick.  Ticks that were missed are dropped
+// rather than delivered back to back.
+void
+lapic_timer_handle(void) {
+  if (lapic_tsc_deadline && thiscpu->cpu_tick_on) {
+    uint64_t now = read_tsc();
+
+    thiscpu->cpu_tick_deadline += lapic_tick_tsc;
+    if (thiscpu->cpu_tick_deadline <= now)
+      thiscpu->cpu_tick_deadline = now + lapic_tick_tsc;
+    lapic_timer_set_deadline(thiscpu->cpu_tick_deadline);
+  }
+  lapic_eoi();
+}
+
+// The local APIC timer as the scheduling timer of the BSP as well
+// (SCHED_TIMER=lapic), so that every CPU gets its ticks from its own
+// timer rather than from the HPET through the 8259A.
+static void
+lapic_timer_enable_interrupts(void) {
+  if (!lapic_timer_available())
+    panic("Local APIC timer is not available");
+  lapic_timer_periodic();
+}
+
+struct Timer timer_lapic = {
+    .timer_name         = "lapic",
+    .enable_interrupts  = lapic_timer_enable_interrupts,
+    .disable_interrupts = lapic_timer_stop,
+    .handle_interrupts  = lapic_timer_handle,
+};
+
+#define IO_RTC_SHUTDOWN 0x0F
+
+// Start additional processor running entry code at addr.
+// See Appendix B of MultiProcessor Specification.
+void
+lapic_startap(uint8_t apicid, uint32_t addr) {
+  int i;
+  uint16_t *wrv;
+
+  // "The BSP must initialize CMOS shutdown code to 0AH
+  // and the warm reset vector (DWORD based at 40:67) to point at
+  // the AP startup code prior to the [universal startup algorithm]."
+  outb(IO_RTC_CMND, IO_RTC_SHUTDOWN);
+  outb(IO_RTC_DATA, 0x0A);
+  wrv    = (uint16_t *)KADDR((0x40 << 4 | 0x67)); // Warm reset vector
+  wrv[0] = 0;
+  wrv[1] = addr >> 4;
+
+  // "Universal startup algorithm."
+  // Send INIT (level-triggered) interrupt to reset other CPU.
+  lapicw(ICRHI, apicid << 24);
+  lapicw(ICRLO, INIT | LEVEL | ASSERT);
+  microdelay(200);
+  lapicw(ICRLO, INIT | LEVEL);
+  microdelay(10000); // should be 10ms
+
+  // Send startup IPI (twice!) to enter code.
+  // Regular hardware is supposed to only accept a STARTUP
+  // when it is in the halted state due to an INIT.  So the second
+  // should be ignored, but it is part of the official Intel algorithm.
+  for (i = 0; i < 2; i++) {
+    lapicw(ICRHI, apicid << 24);
+    lapicw(ICRLO, STARTUP | (addr >> 12));
+    microdelay(200);
+  }
+}
+
+// Send an IPI with 'vector' to CPU number 'cpu'.
+void
+lapic_ipi_cpu(int cpu, int vector) {
+  if (!lapic)
+    return;
+  lapicw(ICRHI, cpus[cpu].cpu_id << 24);
+  lapicw(ICRLO, FIXED | vector);
+  while (lapic[ICRLO] & DELIVS)
+    ;
+}
+
+// Send an IPI with 'vector' to all other CPUs.
+void
+lapic_ipi(int vector) {
+  lapicw(ICRLO, OTHERS | FIXED | vector);
+  while (lapic[ICRLO] & DELIVS)
+    ;
+}
@@ -13,9 +13,15 @@
 
 #include <kern/tsc.h>
 #include <kern/timer.h>
+#include <kern/hrtimer.h>
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/trap.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <kern/syscall.h>
+#include <kern/systrace.h>
+#include <kern/kworker.h>
 
 #define CMDBUF_SIZE 80 // enough for one VGA text line
 
@@ -49,6 +55,13 @@ static struct Command commands[] = {
     {"memory", "Print list of all physical memory pages", mon_memory},
     // LAB 6 code end
 
+    {"sched", "Display scheduler statistics", mon_sched},
+    {"hrtimers", "Display kernel timer statistics", mon_hrtimers},
+    {"lockstat", "Display lock contention statistics, 'lockstat reset' clears them", mon_lockstat},
+    {"systrace", "Display traced system calls, see 'systrace help'", mon_systrace},
+    {"sysstat", "Display system call statistics, see 'sysstat help'", mon_sysstat},
+    {"kworkers", "Display kernel worker statistics", mon_kworkers},
+
     {"backtrace", "Print stack backtrace", mon_backtrace}};
 #define NCOMMANDS (sizeof(commands) / sizeof(commands[0]))
 
@@ -229,6 +242,81 @@ mon_memory(int argc, char **argv, struct Trapframe *tf) {
 }
 // LAB 6 code end
 
+int
+mon_sched(int argc, char **argv, struct Trapframe *tf) {
+  sched_print_stats();
+  return 0;
+}
+
+int
+mon_hrtimers(int argc, char **argv, struct Trapframe *tf) {
+  timer_print_stats();
+  return 0;
+}
+
+int
+mon_lockstat(int argc, char **argv, struct Trapframe *tf) {
+  if (argc > 2 || (argc == 2 && strcmp(argv[1], "reset"))) {
+    cprintf("Usage: lockstat [reset]\n");
+    return 0;
+  }
+  spin_print_stats(argc == 2);
+  return 0;
+}
+
+int
+mon_systrace(int argc, char **argv, struct Trapframe *tf) {
+  struct Env *e;
+  char *end;
+  long n;
+
+  if (argc == 1) {
+    systrace_print(32);
+  } else if (argc == 2 && !strcmp(argv[1], "on")) {
+    systrace_all = 1;
+  } else if (argc == 2 && !strcmp(argv[1], "off")) {
+    systrace_all = 0;
+    for (int i = 0; i < NENV; i++)
+      envs[i].env_systrace = 0;
+  } else if (argc == 2 && !strcmp(argv[1], "clear")) {
+    systrace_clear();
+  } else if (argc == 3 && !strcmp(argv[1], "env")) {
+    n = strtol(argv[2], &end, 16);
+    if (*end || !n || envid2env(n, &e, 0) < 0) {
+      cprintf("systrace: no env %s\n", argv[2]);
+      return 0;
+    }
+    e->env_systrace = 1;
+  } else if (argc == 2 && (n = strtol(argv[1], &end, 10)) > 0 && !*end) {
+    systrace_print(n);
+  } else {
+    cprintf("Usage: systrace [N]       print the last N (32) calls traced\n"
+            "       systrace on|off    trace all envs, or stop tracing\n"
+            "       systrace env ID    trace env ID (hex)\n"
+            "       systrace clear     forget the calls traced\n");
+  }
+  return 0;
+}
+
+int
+mon_sysstat(int argc, char **argv, struct Trapframe *tf) {
+  if (argc == 1) {
+    syscall_print_stats(NULL);
+  } else if (argc == 2 && !strcmp(argv[1], "reset")) {
+    syscall_clear_stats();
+  } else if (argc != 2 || syscall_print_stats(argv[1]) < 0) {
+    cprintf("Usage: sysstat           print calls and average latency\n"
+            "       sysstat NAME      print the latency histogram of NAME\n"
+            "       sysstat reset     clear the statistics\n");
+  }
+  return 0;
+}
+
+int
+mon_kworkers(int argc, char **argv, struct Trapframe *tf) {
+  kworker_print_stats();
+  return 0;
+}
 
 /***** Kernel monitor command interpreter *****/
 
@@ -30,4 +30,11 @@ int mon_memory(int argc, char **argv, struct Trapframe *tf);
 int mon_memory(int argc, char **argv, struct Trapframe *tf);
 // LAB 6 code end
 
+int mon_sched(int argc, char **argv, struct Trapframe *tf);
+int mon_hrtimers(int argc, char **argv, struct Trapframe *tf);
+int mon_lockstat(int argc, char **argv, struct Trapframe *tf);
+int mon_systrace(int argc, char **argv, struct Trapframe *tf);
+int mon_sysstat(int argc, char **argv, struct Trapframe *tf);
+int mon_kworkers(int argc, char **argv, struct Trapframe *tf);
+
 #endif // !JOS_KERN_MONITOR_H
@@ -0,0 +1,102 @@
+// Search for and parse the ACPI Multiple APIC Description Table (MADT)
+// to find out about the processors of the machine.
+
+#include <inc/types.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/memlayout.h>
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/env.h>
+#include <kern/cpu.h>
+#include <kern/pmap.h>
+#include <kern/timer.h>
+
+struct CpuInfo cpus[NCPU];
+struct CpuInfo *bootcpu;
+int ncpu;
+physaddr_t lapicaddr;
+
+// Per-CPU kernel stacks.  The stack of the BSP is bootstack (see
+// kern/entry.S), so percpu_kstacks[0] is left unused.
+unsigned char percpu_kstacks[NCPU][KSTKSIZE]
+    __attribute__((aligned(PGSIZE)));
+
+#define MSR_APIC_BASE    0x1B
+#define APIC_BASE_ENABLE (1 << 11)
+
+// Point the GS base of the running CPU at 'c', making it thiscpu.
+// Called first thing on every CPU.  The user GS base starts out as 0.
+void
+percpu_init(struct CpuInfo *c) {
+  c->cpu_self = c;
+  c->cpu_num  = c - cpus;
+  wrmsr(MSR_GS_BASE, (uintptr_t)c);
+  wrmsr(MSR_KERNEL_GS_BASE, 0);
+}
+
+void
+mp_init(void) {
+  MADT *madt;
+  uint8_t *p, *end;
+
+  // The BSP is always CPU 0, whatever its APIC ID is: that's how
+  // the stack and TSS it has been using since boot are laid out.
+  bootcpu             = &cpus[0];
+  ncpu                = 1;
+  bootcpu->cpu_status = CPU_STARTED;
+
+  if (!(rdmsr(MSR_APIC_BASE) & APIC_BASE_ENABLE)) {
+    cprintf("SMP: local APIC is disabled, running on one CPU\n");
+    return;
+  }
+
+  // Read the APIC ID of the BSP directly; the local APIC is
+  // mapped by lapic_init() later.
+  {
+    uint32_t ebx;
+    cpuid(1, NULL, &ebx, NULL, NULL);
+    bootcpu->cpu_id = ebx >> 24;
+  }
+
+  if (!(madt = acpi_find_table("APIC"))) {
+    cprintf("SMP: no MADT found, running on one CPU\n");
+    lapicaddr = PTE_ADDR(rdmsr(MSR_APIC_BASE));
+    return;
+  }
+
+  lapicaddr = madt->LocalApicAddress;
+  p         = madt->Entries;
+  end       = (uint8_t *)madt + madt->h.Length;
+  for (; p + sizeof(MADTEntry) <= end; p += ((MADTEntry *)p)->Length) {
+    MADTEntry *ent = (MADTEntry *)p;
+
+    if (ent->Length < sizeof(MADTEntry))
+      break;
+
+    switch (ent->Type) {
+    case MADT_LAPIC: {
+      MADTLocalApic *proc = (MADTLocalApic *)ent;
+
+      if (!(proc->Flags & 1) || proc->ApicId == bootcpu->cpu_id)
+        break;
+      if (ncpu < NCPU) {
+        cpus[ncpu].cpu_id = proc->ApicId;
+        ncpu++;
+      } else {
+        cprintf("SMP: too many CPUs, CPU %d disabled\n", proc->ApicId);
+      }
+      break;
+    }
+    case MADT_LAPIC_OVERRIDE:
+      lapicaddr = ((MADTLocalApicOverride *)ent)->Address;
+      break;
+    default:
+      // I/O APICs, interrupt source overrides, NMI sources:
+      // interrupts are still routed through the 8259A.
+      break;
+    }
+  }
+
+  cprintf("SMP: CPU %d found %d CPU(s)\n", bootcpu->cpu_id, ncpu);
+}
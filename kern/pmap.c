@@ -7,8 +7,10 @@
 #include <inc/assert.h>
 
 #include <kern/pmap.h>
+#include <kern/tsc.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
+#include <kern/spinlock.h>
 #include <inc/uefi.h>
 
 #ifdef SANITIZE_SHADOW_BASE
@@ -29,6 +31,7 @@ physaddr_t kern_cr3;                               // Physical address of boot t
 struct PageInfo *pages;                            // Physical page state array
 static struct PageInfo *page_free_list     = NULL; // Free list of physical pages
 static struct PageInfo *page_free_list_top = NULL;
+static void *envs_zero_page;                       // Backs unused slots at UENVS
 //Pointers to start and end of UEFI memory map
 EFI_MEMORY_DESCRIPTOR *mmap_base = NULL;
 EFI_MEMORY_DESCRIPTOR *mmap_end  = NULL;
@@ -143,6 +146,7 @@ static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
 static void check_kern_pml4e(void);
+static void mem_init_mp(void);
 static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 static void check_page(void);
 static void check_page_installed_pml4(void);
@@ -259,12 +263,14 @@ mem_init(void) {
   // LAB 6 code end
 
   //////////////////////////////////////////////////////////////////////
-  // Make 'envs' point to an array of size 'NENV' of 'struct Env'.
+  // The 'envs' array itself is allocated on demand by env_init() and
+  // env_alloc(); until a slot is handed out, users see it through a
+  // zero page, which reads as a free env.
+
+  // LAB 8 code
+  envs_zero_page = boot_alloc(PGSIZE);
+  memset(envs_zero_page, 0, PGSIZE);
 
-  // LAB 8 code 
-  envs = (struct Env *)boot_alloc(sizeof(* envs) * NENV);
-	memset(envs, 0, sizeof(*envs) * NENV);
-  
   //////////////////////////////////////////////////////////////////////
   // Now that we've allocated the initial kernel data structures, we set
   // up the list of free physical pages. Once we've done so, all further
@@ -298,7 +304,11 @@ mem_init(void) {
   //    - envs itself -- kernel RW, user NONE
 
   // LAB 8 code
-  boot_map_region(kern_pml4e, UENVS, ROUNDUP(NENV * sizeof(*envs), PGSIZE), PADDR(envs), PTE_U | PTE_P);
+  for (size_t i = 0; i < ROUNDUP(NENV * sizeof(struct Env), PGSIZE); i += PGSIZE)
+    boot_map_region(kern_pml4e, UENVS + i, PGSIZE, PADDR(envs_zero_page), PTE_U | PTE_P);
+
+  // Map the time page read-only by the user at UTIME, see inc/time.h.
+  boot_map_region(kern_pml4e, UTIME, PGSIZE, PADDR(&time_page), PTE_U | PTE_P);
   
   //////////////////////////////////////////////////////////////////////
   // Use the physical memory that 'bootstack' refers to as the kernel
@@ -317,6 +327,9 @@ mem_init(void) {
   // Additionally map stack to lower 32-bit addresses.
   boot_map_region(kern_pml4e, X86ADDR(KSTACKTOP - KSTKSIZE), KSTKSIZE, PADDR(bootstack), PTE_P | PTE_W);
 
+  // Initialize the SMP-related parts of the memory map
+  mem_init_mp();
+
   //////////////////////////////////////////////////////////////////////
   // Map all of physical memory at KERNBASE.
   // Ie.  the VA range [KERNBASE, 2^32) should map to
@@ -389,6 +402,34 @@ mem_init(void) {
   check_page_free_list(0);
 }
 
+// Modify mappings in kern_pml4e to support SMP
+//   - Map the per-CPU stacks in the region [KSTACKTOP-PTSIZE, KSTACKTOP)
+//   - Identity map the startup code of the APs at MPENTRY_PADDR
+static void
+mem_init_mp(void) {
+  // Map per-CPU stacks starting at KSTACKTOP, for up to 'NCPU' CPUs.
+  //
+  // For CPU i, use the physical memory that 'percpu_kstacks[i]' refers
+  // to as its kernel stack. CPU i's kernel stack grows down from virtual
+  // address KSTACKTOP_CPU(i), and is divided into two pieces, just like
+  // the single stack you set up in mem_init:
+  //     * [kstacktop_i - KSTKSIZE, kstacktop_i)
+  //          -- backed by physical memory
+  //     * [kstacktop_i - (KSTKSIZE + KSTKGAP), kstacktop_i - KSTKSIZE)
+  //          -- not backed; so if the kernel overflows its stack,
+  //             it will fault rather than overwrite another CPU's stack.
+  //             Known as a "guard page".
+  //     Permissions: kernel RW, user NONE
+  //
+  // CPU 0 is the BSP, which keeps running on bootstack.
+  for (int i = 1; i < NCPU; i++)
+    boot_map_region(kern_pml4e, KSTACKTOP_CPU(i) - KSTKSIZE, KSTKSIZE,
+                    PADDR(percpu_kstacks[i]), PTE_W | PTE_P);
+
+  // The APs turn paging on while running from MPENTRY_PADDR.
+  boot_map_region(kern_pml4e, MPENTRY_PADDR, PGSIZE, MPENTRY_PADDR, PTE_W | PTE_P);
+}
+
 #ifdef SANITIZE_SHADOW_BASE
 void
 kasan_mem_init(void) {
@@ -473,7 +514,8 @@ page_init(void) {
   page_free_list  = &pages[1];
   last            = &pages[1];
   for (i = 1; i < npages_basemem; i++) {
-    if (is_page_allocatable(i)) {
+    // The startup code of the APs is copied there.
+    if (i != PGNUM(MPENTRY_PADDR) && is_page_allocatable(i)) {
       pages[i].pp_ref = 0;
       last->pp_link   = &pages[i];
       last            = &pages[i];
@@ -520,7 +562,9 @@ page_init(void) {
 // Hint: use page2kva and memset
 struct PageInfo *
 page_alloc(int alloc_flags) {
+  spin_lock(&page_lock);
   if (!page_free_list) {
+    spin_unlock(&page_lock);
     return NULL;
   }
   struct PageInfo *return_page = page_free_list;
@@ -530,6 +574,7 @@ page_alloc(int alloc_flags) {
   if (!page_free_list) {
     page_free_list_top = NULL;
   }
+  spin_unlock(&page_lock);
 
 #ifdef SANITIZE_SHADOW_BASE
   if ((uintptr_t)page2kva(return_page) >= SANITIZE_SHADOW_BASE) {
@@ -553,11 +598,10 @@ page_is_allocated(const struct PageInfo *pp) {
 }
 
 //
-// Return a page to the free list.
-// (This function should only be called when pp->pp_ref reaches 0.)
+// Return a page to the free list, with page_lock held.
 //
-void
-page_free(struct PageInfo *pp) {
+static void
+page_free_locked(struct PageInfo *pp) {
   // Hint: You may want to panic if pp->pp_ref is nonzero or
   // pp->pp_link is not NULL.
   if ((pp->pp_ref != 0) || (pp->pp_link != NULL)) {
@@ -570,14 +614,38 @@ page_free(struct PageInfo *pp) {
   }
 }
 
+//
+// Return a page to the free list.
+// (This function should only be called when pp->pp_ref reaches 0.)
+//
+void
+page_free(struct PageInfo *pp) {
+  spin_lock(&page_lock);
+  page_free_locked(pp);
+  spin_unlock(&page_lock);
+}
+
 //
 // Decrement the reference count on a page,
 // freeing it if there are no more refs.
 //
 void
 page_decref(struct PageInfo *pp) {
+  spin_lock(&page_lock);
   if (--pp->pp_ref == 0)
-    page_free(pp);
+    page_free_locked(pp);
+  spin_unlock(&page_lock);
+}
+
+//
+// Take another reference to a page that may be shared
+// with other address spaces.
+//
+void
+page_incref(struct PageInfo *pp) {
+  spin_lock(&page_lock);
+  pp->pp_ref++;
+  spin_unlock(&page_lock);
 }
 
 // Given 'pgdir', a pointer to a page directory, pgdir_walk returns
@@ -716,12 +784,12 @@ page_insert(pml4e_t *pml4e, struct PageInfo *pp, void *va, int perm) {
     } else {
 			page_remove(pml4e, va);
 			*ptep = page2pa(pp) | perm | PTE_P;
-			pp->pp_ref++;
+			page_incref(pp);
 			tlb_invalidate(pml4e, va);
 		}
 	} else {
 		*ptep = page2pa(pp) | perm | PTE_P;
-		pp->pp_ref++;
+		page_incref(pp);
 	}
   // LAB 7 code end
   return 0;
@@ -1090,7 +1158,11 @@ check_kern_pml4e(void) {
   // check envs array (new test for lab 8)
   n = ROUNDUP(NENV * sizeof(struct Env), PGSIZE);
   for (i = 0; i < n; i += PGSIZE)
-    assert(check_va2pa(pml4e, UENVS + i) == PADDR(envs) + i);
+    assert(check_va2pa(pml4e, UENVS + i) == PADDR(envs_zero_page));
+
+  // check time page, which must not share its page with anything else
+  assert(PGOFF(&time_page) == 0 && sizeof(time_page) == PGSIZE);
+  assert(check_va2pa(pml4e, UTIME) == PADDR(&time_page));
 
   // check phys mem
   for (i = 0; i < npages * PGSIZE; i += PGSIZE)
@@ -1101,6 +1173,15 @@ check_kern_pml4e(void) {
     assert(check_va2pa(pml4e, KSTACKTOP - KSTKSIZE + i) == PADDR(bootstack) + i);
   assert(check_va2pa(pml4e, KSTACKTOP - PTSIZE) == ~0);
 
+  // check the per-CPU kernel stacks and their guards
+  for (n = 1; n < NCPU; n++) {
+    uintptr_t kstkbot = KSTACKTOP_CPU(n) - KSTKSIZE;
+    for (i = 0; i < KSTKSIZE; i += PGSIZE)
+      assert(check_va2pa(pml4e, kstkbot + i) == PADDR(percpu_kstacks[n]) + i);
+    for (i = 0; i < KSTKGAP; i += PGSIZE)
+      assert(check_va2pa(pml4e, kstkbot - KSTKGAP + i) == ~0);
+  }
+
   pdpe_t *pdpe = KADDR(PTE_ADDR(kern_pml4e[1]));
   pde_t *pgdir = KADDR(PTE_ADDR(pdpe[0]));
   // check PDE permissions
@@ -16,6 +16,7 @@ extern struct PageInfo *pages;
 extern size_t npages;
 
 extern pde_t *kern_pml4e;
+extern physaddr_t kern_cr3;
 
 /* This macro takes a kernel virtual address -- an address that points above
  * KERNBASE, where the machine's maximum 512MB of physical memory is mapped --
@@ -68,6 +69,7 @@ int page_insert(pml4e_t *pml4e, struct PageInfo *pp, void *va, int perm);
 void page_remove(pml4e_t *pml4e, void *va);
 struct PageInfo *page_lookup(pml4e_t *pml4e, void *va, pte_t **pte_store);
 void page_decref(struct PageInfo *pp);
+void page_incref(struct PageInfo *pp);
 int page_is_allocated(const struct PageInfo *pp);
 
 void tlb_invalidate(pml4e_t *pml4e, void *va);
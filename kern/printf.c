@@ -4,18 +4,23 @@
 #include <inc/types.h>
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
+#include <kern/console.h>
 
 static void
 putch(int ch, int *cnt) {
-  cputchar(ch);
+  cons_putc(ch);
   (*cnt)++;
 }
 
+// The whole message goes out under cons_lock, so the messages of
+// different CPUs don't get mixed up.
 int
 vcprintf(const char *fmt, va_list ap) {
   int cnt = 0;
+  bool locked = cons_lock_output();
 
   vprintfmt((void *)putch, &cnt, fmt, ap);
+  cons_unlock_output(locked);
   return cnt;
 }
 
@@ -1,79 +1,1117 @@
 #include <inc/assert.h>
+#include <inc/error.h>
 #include <inc/x86.h>
 #include <kern/env.h>
+#include <kern/fpu.h>
+#include <kern/hrtimer.h>
+#include <kern/ipc.h>
 #include <kern/monitor.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <kern/timer.h>
+#include <kern/tsc.h>
 
-struct Taskstate cpu_ts;
-void sched_halt(void);
+void sched_halt(void) __attribute__((noreturn));
+static void sched_switch(void) __attribute__((noreturn));
+
+// Multi-level feedback queue.
+//
+// Runnable environments are kept on one FIFO queue per priority level,
+// level 0 being the most important one.  An environment that uses up its
+// whole time slice at some level is demoted to the next one, while an
+// environment that gives the CPU away before its slice expires (e.g. it
+// waits for I/O) is promoted back towards its base priority.  Every
+// MLFQ_BOOST_TICKS clock ticks of a CPU the environments of that CPU
+// are moved back to their base priority, so CPU hogs sitting at the
+// bottom level are not starved by a steady stream of interactive
+// environments.
+
+// Length of the time slice at level 'lvl', in clock ticks.
+#define MLFQ_SLICE(lvl)  (1U << (lvl))
+#define MLFQ_BOOST_TICKS 32
+
+struct MlfqStat {
+  uint64_t picks;      // Times an env was dispatched from this level
+  uint64_t ticks;      // Clock ticks consumed at this level
+  uint64_t demotions;  // Envs moved down from this level
+  uint64_t promotions; // Envs moved up to this level
+};
+
+static struct EnvQueue mlfq[NCPU][NPRIO];
+static struct MlfqStat mlfq_stats[NCPU][NPRIO];
+
+// Timer for the earliest event any class asked for, on the boot CPU.
+// The callback has nothing to do: trap_dispatch() calls sched_hrtick()
+// on every one-shot interrupt.
+static struct hrtimer sched_hrtimer;
+
+// Per-CPU run queue bookkeeping; the envs themselves are queued by
+// the scheduling classes.
+//
+// The lock of a run queue protects the queues of the per-CPU classes of
+// that CPU and the scheduling state of the envs whose env_cpu it is:
+// env_status, env_on_rq, env_sleeping and the class fields.  An env only
+// changes env_cpu with the locks of both CPUs held, and the env running
+// on a CPU always belongs to its queue.  Two run queue locks are taken
+// in CPU index order, see sched_lock_other().  The shared queue of the
+// deadline class has a lock of its own, which nests inside these.
+struct RunQueue {
+  struct spinlock lock;
+  uint32_t nr_queued;  // Envs on this CPU's queues of per-CPU classes
+  uint64_t steals;     // Envs this CPU pulled while idle
+  uint64_t balances;   // Envs this CPU pulled to even out load
+  uint64_t idles;      // Times the CPU went idle without its tick
+  uint64_t idle_ns;    // Time spent idle without the tick
+  uint64_t ticks_avoided; // Periodic ticks that did not happen meanwhile
+  uint64_t ticks;      // Clock ticks
+  uint64_t hrticks;    // One-shot timer interrupts
+  uint64_t boosts;     // MLFQ priority boosts
+};
+
+static struct RunQueue sched_rq[NCPU] = {
+    [0 ... NCPU - 1] = {.lock = SPINLOCK_INITIALIZER(rq_lock, LOCK_ORDER_RQ)}};
+
+static_assert(LOCK_ORDER_RQ_LAST - LOCK_ORDER_RQ + 1 >= NCPU,
+              "a lock order for the run queue of every CPU");
+
+// Wake-up timers of envs in sys_sleep_ns(), indexed by ENVX(env_id).
+static struct hrtimer sched_sleep_timers[NENV];
+
+// Period of the scheduler tick: HPET timer 0 on the boot CPU and the
+// local APIC timers of the others fire twice a second.
+#define SCHED_TICK_NS 500000000ULL
+
+// An env that ran on some CPU within this time is considered to still
+// have its working set in that CPU's caches.
+#define SCHED_MIGRATION_COST_NS 500000ULL
+
+void
+queue_push(struct EnvQueue *q, struct Env *e) {
+  e->env_rq_next = NULL;
+  e->env_rq_prev = q->tail;
+  if (q->tail)
+    q->tail->env_rq_next = e;
+  else
+    q->head = e;
+  q->tail = e;
+  q->len++;
+}
+
+// Link 'e' in front of 'pos', or at the tail if 'pos' is NULL.
+void
+queue_insert_before(struct EnvQueue *q, struct Env *pos, struct Env *e) {
+  if (!pos) {
+    queue_push(q, e);
+    return;
+  }
+  e->env_rq_next = pos;
+  e->env_rq_prev = pos->env_rq_prev;
+  if (pos->env_rq_prev)
+    pos->env_rq_prev->env_rq_next = e;
+  else
+    q->head = e;
+  pos->env_rq_prev = e;
+  q->len++;
+}
+
+void
+queue_remove(struct EnvQueue *q, struct Env *e) {
+  if (e->env_rq_prev)
+    e->env_rq_prev->env_rq_next = e->env_rq_next;
+  else
+    q->head = e->env_rq_next;
+  if (e->env_rq_next)
+    e->env_rq_next->env_rq_prev = e->env_rq_prev;
+  else
+    q->tail = e->env_rq_prev;
+  e->env_rq_next = e->env_rq_prev = NULL;
+  q->len--;
+}
+
+// Give the run queue of every CPU its place in the lock order.
+void
+sched_init(void) {
+  for (int cpu = 0; cpu < NCPU; cpu++)
+    __spin_initlock(&sched_rq[cpu].lock, "rq_lock", LOCK_ORDER_RQ + cpu);
+}
+
+void
+sched_lock_this(void) {
+  spin_lock(&sched_rq[cpunum()].lock);
+}
+
+void
+sched_unlock_this(void) {
+  spin_unlock(&sched_rq[cpunum()].lock);
+}
+
+bool
+sched_holding_this(void) {
+  return spin_holding(&sched_rq[cpunum()].lock);
+}
+
+// Lock the run queue 'e' belongs to.  Returns its CPU, for
+// sched_unlock_cpu().
+int
+sched_lock_env(struct Env *e) {
+  int cpu;
+
+  for (;;) {
+    cpu = e->env_cpu;
+    spin_lock(&sched_rq[cpu].lock);
+    if (e->env_cpu == cpu)
+      return cpu;
+    spin_unlock(&sched_rq[cpu].lock);
+  }
+}
+
+void
+sched_unlock_cpu(int cpu) {
+  spin_unlock(&sched_rq[cpu].lock);
+}
+
+// Same as sched_lock_env(), for 'e' as envid2env() found it for 'envid'
+// without a lock held: check that it is still that environment, which
+// may have been freed, and its slot reused, meanwhile.  Envid 0 is the
+// current environment, which can't be.
+//
+// Returns the CPU on success, or -E_BAD_ENV, with nothing locked.
+int
+sched_lock_envid(struct Env *e, envid_t envid) {
+  int cpu = sched_lock_env(e);
+
+  if ((envid && e->env_id != envid) || e->env_status == ENV_FREE) {
+    sched_unlock_cpu(cpu);
+    return -E_BAD_ENV;
+  }
+  return cpu;
+}
+
+// Also lock the run queue of 'cpu', with the one of this CPU held.
+// Locks are taken in CPU index order, so the lock of this CPU may be
+// released meanwhile: anything read under it must be checked again.
+static void
+sched_lock_other(int cpu) {
+  int this = cpunum();
+
+  assert(cpu != this);
+  if (cpu < this) {
+    spin_unlock(&sched_rq[this].lock);
+    spin_lock(&sched_rq[cpu].lock);
+    spin_lock(&sched_rq[this].lock);
+  } else {
+    spin_lock(&sched_rq[cpu].lock);
+  }
+}
+
+static void
+mlfq_enqueue(struct Env *e) {
+  queue_push(&mlfq[e->env_cpu][e->env_sched_level], e);
+}
+
+static void
+mlfq_dequeue(struct Env *e) {
+  queue_remove(&mlfq[e->env_cpu][e->env_sched_level], e);
+}
+
+static void
+mlfq_set_level(struct Env *e, int level) {
+  bool queued = e->env_on_rq;
+
+  if (queued)
+    sched_dequeue(e);
+  e->env_sched_level = level;
+  e->env_slice_ticks = 0;
+  if (queued)
+    sched_enqueue(e);
+}
+
+// Most important non-empty level of the queues of 'cpu',
+// or NPRIO if nothing is runnable there.
+static int
+mlfq_top_level(int cpu) {
+  int lvl;
+
+  for (lvl = 0; lvl < NPRIO; lvl++)
+    if (mlfq[cpu][lvl].head)
+      break;
+  return lvl;
+}
+
+static bool
+mlfq_has_runnable(void) {
+  return mlfq_top_level(cpunum()) < NPRIO;
+}
+
+// Take from the least important levels first, which are the envs
+// that would wait the longest on 'from'.
+static struct Env *
+mlfq_steal(int from, int to) {
+  struct Env *e, *any = NULL;
+
+  for (int lvl = NPRIO - 1; lvl >= 0; lvl--) {
+    for (e = mlfq[from][lvl].head; e; e = e->env_rq_next) {
+      if (!sched_cache_hot(e, to))
+        return e;
+      if (!any)
+        any = e;
+    }
+  }
+  return any;
+}
+
+// Move every environment of this CPU back to its base priority.
+// Called with the run queue lock of this CPU held, which keeps the
+// envs that belong to it there.
+static void
+mlfq_boost(void) {
+  int cpu = cpunum();
+
+  for (int i = 0; i < nenvs; i++) {
+    if (envs[i].env_cpu == cpu && envs[i].env_status != ENV_FREE &&
+        envs[i].env_sched_class == SCHED_MLFQ &&
+        envs[i].env_sched_level != envs[i].env_priority)
+      mlfq_set_level(&envs[i], envs[i].env_priority);
+  }
+  sched_rq[cpu].boosts++;
+}
+
+static bool
+mlfq_tick(struct Env *cur) {
+  struct MlfqStat *stats = mlfq_stats[cpunum()];
+
+  stats[cur->env_sched_level].ticks++;
+  if (++cur->env_slice_ticks >= MLFQ_SLICE(cur->env_sched_level)) {
+    // Used up the whole slice: CPU-bound, move it down.
+    if (cur->env_sched_level < NPRIO - 1) {
+      stats[cur->env_sched_level].demotions++;
+      cur->env_sched_level++;
+    }
+    cur->env_slice_ticks = 0;
+    return 1;
+  }
+
+  // Somebody more important became runnable.
+  return mlfq_top_level(cpunum()) < cur->env_sched_level;
+}
+
+// The current environment keeps the CPU only if nothing of the same or
+// better level is waiting; once another environment is picked, env_run()
+// puts the current one at the tail of its level.
+static struct Env *
+mlfq_pick_next(struct Env *cur, bool preempted) {
+  int cpu = cpunum(), lvl;
+  struct MlfqStat *stats = mlfq_stats[cpu];
+
+  if (cur && !preempted) {
+    // Gave the CPU away before its slice ran out: treat it as
+    // interactive and move it back up towards its base priority.
+    if (cur->env_sched_level > cur->env_priority) {
+      cur->env_sched_level--;
+      stats[cur->env_sched_level].promotions++;
+    }
+    cur->env_slice_ticks = 0;
+  }
+
+  lvl = mlfq_top_level(cpu);
+  if (lvl < NPRIO && !(cur && cur->env_sched_level < lvl)) {
+    stats[lvl].picks++;
+    return mlfq[cpu][lvl].head;
+  }
+  if (cur)
+    stats[cur->env_sched_level].picks++;
+  return cur;
+}
+
+static void
+mlfq_switched_to(struct Env *e) {
+  e->env_sched_level = e->env_priority;
+  e->env_slice_ticks = 0;
+}
+
+// The counters are read without the run queue locks.
+static void
+mlfq_print_stats(void) {
+  uint64_t boosts = 0;
+
+  for (int cpu = 0; cpu < ncpu; cpu++)
+    boosts += sched_rq[cpu].boosts;
+  cprintf("priority boosts %lu\n", (unsigned long)boosts);
+  cprintf("level  queued      picks      ticks  demoted promoted\n");
+  for (int lvl = 0; lvl < NPRIO; lvl++) {
+    struct MlfqStat sum = {0};
+    uint32_t queued = 0;
+
+    for (int cpu = 0; cpu < ncpu; cpu++) {
+      queued += mlfq[cpu][lvl].len;
+      sum.picks += mlfq_stats[cpu][lvl].picks;
+      sum.ticks += mlfq_stats[cpu][lvl].ticks;
+      sum.demotions += mlfq_stats[cpu][lvl].demotions;
+      sum.promotions += mlfq_stats[cpu][lvl].promotions;
+    }
+    cprintf("%5d %7u %10lu %10lu %8lu %8lu\n", lvl, queued,
+            (unsigned long)sum.picks, (unsigned long)sum.ticks,
+            (unsigned long)sum.demotions, (unsigned long)sum.promotions);
+  }
+}
+
+struct SchedClass sched_class_mlfq = {
+    .class_name   = "mlfq",
+    .enqueue      = mlfq_enqueue,
+    .dequeue      = mlfq_dequeue,
+    .pick_next    = mlfq_pick_next,
+    .has_runnable = mlfq_has_runnable,
+    .steal        = mlfq_steal,
+    .tick         = mlfq_tick,
+    .switched_to  = mlfq_switched_to,
+    .print_stats  = mlfq_print_stats,
+};
+
+// Scheduling classes, most important first.
+static struct SchedClass *const sched_classes[] = {
+    &sched_class_deadline,
+    &sched_class_mlfq,
+    &sched_class_fair,
+};
+#define NCLASSES (sizeof(sched_classes) / sizeof(sched_classes[0]))
+
+static struct SchedClass *
+sched_class(struct Env *e) {
+  static struct SchedClass *const by_id[NSCHEDCLASSES] = {
+      [SCHED_MLFQ]     = &sched_class_mlfq,
+      [SCHED_FAIR]     = &sched_class_fair,
+      [SCHED_DEADLINE] = &sched_class_deadline,
+  };
+
+  return by_id[e->env_sched_class];
+}
+
+// Wake up an idle CPU to run 'e': the one whose queue it is on,
+// or any idle one, which will steal it.  Idle CPUs sleep without
+// their tick and would not notice otherwise.
+static void
+sched_kick(struct Env *e) {
+  int this = cpunum();
+
+  if (sched_class(e)->steal && e->env_cpu != this &&
+      cpus[e->env_cpu].cpu_status == CPU_HALTED) {
+    lapic_ipi_cpu(e->env_cpu, IRQ_OFFSET + IRQ_WAKEUP);
+    return;
+  }
+  for (int cpu = 0; cpu < ncpu; cpu++) {
+    if (cpu != this && cpus[cpu].cpu_status == CPU_HALTED) {
+      lapic_ipi_cpu(cpu, IRQ_OFFSET + IRQ_WAKEUP);
+      return;
+    }
+  }
+}
+
+// Put a runnable environment on its class' run queue.
+void
+sched_enqueue(struct Env *e) {
+  assert(spin_holding(&sched_rq[e->env_cpu].lock));
+  assert(e->env_status == ENV_RUNNABLE);
+  if (e->env_on_rq)
+    return;
+  sched_class(e)->enqueue(e);
+  if (sched_class(e)->steal)
+    sched_rq[e->env_cpu].nr_queued++;
+  e->env_on_rq = 1;
+  if (ncpu > 1)
+    sched_kick(e);
+}
+
+// Remove an environment from the run queues (no-op if it is not queued).
+void
+sched_dequeue(struct Env *e) {
+  assert(spin_holding(&sched_rq[e->env_cpu].lock));
+  if (!e->env_on_rq)
+    return;
+  sched_class(e)->dequeue(e);
+  if (sched_class(e)->steal)
+    sched_rq[e->env_cpu].nr_queued--;
+  e->env_on_rq = 0;
+}
+
+// Number of envs running or waiting on 'cpu'.
+static uint32_t
+sched_load(int cpu) {
+  return sched_rq[cpu].nr_queued + (cpus[cpu].cpu_env != NULL);
+}
+
+// CPU for a new environment: the least loaded one that is up.
+// The loads are read without the run queue locks, they are only a hint.
+int
+sched_select_cpu(void) {
+  int best = cpunum();
+
+  for (int cpu = 0; cpu < ncpu; cpu++)
+    if (cpus[cpu].cpu_status != CPU_UNUSED && sched_load(cpu) < sched_load(best))
+      best = cpu;
+  return best;
+}
+
+// Whether 'e' recently ran on a CPU other than 'cpu', so that moving
+// it there would cost it its cache footprint.
+bool
+sched_cache_hot(struct Env *e, int cpu) {
+  static uint64_t cost;
+
+  if (!cost)
+    cost = ns_to_tsc(SCHED_MIGRATION_COST_NS);
+  return e->env_last_cpu >= 0 && e->env_last_cpu != cpu &&
+         read_tsc() - e->env_last_ran < cost;
+}
+
+// Move a queued environment to the run queue of CPU 'to'.
+// Called with the run queue locks of both CPUs held.
+static void
+sched_migrate(struct Env *e, int to) {
+  struct SchedClass *cls = sched_class(e);
+
+  sched_dequeue(e);
+  if (cls->migrate)
+    cls->migrate(e, to);
+  e->env_cpu = to;
+  sched_enqueue(e);
+}
+
+// Pull an environment from the busiest CPU to this one.  An idle CPU
+// takes anything that is waiting, a busy one only evens out a real
+// imbalance.  Returns true if an environment was moved.
+static bool
+sched_balance(bool idle) {
+  int this = cpunum(), busiest = -1;
+  uint32_t max = 0;
+
+  for (int cpu = 0; cpu < ncpu; cpu++) {
+    if (cpu == this || cpus[cpu].cpu_status == CPU_UNUSED)
+      continue;
+    if (sched_rq[cpu].nr_queued > max) {
+      max     = sched_rq[cpu].nr_queued;
+      busiest = cpu;
+    }
+  }
+  if (busiest < 0 || (!idle && sched_load(busiest) < sched_load(this) + 2))
+    return 0;
+
+  sched_lock_other(busiest);
+  for (int i = 0; i < NCLASSES; i++) {
+    struct Env *e;
+
+    if (!sched_classes[i]->steal || !(e = sched_classes[i]->steal(busiest, this)))
+      continue;
+    sched_migrate(e, this);
+    if (idle)
+      sched_rq[this].steals++;
+    else
+      sched_rq[this].balances++;
+    spin_unlock(&sched_rq[busiest].lock);
+    return 1;
+  }
+  spin_unlock(&sched_rq[busiest].lock);
+  return 0;
+}
+
+// Bring 'e', which a class without per-CPU queues picked, over to this
+// CPU to run it.  It belongs to another CPU (the one it last ran on).
+static void
+sched_pull(struct Env *e) {
+  int this = cpunum(), from = e->env_cpu;
+
+  if (from == this)
+    return;
+  sched_lock_other(from);
+  // It may have been picked, or moved, meanwhile.
+  if (e->env_cpu == from && e->env_on_rq && !sched_class(e)->steal)
+    sched_migrate(e, this);
+  spin_unlock(&sched_rq[from].lock);
+}
+
+// Take a dying environment off the scheduler.
+// Called with the run queue lock of 'e' held.
+void
+sched_exit(struct Env *e) {
+  if (e->env_sleeping) {
+    timer_cancel(&sched_sleep_timers[ENVX(e->env_id)]);
+    e->env_sleeping = 0;
+  }
+  sched_dequeue(e);
+  if (sched_class(e)->switched_from)
+    sched_class(e)->switched_from(e);
+  e->env_sched_class = SCHED_MLFQ;
+}
+
+// Change the base priority of 'e', found by envid2env() for 'envid'.
+// For the feedback queue this also restarts it at that level, for the
+// fair class it changes its weight.
+//
+// Returns 0 on success, or -E_BAD_ENV if 'e' is no longer 'envid'.
+int
+sched_set_priority(struct Env *e, envid_t envid, int priority) {
+  int cpu;
+
+  assert(priority >= 0 && priority < NPRIO);
+  if ((cpu = sched_lock_envid(e, envid)) < 0)
+    return cpu;
+  e->env_priority = priority;
+  if (e->env_sched_class == SCHED_MLFQ)
+    mlfq_set_level(e, priority);
+  sched_unlock_cpu(cpu);
+  return 0;
+}
+
+// Move 'e', found by envid2env() for 'envid', to another scheduling
+// class.  Fails with -E_BAD_ENV if 'e' is no longer 'envid'.
+int
+sched_set_class(struct Env *e, envid_t envid, int sched_class_id) {
+  int cpu, r;
+
+  if ((cpu = sched_lock_envid(e, envid)) < 0)
+    return cpu;
+  r = sched_change_class(e, sched_class_id);
+  sched_unlock_cpu(cpu);
+  return r;
+}
+
+// Same as sched_set_class(), called with the run queue lock of 'e' held.
+int
+sched_change_class(struct Env *e, int sched_class_id) {
+  bool queued = e->env_on_rq;
+
+  if (sched_class_id < 0 || sched_class_id >= NSCHEDCLASSES)
+    return -E_INVAL;
+
+  if (queued)
+    sched_dequeue(e);
+  if (sched_class(e)->switched_from)
+    sched_class(e)->switched_from(e);
+  e->env_sched_class = sched_class_id;
+  if (sched_class(e)->switched_to)
+    sched_class(e)->switched_to(e);
+  if (queued)
+    sched_enqueue(e);
+  return 0;
+}
+
+// Charge the time the current environment spent running since
+// env_run() put it on the CPU.  Called on every entry to the kernel.
+void
+sched_update_curr(void) {
+  struct Env *cur = curenv;
+  uint64_t now, delta;
+
+  if (!cur || !cur->env_exec_start)
+    return;
+
+  sched_lock_this();
+  now                 = read_tsc();
+  delta               = now - cur->env_exec_start;
+  cur->env_exec_start = 0;
+  cur->env_last_ran   = now;
+  cur->env_sum_exec += delta;
+  if (sched_class(cur)->update_curr)
+    sched_class(cur)->update_curr(cur, delta);
+  sched_unlock_this();
+}
+
+// Run the timer driven work of all classes.
+// Returns true if the current environment should be preempted.
+static bool
+sched_check_timers(struct Env *cur) {
+  bool preempt = 0;
+
+  for (int i = 0; i < NCLASSES; i++)
+    if (sched_classes[i]->check_timers &&
+        sched_classes[i]->check_timers(cur))
+      preempt = 1;
+  return preempt;
+}
+
+// Whether anything runnable in a class more important than the
+// one of 'cur' is waiting.
+static bool
+sched_better_runnable(struct Env *cur) {
+  struct SchedClass *cls = sched_class(cur);
+
+  for (int i = 0; sched_classes[i] != cls; i++)
+    if (sched_classes[i]->has_runnable())
+      return 1;
+  return 0;
+}
+
+// TSC of the earliest event any class asked for, 0 if none.
+static uint64_t
+sched_next_event(struct Env *cur) {
+  uint64_t next = 0;
+
+  for (int i = 0; i < NCLASSES; i++) {
+    uint64_t t;
+
+    if (sched_classes[i]->next_event &&
+        (t = sched_classes[i]->next_event(cur)) &&
+        (!next || t < next))
+      next = t;
+  }
+  return next;
+}
+
+static void
+sched_hrtimer_fn(struct hrtimer *t) {
+}
+
+// Arm the scheduler timer for the earliest event any class asked for.
+static void
+sched_arm_hrtick(struct Env *cur) {
+  uint64_t next;
+
+  // The one-shot interrupt only reaches the boot CPU; the others
+  // rely on their clock ticks.
+  if (!hpet_oneshot_enabled() || thiscpu != bootcpu)
+    return;
+
+  next = sched_next_event(cur);
+  if (next)
+    timer_add(&sched_hrtimer, tsc_to_ns(next), sched_hrtimer_fn, NULL);
+  else if (timer_pending(&sched_hrtimer))
+    timer_cancel(&sched_hrtimer);
+}
+
+// Account one clock tick to the current environment.
+// Returns true if the current environment should be preempted.
+bool
+sched_tick(void) {
+  struct Env *cur = curenv;
+  struct RunQueue *rq = &sched_rq[cpunum()];
+  bool preempt;
+
+  sched_lock_this();
+  if (++rq->ticks % MLFQ_BOOST_TICKS == 0)
+    mlfq_boost();
+
+  // May release the lock for a while, cur is only looked at after.
+  if (ncpu > 1)
+    sched_balance(0);
+
+  if (!cur || cur->env_status != ENV_RUNNING) {
+    sched_check_timers(NULL);
+    preempt = 1;
+  } else if (sched_check_timers(cur) || sched_better_runnable(cur) ||
+             sched_class(cur)->tick(cur)) {
+    thiscpu->cpu_preempt = 1;
+    preempt = 1;
+  } else {
+    preempt = 0;
+  }
+  sched_unlock_this();
+  return preempt;
+}
+
+// Handle the scheduler's one-shot timer interrupt.
+// Returns true if the current environment should be preempted.
+bool
+sched_hrtick(void) {
+  struct Env *cur = curenv;
+  bool preempt;
+
+  sched_lock_this();
+  sched_rq[cpunum()].hrticks++;
+
+  if (!cur || cur->env_status != ENV_RUNNING) {
+    sched_check_timers(NULL);
+    preempt = 1;
+  } else if (sched_check_timers(cur) || sched_better_runnable(cur)) {
+    thiscpu->cpu_preempt = 1;
+    preempt = 1;
+  } else {
+    preempt = 0;
+  }
+  sched_unlock_this();
+  return preempt;
+}
+
+// Go idle without the periodic tick: stop it and program the local
+// APIC timer to fire once, at the earliest event any class or kernel
+// timer waits for.  Without such an event only an interrupt (e.g.
+// sched_kick()) wakes the CPU.  Returns false if the tick can't be
+// stopped on this CPU.
+static bool
+sched_idle_enter(void) {
+  uint64_t next, now, timer;
+
+  if (!lapic_timer_available())
+    return 0;
+  if (thiscpu == bootcpu) {
+    if (!timer_tick_stop())
+      return 0;
+    // Class events are covered by the local APIC timer below.
+    if (timer_pending(&sched_hrtimer))
+      timer_cancel(&sched_hrtimer);
+  }
+
+  now  = read_tsc();
+  next = sched_next_event(NULL);
+  if ((timer = timer_next_deadline()) &&
+      (!next || ns_to_tsc(timer) < next))
+    next = ns_to_tsc(timer);
+  if (next)
+    lapic_timer_oneshot(next > now ? tsc_to_ns(next - now) : 0);
+  else
+    lapic_timer_stop();
+
+  sched_rq[cpunum()].idles++;
+  thiscpu->cpu_idle_start = now;
+  thiscpu->cpu_tickless   = 1;
+  return 1;
+}
+
+// Restart the periodic tick after a tickless idle period.  Called by
+// trap() on the first interrupt after sched_halt().
+void
+sched_idle_exit(void) {
+  struct RunQueue *rq = &sched_rq[cpunum()];
+  uint64_t idle_ns;
+
+  if (!thiscpu->cpu_tickless)
+    return;
+  thiscpu->cpu_tickless = 0;
+
+  if (thiscpu == bootcpu) {
+    lapic_timer_stop();
+    timer_tick_start();
+  } else {
+    lapic_timer_periodic();
+  }
+
+  idle_ns = tsc_to_ns(read_tsc() - thiscpu->cpu_idle_start);
+  rq->idle_ns += idle_ns;
+  rq->ticks_avoided += idle_ns / SCHED_TICK_NS;
+}
+
+// Called by env_run() right before 'e' is put on the CPU.
+void
+sched_set_curr(struct Env *e) {
+  sched_arm_hrtick(e);
+}
+
+static void sched_reschedule(void *unused);
 
 // Choose a user environment to run and run it.
 void
 sched_yield(void) {
-  // Implement simple round-robin scheduling.
-  //
-  // Search through 'envs' for an ENV_RUNNABLE environment in
-  // circular fashion starting just after the env was
-  // last running.  Switch to the first such environment found.
-  //
-  // If no envs are runnable, but the environment previously
-  // running is still ENV_RUNNING, it's okay to
-  // choose that environment.
+  // Get off the kernel stack of the current environment, which may be
+  // about to be freed or to run elsewhere.
+  env_stack_call(sched_reschedule, NULL);
+}
+
+// The body of sched_yield(), on the kernel stack of this CPU.
+static void
+sched_reschedule(void *unused) {
+  // Ask every scheduling class, most important first, for the
+  // environment to run.  The class of the current environment
+  // (if it is still runnable) decides whether it keeps the CPU.
   //
   // If there are no runnable environments,
   // simply drop through to the code
   // below to halt the cpu.
+  struct Env *cur;
+
+  sched_lock_this();
+
+  // Garbage collect the current environment if it became a zombie
+  // (see env_destroy()).  Nothing else may free it, but freeing
+  // takes env_lock, which nests outside of the run queue locks.
+  if ((cur = curenv) && cur->env_status == ENV_DYING) {
+    sched_unlock_this();
+    env_free(cur);
+    curenv = NULL;
+    sched_lock_this();
+  }
 
-  // LAB 3 code
-  // If no current environment,
-  // start scanning from the beginning of array
-  int id   = curenv ? ENVX(curenv_getid()) : 0;
-  int orig = id;
-
-  do {
-    id = (id + 1) % NENV;
-    if (envs[id].env_status == ENV_RUNNABLE ||
-       (id == orig && envs[id].env_status == ENV_RUNNING)) {
-      // Found suitable environment to run
-      env_run(envs + id);
+  sched_switch();
+}
+
+// The most important environment any class wants to run next.
+static struct Env *
+sched_pick_next(struct Env *cur, bool preempted) {
+  struct Env *next;
+
+  for (int i = 0; i < NCLASSES; i++) {
+    struct SchedClass *cls = sched_classes[i];
+
+    next = cls->pick_next(cur && sched_class(cur) == cls ? cur : NULL, preempted);
+    if (next)
+      return next;
+  }
+  return NULL;
+}
+
+// The body of sched_yield(), called on the kernel stack of this CPU
+// with its run queue lock held.
+static void
+sched_switch(void) {
+  struct Env *cur, *next;
+  int this = cpunum();
+  bool preempted;
+
+  preempted = thiscpu->cpu_preempt;
+  thiscpu->cpu_preempt = 0;
+
+  for (;;) {
+    // Pulling an env from another CPU releases the lock of this one
+    // for a while, so look at the current environment every time.
+    cur = curenv;
+    if (cur && cur->env_status == ENV_DYING) {
+      sched_unlock_this();
+      sched_yield();
     }
-  } while (id != orig);
+    if (cur && cur->env_status != ENV_RUNNING)
+      cur = NULL;
+
+    if ((next = sched_pick_next(cur, preempted))) {
+      if (next->env_cpu == this)
+        env_run(next);
+      // Queued by a class shared among all CPUs: take it over.
+      sched_pull(next);
+      continue;
+    }
+    // Nothing to run here: take over work queued on a busier CPU.
+    if (ncpu > 1 && sched_balance(1))
+      continue;
+    break;
+  }
+
+  // The current environment may not be allowed to continue
+  // (e.g. it ran out of its reserved budget): queue it up.
+  if (cur) {
+    cur->env_status = ENV_RUNNABLE;
+    sched_enqueue(cur);
+  }
 
   sched_halt();
-  // LAB 3 code end
 }
 
-// Halt this CPU when there is nothing to do. Wait until the
-// timer interrupt wakes it up. This function never returns.
+static void
+sched_switch_fn(void *unused) {
+  sched_switch();
+}
+
+// Take the current environment off the CPU until sched_wakeup().
+// The caller has recorded what it waits for; returning to user mode
+// is up to whoever wakes it, so its saved registers must be final.
+// Called with the run queue lock of this CPU held, taken before the
+// one that protects what the env waits for was released, so that
+// sched_wakeup() can't get to it before it is blocked.
+// This function does not return.
+void
+sched_block(void) {
+  struct Env *cur = curenv;
+
+  assert(sched_holding_this());
+  assert(cur && cur->env_status == ENV_RUNNING);
+  cur->env_status = ENV_NOT_RUNNABLE;
+
+  // Once the run queue lock is released the env may run on another
+  // CPU or be freed, so save its FPU state and leave its address space
+  // and its kernel stack now.
+  fpu_save();
+  lcr3(kern_cr3);
+  curenv = NULL;
+  env_stack_call(sched_switch_fn, NULL);
+}
+
+// Same as sched_wakeup(), called with the run queue lock of 'e' held.
+static void
+sched_wakeup_locked(struct Env *e) {
+  if (e->env_status != ENV_NOT_RUNNABLE)
+    return;
+  e->env_status = ENV_RUNNABLE;
+  sched_enqueue(e);
+}
+
+// Make the blocked (or newly created) environment 'e' runnable.
+void
+sched_wakeup(struct Env *e) {
+  int cpu = sched_lock_env(e);
+
+  sched_wakeup_locked(e);
+  sched_unlock_cpu(cpu);
+}
+
+// Lock the run queue of this CPU and move the blocked environment 'e'
+// to it, so that env_run() can switch to it directly.
 //
+// Returns 0 on success, with the lock held, or -E_BAD_ENV, with
+// nothing locked, if 'e' is not blocked (e.g. it is dying).
+int
+sched_lock_blocked(struct Env *e) {
+  int this = cpunum(), cpu;
+
+  for (;;) {
+    cpu = e->env_cpu;
+    spin_lock(&sched_rq[MIN(cpu, this)].lock);
+    if (cpu != this)
+      spin_lock(&sched_rq[MAX(cpu, this)].lock);
+    if (e->env_cpu == cpu)
+      break;
+    if (cpu != this)
+      spin_unlock(&sched_rq[MAX(cpu, this)].lock);
+    spin_unlock(&sched_rq[MIN(cpu, this)].lock);
+  }
+
+  if (e->env_status != ENV_NOT_RUNNABLE) {
+    if (cpu != this)
+      spin_unlock(&sched_rq[cpu].lock);
+    sched_unlock_this();
+    return -E_BAD_ENV;
+  }
+  if (cpu != this) {
+    if (sched_class(e)->migrate)
+      sched_class(e)->migrate(e, this);
+    e->env_cpu = this;
+    spin_unlock(&sched_rq[cpu].lock);
+  }
+  return 0;
+}
+
+static void
+sched_sleep_timer_fn(struct hrtimer *t) {
+  struct Env *e = t->arg;
+  int cpu;
+
+  cpu = sched_lock_env(e);
+  if (e->env_sleeping) {
+    e->env_sleeping = 0;
+    sched_wakeup_locked(e);
+  }
+  sched_unlock_cpu(cpu);
+}
+
+// Block the current environment for 'ns' nanoseconds, returning 0 to
+// it when it wakes up.  Does not return, except with -E_NO_MEM when
+// there is no room for its timer.
+int
+sched_sleep(uint64_t ns) {
+  struct Env *cur = curenv;
+  uint64_t now    = timer_now_ns();
+  int r;
+
+  sched_lock_this();
+  r = timer_add(&sched_sleep_timers[ENVX(cur->env_id)],
+                ns < ~now ? now + ns : ~0ULL, sched_sleep_timer_fn, cur);
+  if (r < 0) {
+    sched_unlock_this();
+    return r;
+  }
+  cur->env_sleeping          = 1;
+  cur->env_tf->tf_regs.reg_rax = 0;
+  sched_block();
+}
+
+// The counters are read without the run queue locks.
 void
-sched_halt(void) {
-  int i;
+sched_print_stats(void) {
+  uint64_t ticks = 0, hrticks = 0;
 
-  // For debugging and testing purposes, if there are no runnable
-  // environments in the system, then drop into the kernel monitor.
-  for (i = 0; i < NENV; i++) {
+  for (int cpu = 0; cpu < ncpu; cpu++) {
+    ticks += sched_rq[cpu].ticks;
+    hrticks += sched_rq[cpu].hrticks;
+  }
+  cprintf("ticks %lu, one-shot events %lu\n", (unsigned long)ticks,
+          (unsigned long)hrticks);
+  for (int cpu = 0; cpu < ncpu; cpu++) {
+    struct RunQueue *rq = &sched_rq[cpu];
+    struct Env *e       = cpus[cpu].cpu_env;
+
+    cprintf("cpu %d: queued %u, running %08x, steals %lu, balances %lu\n",
+            cpu, rq->nr_queued, e ? e->env_id : 0,
+            (unsigned long)rq->steals, (unsigned long)rq->balances);
+    cprintf("       tickless idle %lu times, %lu ms, ticks avoided %lu\n",
+            (unsigned long)rq->idles, (unsigned long)(rq->idle_ns / 1000000),
+            (unsigned long)rq->ticks_avoided);
+  }
+  for (int i = 0; i < NCLASSES; i++) {
+    cprintf("-- %s --\n", sched_classes[i]->class_name);
+    sched_classes[i]->print_stats();
+  }
+  ipc_print_stats();
+}
+
+// Whether some environment is, or is about to be, runnable.
+static bool
+sched_any_runnable(void) {
+  for (int i = 0; i < nenvs; i++) {
     if ((envs[i].env_status == ENV_RUNNABLE ||
          envs[i].env_status == ENV_RUNNING ||
-         envs[i].env_status == ENV_DYING))
-      break;
+         envs[i].env_status == ENV_DYING ||
+         envs[i].env_sleeping))
+      return 1;
   }
-  if (i == NENV) {
+  return 0;
+}
+
+// Halt this CPU when there is nothing to do. Wait until the
+// timer interrupt wakes it up. Called with the run queue lock of
+// this CPU held, which it releases.  This function never returns.
+//
+void
+sched_halt(void) {
+  bool idle;
+
+  // The env that ran here last may run elsewhere, or be freed, once
+  // the run queue lock is released: save its FPU state, and don't
+  // leave its page tables loaded, a kernel worker may free them while
+  // this CPU halts (see env_free()).
+  fpu_save();
+  lcr3(kern_cr3);
+
+  // For debugging and testing purposes, if there are no runnable
+  // environments in the system, then drop the boot CPU into the
+  // kernel monitor.  The other CPUs just wait for work.
+  if (thiscpu == bootcpu && !sched_any_runnable()) {
+    // Envs change state under the lock of their own run queue:
+    // make sure with all of them held.
+    curenv = NULL;
+    sched_unlock_this();
+    for (int cpu = 0; cpu < ncpu; cpu++)
+      spin_lock(&sched_rq[cpu].lock);
+    idle = !sched_any_runnable();
+    for (int cpu = ncpu - 1; cpu >= 0; cpu--)
+      spin_unlock(&sched_rq[cpu].lock);
+    if (!idle)
+      sched_yield();
+
     cprintf("No runnable environments in the system!\n");
     while (1)
       monitor(NULL);
   }
 
-  // Mark that no environment is running on CPU
+  // Mark that no environment is running on this CPU
   curenv = NULL;
 
-  // Reset stack pointer, enable interrupts and then halt.
+  // Wake up in time for whatever the classes are waiting for,
+  // without the periodic tick if possible.
+  if (!sched_idle_enter())
+    sched_arm_hrtick(NULL);
+
+  // Mark that this CPU is in the HALT state until an interrupt
+  // wakes it up, see trap().
+  xchg(&thiscpu->cpu_status, CPU_HALTED);
+
+  // Reset stack pointer to the stack of this CPU, release the run
+  // queue lock only then (see env_stack_call()), enable interrupts
+  // and halt.
   asm volatile(
       "movq $0, %%rbp\n"
       "movq %0, %%rsp\n"
       "pushq $0\n"
       "pushq $0\n"
+      "call spin_unlock\n"
       "sti\n"
       "hlt\n"
       :
-      : "a"(cpu_ts.ts_esp0));
+      : "a"(CPUSTACKTOP(cpunum())), "D"(&sched_rq[cpunum()].lock));
+
+  while (1) {}
 }
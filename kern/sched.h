@@ -6,7 +6,98 @@
 #error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
+struct Env;
+
+// A scheduling policy.  Classes are consulted in order of importance:
+// an env of a less important class only runs when no more important
+// class has anything runnable.
+//
+// Classes with a steal hook keep one run queue per CPU, the one of
+// e->env_cpu; the others share a single queue among all CPUs.
+// pick_next, has_runnable and tick work on the queue of the calling CPU.
+struct SchedClass {
+  const char *class_name;
+  void (*enqueue)(struct Env *e); // e became runnable
+  void (*dequeue)(struct Env *e); // e is no longer runnable
+  // Next env to run; 'cur' is the running env of this class (or NULL),
+  // 'preempted' tells a clock preemption from a voluntary yield.
+  struct Env *(*pick_next)(struct Env *cur, bool preempted);
+  bool (*has_runnable)(void);
+  // A queued env of CPU 'from' worth moving to CPU 'to', or NULL.
+  // Envs that are not cache hot (see sched_cache_hot()) are preferred.
+  struct Env *(*steal)(int from, int to);
+  // e, dequeued from the queue of e->env_cpu, moves to CPU 'to'.
+  void (*migrate)(struct Env *e, int to);
+  bool (*tick)(struct Env *cur);                      // True to preempt cur
+  void (*update_curr)(struct Env *e, uint64_t delta); // Charge runtime
+  void (*switched_to)(struct Env *e);                 // e joined the class
+  void (*switched_from)(struct Env *e);               // e left the class
+  // Optional timer driven work (e.g. budget replenishment), called on
+  // every clock and one-shot interrupt; true to preempt cur.
+  bool (*check_timers)(struct Env *cur);
+  // TSC value of the next one-shot event the class needs, or 0.
+  uint64_t (*next_event)(struct Env *cur);
+  void (*print_stats)(void);
+};
+
+extern struct SchedClass sched_class_deadline;
+extern struct SchedClass sched_class_mlfq;
+extern struct SchedClass sched_class_fair;
+
+// Intrusive FIFO of envs linked through env_rq_next/env_rq_prev.
+struct EnvQueue {
+  struct Env *head;
+  struct Env *tail;
+  uint32_t len;
+};
+
+void queue_push(struct EnvQueue *q, struct Env *e);
+void queue_insert_before(struct EnvQueue *q, struct Env *pos, struct Env *e);
+void queue_remove(struct EnvQueue *q, struct Env *e);
+
+// Every CPU has a run queue with a lock of its own, which protects the
+// per-CPU class queues and the scheduling state (env_status transitions
+// included) of the envs that belong to the CPU, the ones with their
+// env_cpu there; see kern/sched.c.  The functions below take the locks
+// they need themselves, except for the ones marked as called with the
+// lock of the run queue of 'e', or of this CPU, held.
+
+void sched_init(void);
+void sched_lock_this(void);
+void sched_unlock_this(void);
+bool sched_holding_this(void);
+int sched_lock_env(struct Env *e);
+int sched_lock_envid(struct Env *e, envid_t envid);
+void sched_unlock_cpu(int cpu);
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
+bool sched_tick(void);
+int sched_sleep(uint64_t ns);
+bool sched_hrtick(void);
+void sched_idle_exit(void);
+void sched_update_curr(void);
+int sched_set_priority(struct Env *e, envid_t envid, int priority);
+int sched_set_class(struct Env *e, envid_t envid, int sched_class);
+int sched_set_deadline(struct Env *e, envid_t envid, uint64_t runtime_ns,
+                       uint64_t deadline_ns, uint64_t period_ns);
+void sched_wakeup(struct Env *e);
+int sched_lock_blocked(struct Env *e);
+int sched_select_cpu(void);
+bool sched_cache_hot(struct Env *e, int cpu);
+void sched_print_stats(void);
+
+// Called with the run queue lock of this CPU held.
+void sched_set_curr(struct Env *e);
+void sched_block(void) __attribute__((noreturn));
+
+// Called with the run queue lock of 'e' held.
+void sched_enqueue(struct Env *e);
+void sched_dequeue(struct Env *e);
+void sched_exit(struct Env *e);
+int sched_change_class(struct Env *e, int sched_class);
+
 #endif // !JOS_KERN_SCHED_H
@@ -0,0 +1,331 @@
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/x86.h>
+#include <kern/env.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <kern/timer.h>
+#include <kern/tsc.h>
+
+// Deadline scheduling class.
+//
+// Every env of the class reserves 'runtime' of CPU time in each 'period',
+// to be received within 'deadline' of the start of the period.  Ready envs
+// run in earliest-deadline-first order, ahead of all other classes.  An env
+// that uses up its runtime is throttled until its next period begins, so
+// it can't eat into the reservations of others; reservations are only
+// handed out while the total bandwidth stays below DL_BW_LIMIT, which
+// keeps the set schedulable.  Budget expiry and replenishment are driven
+// by the HPET one-shot timer where available, by clock ticks otherwise.
+//
+// The class keeps one set of queues for all CPUs, protected by dl_lock,
+// which also covers the env_dl_* fields of the envs in the class.  The
+// hooks are called with a run queue lock held and take dl_lock
+// themselves.  An env stays in the run queue of the CPU it last ran on
+// while it waits: sched_switch() pulls it over to the CPU that picks it.
+
+// Bandwidth (runtime / period) is kept as a fixed point fraction.
+#define DL_BW_SHIFT 20
+#define DL_BW_ONE   (1ULL << DL_BW_SHIFT)
+#define DL_BW_LIMIT (DL_BW_ONE * 95 / 100)
+
+// Limits on reservation parameters, in nanoseconds.
+#define DL_MIN_RUNTIME_NS 100000ULL
+#define DL_MAX_PERIOD_NS  10000000000ULL
+
+static struct spinlock dl_lock = SPINLOCK_INITIALIZER(dl_lock, LOCK_ORDER_DEADLINE);
+
+// Ready envs, sorted by absolute deadline.
+static struct EnvQueue dl_ready;
+// Envs waiting for their budget to be replenished.
+static struct EnvQueue dl_throttled;
+static uint64_t dl_total_bw;
+
+static uint64_t dl_nr_misses;
+static uint64_t dl_nr_overruns;
+static uint64_t dl_nr_replenishments;
+
+static uint64_t
+dl_bw(uint64_t runtime, uint64_t period) {
+  return (runtime << DL_BW_SHIFT) / period;
+}
+
+static uint64_t
+dl_next_period(struct Env *e) {
+  return e->env_dl_abs_deadline - e->env_dl_deadline + e->env_dl_period;
+}
+
+static void
+dl_new_period(struct Env *e, uint64_t now) {
+  e->env_dl_abs_deadline = now + e->env_dl_deadline;
+  e->env_dl_budget       = e->env_dl_runtime;
+}
+
+// Start a new period if the deadline of a non-throttled env has passed,
+// counting a miss if it didn't get all of its runtime before it.
+static void
+dl_check_deadline(struct Env *e, uint64_t now) {
+  if (e->env_dl_throttled || now < e->env_dl_abs_deadline)
+    return;
+  if (e->env_dl_budget > 0) {
+    e->env_dl_misses++;
+    dl_nr_misses++;
+  }
+  dl_new_period(e, now);
+}
+
+// Give a throttled env its next period's runtime once it is due.
+// Returns true if it may run again.
+static bool
+dl_replenish(struct Env *e, uint64_t now) {
+  if (now < dl_next_period(e))
+    return 0;
+
+  dl_nr_replenishments++;
+  e->env_dl_abs_deadline += e->env_dl_period;
+  // An overrun of the previous period is paid back from this one.
+  e->env_dl_budget = MIN(e->env_dl_budget + (int64_t)e->env_dl_runtime,
+                         (int64_t)e->env_dl_runtime);
+  if (e->env_dl_budget <= 0)
+    return 0;
+  // Woken up more than a period late: start over from now.
+  if (e->env_dl_abs_deadline <= now)
+    dl_new_period(e, now);
+  e->env_dl_throttled = 0;
+  return 1;
+}
+
+static void
+dl_enqueue_ready(struct Env *e) {
+  struct Env *pos = dl_ready.head;
+
+  while (pos && pos->env_dl_abs_deadline <= e->env_dl_abs_deadline)
+    pos = pos->env_rq_next;
+  queue_insert_before(&dl_ready, pos, e);
+}
+
+static void
+dl_enqueue(struct Env *e) {
+  uint64_t now = read_tsc();
+
+  spin_lock(&dl_lock);
+  if (e->env_dl_throttled && !dl_replenish(e, now)) {
+    queue_push(&dl_throttled, e);
+  } else {
+    dl_check_deadline(e, now);
+    dl_enqueue_ready(e);
+  }
+  spin_unlock(&dl_lock);
+}
+
+static void
+dl_dequeue(struct Env *e) {
+  spin_lock(&dl_lock);
+  queue_remove(e->env_dl_throttled ? &dl_throttled : &dl_ready, e);
+  spin_unlock(&dl_lock);
+}
+
+// Read without dl_lock, like the load of other CPUs.
+static bool
+dl_has_runnable(void) {
+  return dl_ready.head != NULL;
+}
+
+static void
+dl_update_curr(struct Env *e, uint64_t delta) {
+  spin_lock(&dl_lock);
+  e->env_dl_budget -= delta;
+  if (e->env_dl_budget <= 0 && !e->env_dl_throttled) {
+    e->env_dl_throttled = 1;
+    e->env_dl_overruns++;
+    dl_nr_overruns++;
+  }
+  dl_check_deadline(e, read_tsc());
+  spin_unlock(&dl_lock);
+}
+
+// Preempt 'cur' if it is throttled or an earlier deadline is ready.
+static bool
+dl_need_resched(struct Env *cur) {
+  return cur->env_dl_throttled ||
+         (dl_ready.head &&
+          dl_ready.head->env_dl_abs_deadline < cur->env_dl_abs_deadline);
+}
+
+static bool
+dl_tick(struct Env *cur) {
+  bool resched;
+
+  spin_lock(&dl_lock);
+  resched = dl_need_resched(cur);
+  spin_unlock(&dl_lock);
+  return resched;
+}
+
+static bool
+dl_check_timers(struct Env *cur) {
+  uint64_t now = read_tsc();
+  struct Env *e, *next;
+  bool woken = 0;
+
+  spin_lock(&dl_lock);
+  for (e = dl_throttled.head; e; e = next) {
+    next = e->env_rq_next;
+    if (dl_replenish(e, now)) {
+      queue_remove(&dl_throttled, e);
+      dl_enqueue_ready(e);
+      woken = 1;
+    }
+  }
+
+  if (cur && cur->env_sched_class == SCHED_DEADLINE) {
+    if (cur->env_dl_throttled)
+      dl_replenish(cur, now);
+    woken = dl_need_resched(cur);
+  }
+  spin_unlock(&dl_lock);
+  return woken;
+}
+
+static uint64_t
+dl_next_event(struct Env *cur) {
+  uint64_t next = 0;
+
+  spin_lock(&dl_lock);
+  // Budget expiry of the env about to run...
+  if (cur && cur->env_sched_class == SCHED_DEADLINE && !cur->env_dl_throttled)
+    next = read_tsc() + cur->env_dl_budget;
+
+  // ...and the earliest replenishment.
+  for (struct Env *e = dl_throttled.head; e; e = e->env_rq_next)
+    if (!next || dl_next_period(e) < next)
+      next = dl_next_period(e);
+  spin_unlock(&dl_lock);
+  return next;
+}
+
+// The env returned may belong to another CPU, see sched_switch().
+static struct Env *
+dl_pick_next(struct Env *cur, bool preempted) {
+  struct Env *first;
+
+  spin_lock(&dl_lock);
+  first = dl_ready.head;
+  if (cur && !cur->env_dl_throttled &&
+      (!first || cur->env_dl_abs_deadline <= first->env_dl_abs_deadline))
+    first = cur;
+  spin_unlock(&dl_lock);
+  return first;
+}
+
+static void
+dl_switched_to(struct Env *e) {
+  spin_lock(&dl_lock);
+  e->env_dl_throttled = 0;
+  dl_new_period(e, read_tsc());
+  spin_unlock(&dl_lock);
+}
+
+static void
+dl_switched_from(struct Env *e) {
+  spin_lock(&dl_lock);
+  dl_total_bw -= dl_bw(e->env_dl_runtime, e->env_dl_period);
+  e->env_dl_throttled = 0;
+  spin_unlock(&dl_lock);
+}
+
+// Reserve CPU time for 'e', found by envid2env() for 'envid', and move
+// it to the deadline class.
+//
+// A zero 'deadline_ns' means the deadline equals the period.
+// Returns -E_INVAL for inconsistent parameters, -E_BUSY if admitting
+// the reservation would overload the CPU and -E_BAD_ENV if 'e' is no
+// longer 'envid'.
+int
+sched_set_deadline(struct Env *e, envid_t envid, uint64_t runtime_ns,
+                   uint64_t deadline_ns, uint64_t period_ns) {
+  uint64_t runtime, deadline, period, bw, old_bw = 0;
+  int cpu, r;
+
+  if (!deadline_ns)
+    deadline_ns = period_ns;
+  if (runtime_ns < DL_MIN_RUNTIME_NS || runtime_ns > deadline_ns ||
+      deadline_ns > period_ns || period_ns > DL_MAX_PERIOD_NS)
+    return -E_INVAL;
+
+  runtime  = ns_to_tsc(runtime_ns);
+  deadline = ns_to_tsc(deadline_ns);
+  period   = ns_to_tsc(period_ns);
+  bw       = dl_bw(runtime, period);
+
+  // Budgets are enforced with the one-shot timer if there is one.
+  hpet_oneshot_init();
+
+  if ((cpu = sched_lock_envid(e, envid)) < 0)
+    return cpu;
+
+  // Admission control.  The new reservation is accounted for right
+  // away; leaving the class gives back the old one.
+  spin_lock(&dl_lock);
+  if (e->env_sched_class == SCHED_DEADLINE)
+    old_bw = dl_bw(e->env_dl_runtime, e->env_dl_period);
+  if (dl_total_bw - old_bw + bw > DL_BW_LIMIT) {
+    spin_unlock(&dl_lock);
+    sched_unlock_cpu(cpu);
+    return -E_BUSY;
+  }
+  dl_total_bw += bw;
+  spin_unlock(&dl_lock);
+
+  if (e->env_sched_class == SCHED_DEADLINE)
+    sched_change_class(e, SCHED_MLFQ);
+
+  e->env_dl_runtime  = runtime;
+  e->env_dl_deadline = deadline;
+  e->env_dl_period   = period;
+  e->env_dl_misses   = 0;
+  e->env_dl_overruns = 0;
+  r = sched_change_class(e, SCHED_DEADLINE);
+  sched_unlock_cpu(cpu);
+  return r;
+}
+
+static void
+dl_print_stats(void) {
+  spin_lock(&dl_lock);
+  cprintf("bandwidth %lu.%lu%%, ready %u, throttled %u\n",
+          (unsigned long)(dl_total_bw * 100 / DL_BW_ONE),
+          (unsigned long)(dl_total_bw * 1000 / DL_BW_ONE % 10),
+          dl_ready.len, dl_throttled.len);
+  cprintf("deadline misses %lu, overruns %lu, replenishments %lu\n",
+          (unsigned long)dl_nr_misses, (unsigned long)dl_nr_overruns,
+          (unsigned long)dl_nr_replenishments);
+  for (int i = 0; i < nenvs; i++) {
+    struct Env *e = &envs[i];
+
+    if (e->env_status != ENV_FREE && e->env_sched_class == SCHED_DEADLINE)
+      cprintf("  [%08x] runtime %luus deadline %luus period %luus "
+              "misses %u overruns %u%s\n",
+              e->env_id, (unsigned long)(tsc_to_ns(e->env_dl_runtime) / 1000),
+              (unsigned long)(tsc_to_ns(e->env_dl_deadline) / 1000),
+              (unsigned long)(tsc_to_ns(e->env_dl_period) / 1000),
+              e->env_dl_misses, e->env_dl_overruns,
+              e->env_dl_throttled ? " (throttled)" : "");
+  }
+  spin_unlock(&dl_lock);
+}
+
+struct SchedClass sched_class_deadline = {
+    .class_name    = "deadline",
+    .enqueue       = dl_enqueue,
+    .dequeue       = dl_dequeue,
+    .pick_next     = dl_pick_next,
+    .has_runnable  = dl_has_runnable,
+    .tick          = dl_tick,
+    .update_curr   = dl_update_curr,
+    .switched_to   = dl_switched_to,
+    .switched_from = dl_switched_from,
+    .check_timers  = dl_check_timers,
+    .next_event    = dl_next_event,
+    .print_stats   = dl_print_stats,
+};
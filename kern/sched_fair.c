@@ -0,0 +1,283 @@
+#include <inc/assert.h>
+#include <inc/x86.h>
+#include <kern/env.h>
+#include <kern/sched.h>
+#include <kern/tsc.h>
+
+// Fair-share scheduling class.
+//
+// Every env is charged the TSC cycles it actually spent on the CPU
+// (see sched_update_curr()), scaled by the inverse of its weight, into
+// its virtual runtime.  Runnable envs are kept in an AVL tree ordered by
+// virtual runtime and the one that got the least weighted CPU time so
+// far runs next, so an env that yields just before a clock tick is not
+// favoured over one that gets preempted.
+//
+// Every CPU has its own tree and its own notion of min vruntime, under
+// the lock of its run queue; an env moving to another CPU keeps its lag
+// relative to the min vruntime.
+
+#define FAIR_WEIGHT0 1024
+
+// Weight of a fair env at each priority level.
+static const uint64_t fair_weights[NPRIO] = {1024, 512, 256, 128};
+
+static struct Env *fair_root[NCPU];
+static uint32_t fair_nr_running[NCPU];
+// Monotonic lower bound of the vruntime of the fair envs of a CPU; new
+// and waking envs are placed there so that they can't claim the time
+// they spent not running.
+static uint64_t fair_min_vruntime[NCPU];
+static uint64_t fair_preemptions[NCPU];
+
+// Minimal runtime (in TSC cycles) before a tick hands the CPU over
+// to an env with a smaller vruntime, to avoid switching back and forth.
+static uint64_t
+fair_granularity(void) {
+  static uint64_t gran;
+
+  if (!gran)
+    gran = tsc_calibrate() / 1000;
+  return gran;
+}
+
+static bool
+fair_less(struct Env *a, struct Env *b) {
+  if (a->env_vruntime != b->env_vruntime)
+    return a->env_vruntime < b->env_vruntime;
+  return a->env_id < b->env_id;
+}
+
+static int
+fair_height(struct Env *n) {
+  return n ? n->env_fair_height : 0;
+}
+
+static void
+fair_fix_height(struct Env *n) {
+  n->env_fair_height = 1 + MAX(fair_height(n->env_fair_left),
+                               fair_height(n->env_fair_right));
+}
+
+static struct Env *
+fair_rotate_right(struct Env *n) {
+  struct Env *l = n->env_fair_left;
+
+  n->env_fair_left  = l->env_fair_right;
+  l->env_fair_right = n;
+  fair_fix_height(n);
+  fair_fix_height(l);
+  return l;
+}
+
+static struct Env *
+fair_rotate_left(struct Env *n) {
+  struct Env *r = n->env_fair_right;
+
+  n->env_fair_right = r->env_fair_left;
+  r->env_fair_left  = n;
+  fair_fix_height(n);
+  fair_fix_height(r);
+  return r;
+}
+
+static struct Env *
+fair_balance(struct Env *n) {
+  int bf;
+
+  fair_fix_height(n);
+  bf = fair_height(n->env_fair_left) - fair_height(n->env_fair_right);
+  if (bf > 1) {
+    if (fair_height(n->env_fair_left->env_fair_left) <
+        fair_height(n->env_fair_left->env_fair_right))
+      n->env_fair_left = fair_rotate_left(n->env_fair_left);
+    return fair_rotate_right(n);
+  }
+  if (bf < -1) {
+    if (fair_height(n->env_fair_right->env_fair_right) <
+        fair_height(n->env_fair_right->env_fair_left))
+      n->env_fair_right = fair_rotate_right(n->env_fair_right);
+    return fair_rotate_left(n);
+  }
+  return n;
+}
+
+static struct Env *
+fair_insert(struct Env *root, struct Env *e) {
+  if (!root) {
+    e->env_fair_left = e->env_fair_right = NULL;
+    e->env_fair_height = 1;
+    return e;
+  }
+  if (fair_less(e, root))
+    root->env_fair_left = fair_insert(root->env_fair_left, e);
+  else
+    root->env_fair_right = fair_insert(root->env_fair_right, e);
+  return fair_balance(root);
+}
+
+static struct Env *
+fair_leftmost(struct Env *root) {
+  while (root && root->env_fair_left)
+    root = root->env_fair_left;
+  return root;
+}
+
+static struct Env *
+fair_remove_min(struct Env *root) {
+  if (!root->env_fair_left)
+    return root->env_fair_right;
+  root->env_fair_left = fair_remove_min(root->env_fair_left);
+  return fair_balance(root);
+}
+
+static struct Env *
+fair_remove(struct Env *root, struct Env *e) {
+  struct Env *l, *r, *m;
+
+  assert(root);
+  if (root == e) {
+    l = e->env_fair_left;
+    r = e->env_fair_right;
+    e->env_fair_left = e->env_fair_right = NULL;
+    if (!r)
+      return l;
+    m                 = fair_leftmost(r);
+    m->env_fair_right = fair_remove_min(r);
+    m->env_fair_left  = l;
+    return fair_balance(m);
+  }
+  if (fair_less(e, root))
+    root->env_fair_left = fair_remove(root->env_fair_left, e);
+  else
+    root->env_fair_right = fair_remove(root->env_fair_right, e);
+  return fair_balance(root);
+}
+
+static void
+fair_update_min_vruntime(int cpu, struct Env *cur) {
+  struct Env *left = fair_leftmost(fair_root[cpu]);
+  uint64_t vruntime;
+
+  if (cur && left)
+    vruntime = MIN(cur->env_vruntime, left->env_vruntime);
+  else if (cur)
+    vruntime = cur->env_vruntime;
+  else if (left)
+    vruntime = left->env_vruntime;
+  else
+    return;
+
+  fair_min_vruntime[cpu] = MAX(fair_min_vruntime[cpu], vruntime);
+}
+
+static void
+fair_enqueue(struct Env *e) {
+  int cpu = e->env_cpu;
+
+  e->env_vruntime = MAX(e->env_vruntime, fair_min_vruntime[cpu]);
+  fair_root[cpu]  = fair_insert(fair_root[cpu], e);
+  fair_nr_running[cpu]++;
+}
+
+static void
+fair_dequeue(struct Env *e) {
+  int cpu = e->env_cpu;
+
+  fair_root[cpu] = fair_remove(fair_root[cpu], e);
+  fair_nr_running[cpu]--;
+}
+
+static bool
+fair_has_runnable(void) {
+  return fair_root[cpunum()] != NULL;
+}
+
+// Prefer the env with the largest vruntime: it is the one that would
+// have waited the longest on 'from'.
+static struct Env *
+fair_steal(int from, int to) {
+  struct Env *e = fair_root[from], *any = NULL;
+
+  while (e) {
+    if (!sched_cache_hot(e, to))
+      return e;
+    any = e;
+    e   = e->env_fair_right;
+  }
+  return any;
+}
+
+static void
+fair_migrate(struct Env *e, int to) {
+  e->env_vruntime = e->env_vruntime - fair_min_vruntime[e->env_cpu] +
+                    fair_min_vruntime[to];
+}
+
+static void
+fair_update_curr(struct Env *e, uint64_t delta) {
+  e->env_vruntime += delta * FAIR_WEIGHT0 / fair_weights[e->env_priority];
+  fair_update_min_vruntime(e->env_cpu, e);
+}
+
+static bool
+fair_tick(struct Env *cur) {
+  struct Env *left = fair_leftmost(fair_root[cpunum()]);
+
+  if (left && left->env_vruntime + fair_granularity() < cur->env_vruntime) {
+    fair_preemptions[cpunum()]++;
+    return 1;
+  }
+  return 0;
+}
+
+static struct Env *
+fair_pick_next(struct Env *cur, bool preempted) {
+  struct Env *left = fair_leftmost(fair_root[cpunum()]);
+
+  // A voluntary yield gives the CPU to anybody else who is waiting.
+  if (!left || (cur && preempted &&
+                left->env_vruntime + fair_granularity() >= cur->env_vruntime))
+    return cur;
+  return left;
+}
+
+static void
+fair_switched_to(struct Env *e) {
+  e->env_vruntime = fair_min_vruntime[e->env_cpu];
+}
+
+static void
+fair_print_stats(void) {
+  uint64_t preemptions = 0;
+
+  for (int cpu = 0; cpu < ncpu; cpu++)
+    preemptions += fair_preemptions[cpu];
+  cprintf("tick preemptions %lu\n", (unsigned long)preemptions);
+  for (int cpu = 0; cpu < ncpu; cpu++)
+    cprintf("cpu %d: queued %u, min vruntime %lu\n", cpu,
+            fair_nr_running[cpu], (unsigned long)fair_min_vruntime[cpu]);
+  for (int i = 0; i < nenvs; i++) {
+    if (envs[i].env_status != ENV_FREE &&
+        envs[i].env_sched_class == SCHED_FAIR)
+      cprintf("  [%08x] weight %4lu vruntime %lu runtime %lu\n",
+              envs[i].env_id,
+              (unsigned long)fair_weights[envs[i].env_priority],
+              (unsigned long)envs[i].env_vruntime,
+              (unsigned long)envs[i].env_sum_exec);
+  }
+}
+
+struct SchedClass sched_class_fair = {
+    .class_name   = "fair",
+    .enqueue      = fair_enqueue,
+    .dequeue      = fair_dequeue,
+    .pick_next    = fair_pick_next,
+    .has_runnable = fair_has_runnable,
+    .steal        = fair_steal,
+    .migrate      = fair_migrate,
+    .tick         = fair_tick,
+    .update_curr  = fair_update_curr,
+    .switched_to  = fair_switched_to,
+    .print_stats  = fair_print_stats,
+};
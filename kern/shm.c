@@ -0,0 +1,145 @@
+// Shared memory segments.
+//
+// A segment is a set of zeroed physical pages named by a key that
+// environments agree upon.  sys_shm_get() finds or creates it, and
+// sys_shm_map() maps all of its pages, in order, into the address space
+// of the caller, so any number of environments can share them.  The
+// segment holds a reference to each of its pages until sys_shm_remove();
+// after that the pages live on for as long as they stay mapped.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/memlayout.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/shm.h>
+#include <kern/spinlock.h>
+
+#define NSHM          32
+#define SHM_MAX_PAGES 256 // 1 MB
+
+struct ShmSegment {
+  uint32_t key;    // 0 if the slot is free
+  uint32_t npages;
+  struct PageInfo *pages[SHM_MAX_PAGES];
+};
+
+static struct ShmSegment shm_segs[NSHM];
+
+static void
+shm_free_pages(struct ShmSegment *seg) {
+  for (uint32_t i = 0; i < seg->npages; i++)
+    page_decref(seg->pages[i]);
+  seg->key    = 0;
+  seg->npages = 0;
+}
+
+// Return the id of the segment with key 'key', creating it with
+// 'npages' pages if there is none yet.
+//
+// Returns the id (>= 0) on success, < 0 on error.  Errors are:
+//	-E_INVAL if key is 0, npages is 0 or more than SHM_MAX_PAGES, or
+//		the segment exists with fewer than npages pages.
+//	-E_BUSY if all segments are in use.
+//	-E_NO_MEM if there are not enough free pages.
+int
+shm_get(uint32_t key, size_t npages) {
+  struct ShmSegment *seg, *free = NULL;
+  struct PageInfo *pp;
+  int r = 0;
+
+  if (!key || !npages || npages > SHM_MAX_PAGES)
+    return -E_INVAL;
+
+  spin_lock(&shm_lock);
+  for (seg = shm_segs; seg < shm_segs + NSHM; seg++) {
+    if (seg->key == key) {
+      r = npages <= seg->npages ? seg - shm_segs : -E_INVAL;
+      goto out;
+    }
+    if (!seg->key && !free)
+      free = seg;
+  }
+  if (!(seg = free)) {
+    r = -E_BUSY;
+    goto out;
+  }
+
+  seg->key = key;
+  for (seg->npages = 0; seg->npages < npages; seg->npages++) {
+    if (!(pp = page_alloc(ALLOC_ZERO))) {
+      shm_free_pages(seg);
+      r = -E_NO_MEM;
+      goto out;
+    }
+    page_incref(pp);
+    seg->pages[seg->npages] = pp;
+  }
+  r = seg - shm_segs;
+
+out:
+  spin_unlock(&shm_lock);
+  return r;
+}
+
+// Map all pages of segment 'id' at 'va' in the current environment,
+// with permissions 'perm'.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if id is not a segment, va is not page-aligned, the
+//		segment does not fit below UTOP at va, or perm is
+//		inappropriate (see sys_ipc_send_page()).
+//	-E_NO_MEM if a page table can't be allocated.  Nothing is
+//		mapped then.
+int
+shm_map(int id, void *va, int perm) {
+  struct ShmSegment *seg;
+  uintptr_t start = (uintptr_t)va;
+  uint32_t i;
+  int r = 0;
+
+  if (id < 0 || id >= NSHM || PGOFF(va))
+    return -E_INVAL;
+  if ((perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P) || (perm & ~PTE_SYSCALL))
+    return -E_INVAL;
+
+  spin_lock(&shm_lock);
+  seg = &shm_segs[id];
+  if (!seg->key || start >= UTOP ||
+      seg->npages > (UTOP - start) / PGSIZE) {
+    r = -E_INVAL;
+    goto out;
+  }
+
+  for (i = 0; i < seg->npages; i++) {
+    if ((r = page_insert(curenv->env_pml4e, seg->pages[i],
+                         (void *)(start + i * PGSIZE), perm)) < 0) {
+      while (i-- > 0)
+        page_remove(curenv->env_pml4e, (void *)(start + i * PGSIZE));
+      break;
+    }
+  }
+
+out:
+  spin_unlock(&shm_lock);
+  return r;
+}
+
+// Drop segment 'id'.  Its key may be reused right away; environments
+// that have it mapped keep their pages.
+//
+// Returns 0 on success, or -E_INVAL if id is not a segment.
+int
+shm_remove(int id) {
+  if (id < 0 || id >= NSHM)
+    return -E_INVAL;
+
+  spin_lock(&shm_lock);
+  if (!shm_segs[id].key) {
+    spin_unlock(&shm_lock);
+    return -E_INVAL;
+  }
+  shm_free_pages(&shm_segs[id]);
+  spin_unlock(&shm_lock);
+  return 0;
+}
@@ -0,0 +1,15 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_SHM_H
+#define JOS_KERN_SHM_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+int shm_get(uint32_t key, size_t npages);
+int shm_map(int id, void *va, int perm);
+int shm_remove(int id);
+
+#endif // !JOS_KERN_SHM_H
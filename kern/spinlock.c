@@ -8,15 +8,84 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/kdebug.h>
+#include <kern/tsc.h>
 
-// The big kernel lock
-struct spinlock kernel_lock = {
-#ifdef DEBUG_SPINLOCK
-    .name = "kernel_lock"
+// Subsystem locks, see kern/spinlock.h for the order they nest in.
+struct spinlock env_lock     = SPINLOCK_INITIALIZER(env_lock, LOCK_ORDER_ENV);
+struct spinlock hrtimer_lock = SPINLOCK_INITIALIZER(hrtimer_lock, LOCK_ORDER_HRTIMER);
+struct spinlock shm_lock     = SPINLOCK_INITIALIZER(shm_lock, LOCK_ORDER_SHM);
+struct spinlock page_lock    = SPINLOCK_INITIALIZER(page_lock, LOCK_ORDER_PAGE);
+struct spinlock timer_lock   = SPINLOCK_INITIALIZER(timer_lock, LOCK_ORDER_TIMER);
+struct spinlock cons_lock    = SPINLOCK_INITIALIZER(cons_lock, LOCK_ORDER_CONS);
+
+#ifdef SPINLOCK_STATS
+// Every lock that has been acquired, wherever it is defined, most
+// recently listed first.
+static struct spinlock *stats_locks;
+
+// Called by the holder of 'lk', so only once for every lock.
+static void
+stats_list_lock(struct spinlock *lk) {
+  lk->stats_listed = 1;
+  lk->stats_next   = __atomic_load_n(&stats_locks, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&stats_locks, &lk->stats_next, lk, 0,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+}
 #endif
-};
 
 #ifdef DEBUG_SPINLOCK
+// Locks held by each CPU, in the order they were acquired.
+#define MAX_HELD_LOCKS 8
+
+static struct {
+  struct spinlock *locks[MAX_HELD_LOCKS];
+  int n;
+} held_locks[NCPU];
+
+static void print_pcs(uintptr_t pcs[]);
+
+// Lock order validator: 'lk' must come after every lock this CPU holds.
+static void
+check_lock_order(struct spinlock *lk) {
+  int cpu = cpunum();
+
+  if (lk->order == LOCK_ORDER_NONE)
+    return;
+  for (int i = 0; i < held_locks[cpu].n; i++) {
+    struct spinlock *held = held_locks[cpu].locks[i];
+
+    if (held->order != LOCK_ORDER_NONE && held->order >= lk->order) {
+      cprintf("Lock order violation: acquiring %s while holding %s, "
+              "which was acquired at:\n", lk->name, held->name);
+      print_pcs(held->pcs);
+      panic("lock order");
+    }
+  }
+}
+
+static void
+push_held_lock(struct spinlock *lk) {
+  int cpu = cpunum();
+
+  if (held_locks[cpu].n == MAX_HELD_LOCKS)
+    panic("Too many locks held acquiring %s", lk->name);
+  held_locks[cpu].locks[held_locks[cpu].n++] = lk;
+}
+
+static void
+pop_held_lock(struct spinlock *lk) {
+  int cpu = cpunum(), i;
+
+  for (i = held_locks[cpu].n - 1; i >= 0; i--)
+    if (held_locks[cpu].locks[i] == lk)
+      break;
+  assert(i >= 0);
+  for (; i < held_locks[cpu].n - 1; i++)
+    held_locks[cpu].locks[i] = held_locks[cpu].locks[i + 1];
+  held_locks[cpu].n--;
+}
+
 // Record the current call stack in pcs[] by following the %rbp chain.
 static void
 get_caller_pcs(uint64_t pcs[]) {
@@ -34,18 +103,45 @@ get_caller_pcs(uint64_t pcs[]) {
     pcs[i] = 0;
 }
 
-// Check whether this CPU is holding the lock.
-static int
-holding(struct spinlock *lock) {
-  return lock->locked;
+static void
+print_pcs(uintptr_t pcs[]) {
+  for (int i = 0; i < 10 && pcs[i]; i++) {
+    struct Ripdebuginfo info;
+    if (debuginfo_rip(pcs[i], &info) >= 0)
+      cprintf("  %08lx %s:%d: %.*s+%lx\n", (unsigned long)pcs[i],
+              info.rip_file, info.rip_line,
+              info.rip_fn_namelen, info.rip_fn_name,
+              (unsigned long)(pcs[i] - info.rip_fn_addr));
+    else
+      cprintf("  %08lx\n", (unsigned long)pcs[i]);
+  }
 }
 #endif
 
+// Check whether this CPU is holding the lock.  Without
+// DEBUG_SPINLOCK only whether some CPU holds it.
+bool
+spin_holding(struct spinlock *lock) {
+  bool locked = lock->owner != lock->next;
+
+#ifdef DEBUG_SPINLOCK
+  return locked && lock->cpu == thiscpu;
+#else
+  return locked;
+#endif
+}
+
 void
-__spin_initlock(struct spinlock *lk, char *name) {
-  lk->locked = 0;
+__spin_initlock(struct spinlock *lk, char *name, int order) {
+  lk->next  = 0;
+  lk->owner = 0;
+  lk->name  = name;
+#ifdef SPINLOCK_STATS
+  memset(&lk->stats, 0, sizeof(lk->stats));
+#endif
 #ifdef DEBUG_SPINLOCK
-  lk->name = name;
+  lk->order = order;
+  lk->cpu   = 0;
 #endif
 }
 
@@ -56,19 +152,40 @@ __spin_initlock(struct spinlock *lk, char *name) {
 void
 spin_lock(struct spinlock *lk) {
 #ifdef DEBUG_SPINLOCK
-  if (holding(lk))
+  if (spin_holding(lk))
     panic("Cannot acquire %s: already holding", lk->name);
+  check_lock_order(lk);
 #endif
 
-  // The xchg is atomic.
+  // The xadd is atomic.
   // It also serializes, so that reads after acquire are not
   // reordered before it.
-  while (xchg(&lk->locked, 1) != 0)
+  uint32_t ticket = xadd(&lk->next, 1);
+
+#ifdef SPINLOCK_STATS
+  uint64_t start = read_tsc(), now = start;
+
+  if (lk->owner != ticket) {
+    while (lk->owner != ticket)
+      asm volatile("pause");
+    now = read_tsc();
+    lk->stats.contended++;
+    lk->stats.spin_cycles += now - start;
+  }
+  lk->stats.acquisitions++;
+  lk->stats.hold_start = now;
+  if (!lk->stats_listed)
+    stats_list_lock(lk);
+#else
+  while (lk->owner != ticket)
     asm volatile("pause");
+#endif
 
     // Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
+  lk->cpu = thiscpu;
   get_caller_pcs(lk->pcs);
+  push_held_lock(lk);
 #endif
 }
 
@@ -76,26 +193,27 @@ spin_lock(struct spinlock *lk) {
 void
 spin_unlock(struct spinlock *lk) {
 #ifdef DEBUG_SPINLOCK
-  if (!holding(lk)) {
-    int i;
+  if (!spin_holding(lk)) {
     uintptr_t pcs[10];
     // Nab the acquiring EIP chain before it gets released
     memmove(pcs, lk->pcs, sizeof pcs);
     cprintf("Cannot release %s\nAcquired at:", lk->name);
-    for (i = 0; i < 10 && pcs[i]; i++) {
-      struct Ripdebuginfo info;
-      if (debuginfo_rip(pcs[i], &info) >= 0)
-        cprintf("  %08x %s:%d: %.*s+%lx\n", pcs[i],
-                info.rip_file, info.rip_line,
-                info.rip_fn_namelen, info.rip_fn_name,
-                pcs[i] - info.rip_fn_addr);
-      else
-        cprintf("  %08x\n", pcs[i]);
-    }
+    print_pcs(pcs);
     panic("spin_unlock");
   }
 
+  pop_held_lock(lk);
   lk->pcs[0] = 0;
+  lk->cpu    = 0;
+#endif
+
+#ifdef SPINLOCK_STATS
+  {
+    uint64_t held = read_tsc() - lk->stats.hold_start;
+
+    if (held > lk->stats.max_hold)
+      lk->stats.max_hold = held;
+  }
 #endif
 
   // The xchg serializes, so that reads before release are
@@ -107,5 +225,65 @@ spin_unlock(struct spinlock *lk) {
   // after a store. So lock->locked = 0 would work here.
   // The xchg being asm volatile ensures gcc emits it after
   // the above assignments (and after the critical section).
-  xchg(&lk->locked, 0);
+  // Only the holder writes 'owner', which passes the lock on
+  // to the next ticket.
+  xchg(&lk->owner, lk->owner + 1);
+}
+
+// Print the contention statistics of the kernel locks (the lockstat
+// monitor command) and optionally clear them.  Every lock acquired so
+// far is covered.  Locks of the same name, like the futex hash buckets
+// or the run queues of the CPUs, are summed up in one row, with their
+// number in brackets.
+void
+spin_print_stats(bool reset) {
+#ifdef SPINLOCK_STATS
+  struct spinlock *head = __atomic_load_n(&stats_locks, __ATOMIC_ACQUIRE);
+
+  cprintf("lock                acquired  contended   spin(ns)   avg spin   max hold\n");
+  for (struct spinlock *lk = head, *l; lk; lk = lk->stats_next) {
+    struct spinlock_stats sum = {0};
+    char name[24];
+    int n = 0;
+
+    // Print the row with the first lock of that name on the list.
+    for (l = head; l != lk && strcmp(l->name, lk->name); l = l->stats_next)
+      ;
+    if (l != lk)
+      continue;
+
+    for (l = lk; l; l = l->stats_next) {
+      struct spinlock_stats *st = &l->stats;
+
+      if (strcmp(l->name, lk->name))
+        continue;
+      // The counters are only written by the holder; a torn read
+      // just prints a slightly stale line.
+      n++;
+      sum.acquisitions += st->acquisitions;
+      sum.contended += st->contended;
+      sum.spin_cycles += st->spin_cycles;
+      sum.max_hold = MAX(sum.max_hold, st->max_hold);
+      if (reset) {
+        // Keep hold_start in case some CPU holds the lock right now.
+        uint64_t hold_start = st->hold_start;
+
+        memset(st, 0, sizeof(*st));
+        st->hold_start = hold_start;
+      }
+    }
+
+    if (n > 1)
+      snprintf(name, sizeof(name), "%s[%d]", lk->name, n);
+    else
+      snprintf(name, sizeof(name), "%s", lk->name);
+    cprintf("%-16s %11lu %10lu %10lu %10lu %10lu\n", name,
+            (unsigned long)sum.acquisitions, (unsigned long)sum.contended,
+            (unsigned long)tsc_to_ns(sum.spin_cycles),
+            (unsigned long)(sum.contended ? tsc_to_ns(sum.spin_cycles / sum.contended) : 0),
+            (unsigned long)tsc_to_ns(sum.max_hold));
+  }
+#else
+  cprintf("Lock statistics are disabled, see SPINLOCK_STATS\n");
+#endif
 }
@@ -6,40 +6,113 @@
 // Comment this to disable spinlock debugging
 //#define DEBUG_SPINLOCK
 
+// Comment this to disable lock contention statistics (see lockstat)
+#define SPINLOCK_STATS
+
+// Lock ordering.
+//
+// Every subsystem has its own lock.  A CPU may only acquire a lock
+// whose order is higher than the order of every lock it already holds:
+//
+//   env_lock      env table: free list, growth, env teardown (kern/env.c)
+//   futex bucket  envs waiting on futexes that hash to the bucket
+//                 (kern/futex.c)
+//   work_lock     work queued for the kernel workers (kern/kworker.c)
+//   ipc_lock      IPC rendezvous state of all envs (kern/ipc.c)
+//   rq_lock       run queue of a CPU: its per-CPU class queues and the
+//                 scheduling state of its envs (kern/sched.c); two of
+//                 them are taken in CPU index order
+//   dl_lock       shared queues of the deadline class
+//                 (kern/sched_deadline.c)
+//   hrtimer_lock  the queue of pending kernel timers (kern/hrtimer.c)
+//   shm_lock      shared memory segments (kern/shm.c)
+//   page_lock     physical page free list and reference counts
+//                 (kern/pmap.c)
+//   timer_lock    timer hardware, e.g. the HPET one-shot comparator
+//                 (kern/timer.c)
+//   cons_lock     console input and output (kern/console.c)
+//
+// so e.g. env_free() may take rq_lock and page_lock while holding
+// env_lock, but nothing may take env_lock while holding rq_lock.
+// Locks are never held in user mode or while a CPU idles, and the
+// kernel runs with interrupts disabled, so they are never taken from
+// interrupt context on a CPU that already holds them.
+//
+// With DEBUG_SPINLOCK the order is checked on every acquisition.
+enum {
+  LOCK_ORDER_NONE = 0, // Not checked
+  LOCK_ORDER_ENV,
+  LOCK_ORDER_FUTEX,
+  LOCK_ORDER_WORK,
+  LOCK_ORDER_IPC,
+  LOCK_ORDER_RQ,                          // + index of the CPU
+  LOCK_ORDER_RQ_LAST = LOCK_ORDER_RQ + 7, // NCPU of them
+  LOCK_ORDER_DEADLINE,
+  LOCK_ORDER_HRTIMER,
+  LOCK_ORDER_SHM,
+  LOCK_ORDER_PAGE,
+  LOCK_ORDER_TIMER,
+  LOCK_ORDER_CONS,
+};
+
+// Contention statistics of a lock, updated by its holder.
+struct spinlock_stats {
+  uint64_t acquisitions; // Times the lock was taken
+  uint64_t contended;    // Acquisitions that had to wait
+  uint64_t spin_cycles;  // TSC cycles spent waiting
+  uint64_t max_hold;     // Longest time the lock was held, in TSC cycles
+  uint64_t hold_start;   // TSC when the current holder got it
+};
+
 // Mutual exclusion lock.
+//
+// A ticket lock: a CPU takes the next ticket and waits until 'owner'
+// gets to it, so waiters get the lock in FIFO order and only read the
+// lock word while they spin.
 struct spinlock {
-  unsigned locked; // Is the lock held?
+  volatile uint32_t next;  // Next ticket to hand out
+  volatile uint32_t owner; // Ticket of the holder; held while != next
+  char *name;              // Name of lock.
+
+#ifdef SPINLOCK_STATS
+  struct spinlock_stats stats;
+  // Linked into the list of locks lockstat reports on the first
+  // acquisition, see spin_print_stats().
+  bool stats_listed;
+  struct spinlock *stats_next;
+#endif
 
 #ifdef DEBUG_SPINLOCK
   // For debugging:
-  char *name;        // Name of lock.
-  uintptr_t pcs[10]; // The call stack (an array of program counters)
-                     // that locked the lock.
+  int order;           // LOCK_ORDER_*
+  struct CpuInfo *cpu; // The CPU holding the lock.
+  uintptr_t pcs[10];   // The call stack (an array of program counters)
+                       // that locked the lock.
 #endif
 };
 
-void __spin_initlock(struct spinlock *lk, char *name);
+#ifdef DEBUG_SPINLOCK
+#define SPINLOCK_INITIALIZER(lock, ord) \
+  { .name = #lock, .order = (ord) }
+#else
+#define SPINLOCK_INITIALIZER(lock, ord) \
+  { .name = #lock }
+#endif
+
+void __spin_initlock(struct spinlock *lk, char *name, int order);
 void spin_lock(struct spinlock *lk);
 void spin_unlock(struct spinlock *lk);
+bool spin_holding(struct spinlock *lk);
+void spin_print_stats(bool reset);
 
-#define spin_initlock(lock) __spin_initlock(lock, #lock)
-
-extern struct spinlock kernel_lock;
-
-static inline void
-lock_kernel(void) {
-  spin_lock(&kernel_lock);
-}
-
-static inline void
-unlock_kernel(void) {
-  spin_unlock(&kernel_lock);
+#define spin_initlock(lock, order) __spin_initlock(lock, #lock, order)
 
-  // Normally we wouldn't need to do this, but QEMU only runs
-  // one CPU at a time and has a long time-slice.  Without the
-  // pause, this CPU is likely to reacquire the lock before
-  // another CPU has even been given a chance to acquire it.
-  asm volatile("pause");
-}
+// Subsystem locks, in lock order.
+extern struct spinlock env_lock;
+extern struct spinlock hrtimer_lock;
+extern struct spinlock shm_lock;
+extern struct spinlock page_lock;
+extern struct spinlock timer_lock;
+extern struct spinlock cons_lock;
 
 #endif
@@ -10,6 +10,12 @@
 #include <kern/trap.h>
 #include <kern/syscall.h>
 #include <kern/console.h>
+#include <kern/sched.h>
+#include <kern/ipc.h>
+#include <kern/shm.h>
+#include <kern/futex.h>
+#include <kern/systrace.h>
+#include <kern/tsc.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -58,27 +64,630 @@ sys_env_destroy(envid_t envid) {
 		cprintf("[%08x] exiting gracefully\n", curenv->env_id);
 	else
 		cprintf("[%08x] destroying %08x\n", curenv->env_id, e->env_id);
-	env_destroy(e);
-	return 0;
+	// e may have exited meanwhile, see env_destroy_id().
+	return env_destroy_id(e, envid);
+}
+
+// Set the base scheduling priority of environment envid.
+// Priority 0 is the most important one; the environment restarts at
+// that level of the feedback queue.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if priority is not in [0, NPRIO).
+static int
+sys_env_set_priority(envid_t envid, int priority) {
+  int r;
+  struct Env *e;
+
+  if (priority < 0 || priority >= NPRIO)
+    return -E_INVAL;
+  if ((r = envid2env(envid, &e, 1)) < 0)
+    return r;
+  return sched_set_priority(e, envid, priority);
+}
+
+// Move environment envid to scheduling class sched_class
+// (SCHED_MLFQ, SCHED_FAIR, ...).
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if sched_class is not a valid scheduling class, or is
+//		SCHED_DEADLINE (use sys_env_set_deadline for that).
+static int
+sys_env_set_sched_class(envid_t envid, int sched_class) {
+  int r;
+  struct Env *e;
+
+  if (sched_class == SCHED_DEADLINE)
+    return -E_INVAL;
+  if ((r = envid2env(envid, &e, 1)) < 0)
+    return r;
+  return sched_set_class(e, envid, sched_class);
+}
+
+// Reserve 'runtime_ns' of CPU time every 'period_ns' for environment
+// envid, to be delivered within 'deadline_ns' of the start of each period
+// (0 means the end of the period), and schedule it with SCHED_DEADLINE.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if the parameters are out of range or inconsistent.
+//	-E_BUSY if there is not enough CPU bandwidth left for the reservation.
+static int
+sys_env_set_deadline(envid_t envid, uint64_t runtime_ns,
+                     uint64_t deadline_ns, uint64_t period_ns) {
+  int r;
+  struct Env *e;
+
+  if ((r = envid2env(envid, &e, 1)) < 0)
+    return r;
+  return sched_set_deadline(e, envid, runtime_ns, deadline_ns, period_ns);
+}
+
+// Give the CPU to another runnable environment, if there is one the
+// scheduler prefers.  Returns 0 when the environment runs again.
+// (sys_yield is the kernel-space programs' entry, see kern/entry.S.)
+static void
+sys_sched_yield(void) {
+  curenv->env_tf->tf_regs.reg_rax = 0;
+  sched_yield();
+}
+
+// Block the current environment for at least 'ns' nanoseconds; it
+// takes no CPU time meanwhile.  0 just yields.
+//
+// Returns 0 after sleeping, < 0 on error.  Errors are:
+//	-E_NO_MEM if there is no kernel timer left for the wake-up.
+static int
+sys_sleep_ns(uint64_t ns) {
+  if (!ns)
+    sys_sched_yield();
+  return sched_sleep(ns);
+}
+
+// Send the message msg[0..3] to environment 'to' and block until it
+// has received it.  A receiver already waiting in sys_ipc_recv runs
+// right away, in place of the sender.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment 'to' doesn't exist, or exits before
+//		receiving the message.
+//	-E_INVAL if 'to' is the current environment.
+static int
+sys_ipc_send(envid_t to) {
+  // The words are picked up from the saved registers, see kern/ipc.c.
+  return ipc_send(to, 0);
+}
+
+// Like sys_ipc_send, but the message is two words and the page mapped
+// at 'srcva' in the current environment.  The receiver gets the same
+// physical page mapped with permissions 'perm', if it asked for one.
+//
+// Returns 0 on success, < 0 on error.  Errors are those of
+// sys_ipc_send, and:
+//	-E_INVAL if srcva is not page-aligned or not below UTOP,
+//		or no page is mapped there.
+//	-E_INVAL if perm is inappropriate, or asks for PTE_W on a
+//		read-only page.
+static int
+sys_ipc_send_page(envid_t to, void *srcva, int perm) {
+  int r;
+
+  if ((r = ipc_check_page(srcva, perm)) < 0)
+    return r;
+  return ipc_send(to, 1);
+}
+
+// Block until a message arrives from environment 'from', or from any
+// environment if 'from' is 0.  The sender's envid and the message come
+// back in registers, see sys_ipc_recv() in lib/syscall.c.  If the
+// message carries a page and 'dstva' is below UTOP, the page is mapped
+// there, and env_ipc_perm tells its permissions (0 if no page came).
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if dstva is below UTOP but not page-aligned.
+//	-E_NO_MEM if the page can't be mapped.
+static int
+sys_ipc_recv(envid_t from, void *dstva) {
+  return ipc_recv(from, dstva);
+}
+
+// Find the shared memory segment named 'key', creating it with
+// 'npages' zeroed pages if it does not exist yet.
+//
+// Returns the segment id (>= 0) on success, < 0 on error.  Errors are:
+//	-E_INVAL if key or npages is 0, npages is too big, or the existing
+//		segment is smaller than npages pages.
+//	-E_BUSY if there are too many segments.
+//	-E_NO_MEM if there are not enough free pages.
+static int
+sys_shm_get(uint32_t key, size_t npages) {
+  return shm_get(key, npages);
+}
+
+// Map shared memory segment 'id' at 'va' with permissions 'perm'.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if id is not a segment, va is not page-aligned or the
+//		segment does not fit below UTOP there, or perm is
+//		inappropriate.
+//	-E_NO_MEM if a page table can't be allocated.
+static int
+sys_shm_map(int id, void *va, int perm) {
+  return shm_map(id, va, perm);
+}
+
+// Remove shared memory segment 'id'.  Mappings of it stay valid.
+//
+// Returns 0 on success, or -E_INVAL if id is not a segment.
+static int
+sys_shm_remove(int id) {
+  return shm_remove(id);
+}
+
+// Sleep until sys_futex_wake() on 'addr', if the 32-bit word there
+// still holds 'expected'.
+//
+// Returns 0 after a wake-up, < 0 on error.  Errors are:
+//	-E_AGAIN if the word does not hold 'expected'.
+//	-E_INVAL if addr is misaligned or not mapped.
+static int
+sys_futex_wait(uint32_t *addr, uint32_t expected) {
+  return futex_wait(addr, expected);
+}
+
+// Wake up to 'n' environments sleeping on the word at 'addr', in any
+// address space that maps the same physical page.
+//
+// Returns the number woken up, < 0 on error.  Errors are:
+//	-E_INVAL if addr is misaligned or not mapped.
+static int
+sys_futex_wake(uint32_t *addr, int n) {
+  return futex_wake(addr, n);
+}
+
+// Register the page at 'va' as the system call ring of the current
+// environment, see struct Sysring and sys_enter(), or unregister the
+// ring if va is NULL.  The kernel keeps using the physical page mapped
+// there now, whatever gets mapped at va later.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if va is not page-aligned or not below UTOP, or no
+//		user-writable page is mapped there.
+static int
+sys_sysring_setup(void *va) {
+  struct PageInfo *pp = NULL;
+  pte_t *pte;
+
+  if (va) {
+    if ((uintptr_t)va >= UTOP || PGOFF(va))
+      return -E_INVAL;
+    if (!(pp = page_lookup(curenv->env_pml4e, va, &pte)) ||
+        (*pte & (PTE_U | PTE_W)) != (PTE_U | PTE_W))
+      return -E_INVAL;
+    page_incref(pp);
+  }
+  if (curenv->env_sysring)
+    page_decref(curenv->env_sysring);
+  curenv->env_sysring = pp;
+  return 0;
+}
+
+static bool syscall_batchable(uintptr_t num);
+
+// Run up to 'n' of the system calls queued in the ring of the current
+// environment, in order, and post their results, so that a batch of
+// calls costs a single kernel entry.  Stops early if the completion
+// queue is full.  Only calls that return right away can be batched;
+// those that block or give the CPU away (yield, sleep_ns, the IPC
+// calls, futex_wait, env_destroy, enter) or change the ring
+// (sysring_setup) complete with -E_INVAL.
+//
+// Returns the number of calls run, < 0 on error.  Errors are:
+//	-E_INVAL if the environment has no ring, see sys_sysring_setup().
+static int
+sys_enter(uint32_t n) {
+  struct PageInfo *pp = curenv->env_sysring;
+  struct Sysring *ring;
+  uint32_t head, done;
+
+  if (!pp)
+    return -E_INVAL;
+  // env_sysring pins the page: no batched call can change it, and
+  // env_free() releases it if a call destroys the environment.
+  ring = page2kva(pp);
+  head = ring->sq_head;
+  n    = MIN(n, ring->sq_tail - head);
+
+  // The ring may be shared with other environments: use each entry
+  // as read once.
+  for (done = 0; done < n; done++) {
+    struct SysringSqe sqe = ring->sq[(head + done) % SYSRING_ENTRIES];
+    uint32_t tail         = ring->cq_tail;
+    int64_t ret           = -E_INVAL;
+
+    if (tail - ring->cq_head >= SYSRING_ENTRIES)
+      break;
+    if (syscall_batchable(sqe.num))
+      ret = syscall(sqe.num, sqe.args[0], sqe.args[1], sqe.args[2],
+                    sqe.args[3], sqe.args[4]);
+    ring->cq[tail % SYSRING_ENTRIES] = (struct SysringCqe){
+        .user_data = sqe.user_data,
+        .ret       = ret,
+    };
+    ring->cq_tail = tail + 1;
+    ring->sq_head = head + done + 1;
+  }
+  return done;
+}
+
+// Length of the string at 's' in the current environment, if it is
+// readable and shorter than 'max' bytes.  Returns -E_INVAL otherwise.
+static int
+user_strnlen(const char *s, size_t max) {
+  for (size_t n = 0; n < max; n++) {
+    if ((!n || !PGOFF(s + n)) && user_mem_check(curenv, s + n, 1, PTE_U) < 0)
+      return -E_INVAL;
+    if (!s[n])
+      return n;
+  }
+  return -E_INVAL;
+}
+
+// Start a child of the current environment running the program 'name'
+// embedded in the kernel (e.g. "hello" for user/hello), with the
+// NULL-terminated argument vector 'argv', or none if argv is NULL.
+// The arguments are copied to the top page of the child's stack, which
+// they must fit in, for libmain() to pass them on to umain().
+//
+// Returns the envid of the child on success, < 0 on error.  Errors are:
+//	-E_INVAL if name, argv or an argument is not readable, or the
+//		arguments are too big.
+//	-E_INVALID_EXE if there is no program called name.
+//	-E_NO_FREE_ENV if no free environment is left.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_spawn(const char *name, const char *const *argv) {
+  const uintptr_t bottom = USTACKTOP - PGSIZE;
+  uintptr_t str_va, argv_va, sp;
+  uint64_t *uargv;
+  uint8_t *binary, *stack;
+  size_t strsize = 0;
+  struct Env *e;
+  int argc, len, r;
+
+  if ((len = user_strnlen(name, PGSIZE)) < 0)
+    return len;
+  if (!(binary = env_binary(name)))
+    return -E_INVALID_EXE;
+
+  // Lay out the stack: the strings on top, argv[] with its NULL below
+  // them, then argc and argv where entry.S looks for them.
+  for (argc = 0; argv; argc++) {
+    if (user_mem_check(curenv, &argv[argc], sizeof(argv[argc]), PTE_U) < 0)
+      return -E_INVAL;
+    if (!argv[argc])
+      break;
+    if ((len = user_strnlen(argv[argc], PGSIZE)) < 0)
+      return len;
+    strsize += len + 1;
+    if (strsize + (argc + 4) * sizeof(uint64_t) > PGSIZE)
+      return -E_INVAL;
+  }
+  argv_va = ROUNDDOWN(USTACKTOP - strsize, sizeof(uint64_t)) - (argc + 1) * sizeof(uint64_t);
+  sp      = ROUNDDOWN(argv_va - 2 * sizeof(uint64_t), 16);
+  if (sp < bottom)
+    return -E_INVAL;
+
+  if ((r = env_load(&e, binary, curenv->env_id)) < 0)
+    return r;
+
+  // Write through the kernel mapping of the page.  The strings are
+  // measured again as the caller may share their memory with others.
+  stack  = page2kva(page_lookup(e->env_pml4e, (void *)bottom, NULL));
+  uargv  = (uint64_t *)(stack + (argv_va - bottom));
+  str_va = USTACKTOP;
+  for (int i = 0; i < argc; i++) {
+    if ((len = user_strnlen(argv[i], str_va - (USTACKTOP - strsize))) < 0) {
+      env_free(e);
+      return len;
+    }
+    str_va -= len + 1;
+    memcpy(stack + (str_va - bottom), argv[i], len);
+    stack[str_va - bottom + len] = '\0';
+    uargv[i] = str_va;
+  }
+  uargv[argc] = 0;
+  ((uint64_t *)(stack + (sp - bottom)))[0] = argc;
+  ((uint64_t *)(stack + (sp - bottom)))[1] = argv_va;
+  e->env_tf->tf_rsp = sp;
+
+  sched_wakeup(e);
+  return e->env_id;
+}
+
+// The system calls take their arguments from registers, as words; these
+// convert them for the sys_*() functions above.
+#define SYSCALL_ARGS uintptr_t a1, uintptr_t a2, uintptr_t a3, uintptr_t a4, uintptr_t a5
+
+static uintptr_t
+call_cputs(SYSCALL_ARGS) {
+  sys_cputs((const char *)a1, (size_t)a2);
+  return 0;
+}
+
+static uintptr_t
+call_cgetc(SYSCALL_ARGS) {
+  return sys_cgetc();
+}
+
+static uintptr_t
+call_getenvid(SYSCALL_ARGS) {
+  return sys_getenvid();
+}
+
+static uintptr_t
+call_env_destroy(SYSCALL_ARGS) {
+  return sys_env_destroy((envid_t)a1);
+}
+
+static uintptr_t
+call_env_set_priority(SYSCALL_ARGS) {
+  return sys_env_set_priority((envid_t)a1, (int)a2);
+}
+
+static uintptr_t
+call_env_set_sched_class(SYSCALL_ARGS) {
+  return sys_env_set_sched_class((envid_t)a1, (int)a2);
+}
+
+static uintptr_t
+call_env_set_deadline(SYSCALL_ARGS) {
+  return sys_env_set_deadline((envid_t)a1, (uint64_t)a2, (uint64_t)a3, (uint64_t)a4);
+}
+
+static uintptr_t
+call_yield(SYSCALL_ARGS) {
+  sys_sched_yield();
+  return 0;
+}
+
+static uintptr_t
+call_sleep_ns(SYSCALL_ARGS) {
+  return sys_sleep_ns((uint64_t)a1);
+}
+
+static uintptr_t
+call_ipc_send(SYSCALL_ARGS) {
+  return sys_ipc_send((envid_t)a1);
+}
+
+static uintptr_t
+call_ipc_send_page(SYSCALL_ARGS) {
+  return sys_ipc_send_page((envid_t)a1, (void *)a2, (int)a3);
+}
+
+static uintptr_t
+call_ipc_recv(SYSCALL_ARGS) {
+  return sys_ipc_recv((envid_t)a1, (void *)a2);
+}
+
+static uintptr_t
+call_shm_get(SYSCALL_ARGS) {
+  return sys_shm_get((uint32_t)a1, (size_t)a2);
+}
+
+static uintptr_t
+call_shm_map(SYSCALL_ARGS) {
+  return sys_shm_map((int)a1, (void *)a2, (int)a3);
+}
+
+static uintptr_t
+call_shm_remove(SYSCALL_ARGS) {
+  return sys_shm_remove((int)a1);
+}
+
+static uintptr_t
+call_futex_wait(SYSCALL_ARGS) {
+  return sys_futex_wait((uint32_t *)a1, (uint32_t)a2);
+}
+
+static uintptr_t
+call_futex_wake(SYSCALL_ARGS) {
+  return sys_futex_wake((uint32_t *)a1, (int)a2);
+}
+
+static uintptr_t
+call_sysring_setup(SYSCALL_ARGS) {
+  return sys_sysring_setup((void *)a1);
+}
+
+static uintptr_t
+call_enter(SYSCALL_ARGS) {
+  return sys_enter((uint32_t)a1);
+}
+
+static uintptr_t
+call_spawn(SYSCALL_ARGS) {
+  return sys_spawn((const char *)a1, (const char *const *)a2);
+}
+
+// The system calls by number, and whether they may run in a batch of
+// sys_enter(): only those that return to the caller right away.
+static const struct {
+  const char *name;
+  uintptr_t (*call)(SYSCALL_ARGS);
+  bool batch;
+} syscall_table[NSYSCALLS] = {
+    [SYS_cputs]               = {"cputs", call_cputs, 1},
+    [SYS_cgetc]               = {"cgetc", call_cgetc, 1},
+    [SYS_getenvid]            = {"getenvid", call_getenvid, 1},
+    [SYS_env_destroy]         = {"env_destroy", call_env_destroy, 0},
+    [SYS_env_set_priority]    = {"env_set_priority", call_env_set_priority, 1},
+    [SYS_env_set_sched_class] = {"env_set_sched_class", call_env_set_sched_class, 1},
+    [SYS_env_set_deadline]    = {"env_set_deadline", call_env_set_deadline, 1},
+    [SYS_yield]               = {"yield", call_yield, 0},
+    [SYS_sleep_ns]            = {"sleep_ns", call_sleep_ns, 0},
+    [SYS_ipc_send]            = {"ipc_send", call_ipc_send, 0},
+    [SYS_ipc_send_page]       = {"ipc_send_page", call_ipc_send_page, 0},
+    [SYS_ipc_recv]            = {"ipc_recv", call_ipc_recv, 0},
+    [SYS_shm_get]             = {"shm_get", call_shm_get, 1},
+    [SYS_shm_map]             = {"shm_map", call_shm_map, 1},
+    [SYS_shm_remove]          = {"shm_remove", call_shm_remove, 1},
+    [SYS_futex_wait]          = {"futex_wait", call_futex_wait, 0},
+    [SYS_futex_wake]          = {"futex_wake", call_futex_wake, 1},
+    [SYS_sysring_setup]       = {"sysring_setup", call_sysring_setup, 0},
+    [SYS_enter]               = {"enter", call_enter, 0},
+    [SYS_spawn]               = {"spawn", call_spawn, 1},
+};
+
+static_assert(sizeof(struct Sysring) <= PGSIZE, "struct Sysring must fit in a page");
+
+static bool
+syscall_batchable(uintptr_t num) {
+  return num < NSYSCALLS && syscall_table[num].batch;
+}
+
+#ifdef SYSCALL_STATS
+// Latency buckets: bucket i counts the calls that took [2^i, 2^(i+1))
+// cycles, the last one all longer calls.
+#define SYSSTAT_BUCKETS 32
+
+struct syscall_stats {
+  uint64_t calls;    // Calls made
+  uint64_t returned; // Calls that returned directly, see syscall()
+  uint64_t cycles;   // Total cycles of the calls returned
+  uint64_t hist[SYSSTAT_BUCKETS];
+};
+
+// Kept per CPU, so that counting takes no atomic operation: a system
+// call runs to its end on the CPU it started on, with interrupts off.
+static struct syscall_stats syscall_stats[NCPU][NSYSCALLS];
+#endif
+
+// Returns the name of system call 'num', or NULL if there is none.
+const char *
+syscall_name(uintptr_t num) {
+  return num < NSYSCALLS ? syscall_table[num].name : NULL;
 }
 
 // Dispatches to the correct kernel function, passing the arguments.
+//
+// A call that blocks or switches to another environment does not
+// return here; it only counts in the statistics as made.
+static uintptr_t
+syscall_dispatch(uintptr_t syscallno, uintptr_t a1, uintptr_t a2, uintptr_t a3, uintptr_t a4, uintptr_t a5) {
+#ifdef SYSCALL_STATS
+  struct syscall_stats *st;
+  uint64_t cycles;
+  uintptr_t ret;
+  int bucket;
+#endif
+
+  if (syscallno >= NSYSCALLS || !syscall_table[syscallno].call)
+    return -E_INVAL;
+
+#ifdef SYSCALL_STATS
+  st = &syscall_stats[cpunum()][syscallno];
+  st->calls++;
+  cycles = read_tsc();
+  ret    = syscall_table[syscallno].call(a1, a2, a3, a4, a5);
+  cycles = read_tsc() - cycles;
+
+  bucket = 63 - __builtin_clzll(cycles | 1);
+  st->returned++;
+  st->cycles += cycles;
+  st->hist[MIN(bucket, SYSSTAT_BUCKETS - 1)]++;
+  return ret;
+#else
+  return syscall_table[syscallno].call(a1, a2, a3, a4, a5);
+#endif
+}
+
+// Handles system call 'syscallno' made by curenv, recording it if
+// tracing is on for curenv (see kern/systrace.c).
 uintptr_t
 syscall(uintptr_t syscallno, uintptr_t a1, uintptr_t a2, uintptr_t a3, uintptr_t a4, uintptr_t a5) {
-  // Call the function corresponding to the 'syscallno' parameter.
-  // Return any appropriate return value.
-  // LAB 8
-  if (syscallno == SYS_cputs) {
-    sys_cputs((const char *) a1, (size_t) a2);
+  uint64_t seq;
+  uintptr_t ret;
+
+  if (!systrace_enabled(curenv))
+    return syscall_dispatch(syscallno, a1, a2, a3, a4, a5);
+
+  seq = systrace_enter(syscallno, a1, a2, a3, a4, a5);
+  ret = syscall_dispatch(syscallno, a1, a2, a3, a4, a5);
+  systrace_exit(seq, ret);
+  return ret;
+}
+
+// Print the statistics of the system calls made so far (the sysstat
+// monitor command): counts and average latency of every call, or the
+// latency histogram of the call named 'name'.  Returns -E_INVAL if
+// there is no such call.
+int
+syscall_print_stats(const char *name) {
+#ifdef SYSCALL_STATS
+  struct syscall_stats sum;
+  uint64_t max = 0;
+  int num;
+
+  if (!name) {
+    cprintf("syscall                    calls   returned   avg(ns)\n");
+    for (num = 0; num < NSYSCALLS; num++) {
+      memset(&sum, 0, sizeof(sum));
+      for (int i = 0; i < NCPU; i++) {
+        sum.calls += syscall_stats[i][num].calls;
+        sum.returned += syscall_stats[i][num].returned;
+        sum.cycles += syscall_stats[i][num].cycles;
+      }
+      if (sum.calls)
+        cprintf("%-20s %11lu %10lu %9lu\n", syscall_table[num].name,
+                (unsigned long)sum.calls, (unsigned long)sum.returned,
+                (unsigned long)(sum.returned ? tsc_to_ns(sum.cycles / sum.returned) : 0));
+    }
     return 0;
-  } else if (syscallno == SYS_cgetc) {
-    return sys_cgetc();
-  } else if (syscallno == SYS_getenvid) {
-    return sys_getenvid();
-  } else if (syscallno == SYS_env_destroy) {
-    return sys_env_destroy((envid_t) a1);
-  } else {
+  }
+
+  for (num = 0; num < NSYSCALLS; num++)
+    if (!strcmp(name, syscall_table[num].name))
+      break;
+  if (num == NSYSCALLS)
     return -E_INVAL;
+
+  memset(&sum, 0, sizeof(sum));
+  for (int i = 0; i < NCPU; i++) {
+    sum.returned += syscall_stats[i][num].returned;
+    for (int b = 0; b < SYSSTAT_BUCKETS; b++)
+      sum.hist[b] += syscall_stats[i][num].hist[b];
   }
-  return -E_INVAL;
+  for (int b = 0; b < SYSSTAT_BUCKETS; b++)
+    max = MAX(max, sum.hist[b]);
+
+  cprintf("%s: %lu calls returned, by latency in cycles\n", name,
+          (unsigned long)sum.returned);
+  for (int b = 0; b < SYSSTAT_BUCKETS; b++) {
+    if (!sum.hist[b])
+      continue;
+    cprintf("  %10lu%c %10lu ", 1UL << b, b == SYSSTAT_BUCKETS - 1 ? '+' : ' ',
+            (unsigned long)sum.hist[b]);
+    for (uint64_t n = 0; n < (sum.hist[b] * 40 + max - 1) / max; n++)
+      cprintf("#");
+    cprintf("\n");
+  }
+#else
+  cprintf("System call statistics are disabled, see SYSCALL_STATS\n");
+#endif
+  return 0;
+}
+
+// Forget the statistics of the system calls made so far.
+void
+syscall_clear_stats(void) {
+#ifdef SYSCALL_STATS
+  memset(syscall_stats, 0, sizeof(syscall_stats));
+#endif
 }
@@ -6,6 +6,12 @@
 
 #include <inc/syscall.h>
 
+// Comment this to disable system call statistics (see sysstat)
+#define SYSCALL_STATS
+
 uintptr_t syscall(uintptr_t num, uintptr_t a1, uintptr_t a2, uintptr_t a3, uintptr_t a4, uintptr_t a5);
+const char *syscall_name(uintptr_t num);
+int syscall_print_stats(const char *name);
+void syscall_clear_stats(void);
 
 #endif /* !JOS_KERN_SYSCALL_H */
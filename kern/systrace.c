@@ -0,0 +1,113 @@
+// System call tracing.
+//
+// Tracing is off by default and costs a single test per system call
+// then.  Once turned on with the "systrace" monitor command, for every
+// environment or for chosen ones (env_systrace), each system call they
+// make is recorded in binary form into a ring of the last SYSTRACE_SIZE
+// calls: number, arguments, return value and TSC at entry and exit.
+// Nothing is printed until the monitor dumps the ring.
+//
+// CPUs claim records with an atomic increment of a sequence number and
+// fill them in without a lock.  A call that blocks records its exit
+// only if it returns to the env directly, so its exit TSC may stay 0.
+
+#include <inc/assert.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/syscall.h>
+#include <inc/x86.h>
+#include <kern/cpu.h>
+#include <kern/env.h>
+#include <kern/syscall.h>
+#include <kern/systrace.h>
+
+#define SYSTRACE_SIZE 512 // Must be a power of 2
+
+struct SystraceRecord {
+  uint64_t seq;       // 1 + number of calls traced before, 0 if unused
+  uint64_t enter_tsc;
+  uint64_t exit_tsc;  // 0 if the call has not returned directly (yet)
+  envid_t env;
+  uint32_t cpu;
+  uint64_t num;
+  uint64_t args[5];
+  uint64_t ret;
+};
+
+bool systrace_all;
+
+static struct SystraceRecord systrace_ring[SYSTRACE_SIZE];
+static uint64_t systrace_seq;
+
+// Record the entry of system call 'num' made by curenv.  Returns the
+// sequence number to pass to systrace_exit().
+uint64_t
+systrace_enter(uint64_t num, uint64_t a1, uint64_t a2, uint64_t a3,
+               uint64_t a4, uint64_t a5) {
+  uint64_t seq = __atomic_add_fetch(&systrace_seq, 1, __ATOMIC_RELAXED);
+  struct SystraceRecord *r = &systrace_ring[(seq - 1) % SYSTRACE_SIZE];
+
+  r->seq       = 0;
+  r->enter_tsc = read_tsc();
+  r->exit_tsc  = 0;
+  r->env       = curenv->env_id;
+  r->cpu       = cpunum();
+  r->num       = num;
+  r->args[0]   = a1;
+  r->args[1]   = a2;
+  r->args[2]   = a3;
+  r->args[3]   = a4;
+  r->args[4]   = a5;
+  r->ret       = 0;
+  __atomic_store_n(&r->seq, seq, __ATOMIC_RELEASE);
+  return seq;
+}
+
+// Record that call 'seq' returned 'ret', unless its record has been
+// reused already.
+void
+systrace_exit(uint64_t seq, uint64_t ret) {
+  struct SystraceRecord *r = &systrace_ring[(seq - 1) % SYSTRACE_SIZE];
+
+  if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != seq)
+    return;
+  r->ret      = ret;
+  r->exit_tsc = read_tsc();
+}
+
+// Print the last 'n' calls recorded, oldest first.
+void
+systrace_print(unsigned n) {
+  uint64_t last = __atomic_load_n(&systrace_seq, __ATOMIC_ACQUIRE);
+  uint64_t seq;
+
+  n = MIN(n, SYSTRACE_SIZE);
+  n = MIN((uint64_t)n, last);
+  cprintf("systrace: %s, %lu calls traced\n",
+          systrace_all ? "all envs" : "envs with env_systrace",
+          (unsigned long)last);
+  for (seq = last - n + 1; seq <= last; seq++) {
+    struct SystraceRecord *r = &systrace_ring[(seq - 1) % SYSTRACE_SIZE];
+    const char *name = syscall_name(r->num);
+
+    if (r->seq != seq)
+      continue;
+    cprintf("  %6lu cpu %u [%08x] %lu %s(%lx, %lx, %lx, %lx, %lx)",
+            (unsigned long)seq, r->cpu, r->env, (unsigned long)r->enter_tsc,
+            name ? name : "?", (unsigned long)r->args[0],
+            (unsigned long)r->args[1], (unsigned long)r->args[2],
+            (unsigned long)r->args[3], (unsigned long)r->args[4]);
+    if (r->exit_tsc)
+      cprintf(" = %ld, %lu cycles\n", (long)r->ret,
+              (unsigned long)(r->exit_tsc - r->enter_tsc));
+    else
+      cprintf(" blocked\n");
+  }
+}
+
+// Forget all calls recorded so far.
+void
+systrace_clear(void) {
+  memset(systrace_ring, 0, sizeof(systrace_ring));
+  __atomic_store_n(&systrace_seq, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,27 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_SYSTRACE_H
+#define JOS_KERN_SYSTRACE_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/env.h>
+
+// Trace the system calls of every environment, not only of those with
+// env_systrace set.
+extern bool systrace_all;
+
+static inline bool
+systrace_enabled(const struct Env *e) {
+  return systrace_all || e->env_systrace;
+}
+
+uint64_t systrace_enter(uint64_t num, uint64_t a1, uint64_t a2, uint64_t a3,
+                        uint64_t a4, uint64_t a5);
+void systrace_exit(uint64_t seq, uint64_t ret);
+void systrace_print(unsigned n);
+void systrace_clear(void);
+
+#endif // !JOS_KERN_SYSTRACE_H
@@ -10,6 +10,7 @@
 #include <kern/picirq.h>
 #include <kern/trap.h>
 #include <kern/pmap.h>
+#include <kern/spinlock.h>
 
 #define kilo      (1000ULL)
 #define Mega      (kilo * kilo)
@@ -43,16 +44,18 @@ struct Timer timer_hpet0 = {
     .timer_name        = "hpet0",
     .timer_init        = hpet_init,
     .get_cpu_freq      = hpet_cpu_frequency,
-    .enable_interrupts = hpet_enable_interrupts_tim0,
-    .handle_interrupts = hpet_handle_interrupts_tim0,
+    .enable_interrupts  = hpet_enable_interrupts_tim0,
+    .disable_interrupts = hpet_disable_interrupts_tim0,
+    .handle_interrupts  = hpet_handle_interrupts_tim0,
 };
 
 struct Timer timer_hpet1 = {
     .timer_name        = "hpet1",
     .timer_init        = hpet_init,
     .get_cpu_freq      = hpet_cpu_frequency,
-    .enable_interrupts = hpet_enable_interrupts_tim1,
-    .handle_interrupts = hpet_handle_interrupts_tim1,
+    .enable_interrupts  = hpet_enable_interrupts_tim1,
+    .disable_interrupts = hpet_disable_interrupts_tim1,
+    .handle_interrupts  = hpet_handle_interrupts_tim1,
 };
 
 struct Timer timer_acpipm = {
@@ -104,7 +107,7 @@ get_rsdp(void) {
 }
 
 // LAB 5 code
-static void *
+void *
 acpi_find_table(const char *sign) {
   static RSDT *krsdt;
   static size_t krsdt_len;
@@ -168,7 +171,7 @@ acpi_find_table(const char *sign) {
 
     hd = mmio_map_region(fadt_pa, sizeof(ACPISDTHeader));
     /* Remap since we can obtain table length only after mapping */
-    hd = mmio_remap_last_region(fadt_pa, hd, sizeof(ACPISDTHeader), krsdt->h.Length);
+    hd = mmio_remap_last_region(fadt_pa, hd, sizeof(ACPISDTHeader), hd->Length);
 
     for (size_t i = 0; i < hd->Length; i++)
       cksm = (uint8_t)(cksm + ((uint8_t *)hd)[i]);
@@ -335,6 +338,39 @@ hpet_enable_interrupts_tim1(void) {
   // LAB 5 code end
 }
 
+void
+hpet_disable_interrupts_tim0(void) {
+  hpetReg->TIM0_CONF &= ~HPET_TN_INT_ENB_CNF;
+  irq_setmask_8259A(irq_mask_8259A | (1 << IRQ_TIMER));
+}
+
+void
+hpet_disable_interrupts_tim1(void) {
+  hpetReg->TIM1_CONF &= ~HPET_TN_INT_ENB_CNF;
+  irq_setmask_8259A(irq_mask_8259A | (1 << IRQ_CLOCK));
+}
+
+// Stop the periodic scheduling tick of the boot CPU while it idles
+// (see sched_idle_enter()).  Returns false if the timer can't be
+// stopped.
+bool
+timer_tick_stop(void) {
+  if (!timer_for_schedule || !timer_for_schedule->disable_interrupts)
+    return 0;
+  spin_lock(&timer_lock);
+  timer_for_schedule->disable_interrupts();
+  spin_unlock(&timer_lock);
+  return 1;
+}
+
+// Restart the periodic tick, one full period from now.
+void
+timer_tick_start(void) {
+  spin_lock(&timer_lock);
+  timer_for_schedule->enable_interrupts();
+  spin_unlock(&timer_lock);
+}
+
 void
 hpet_handle_interrupts_tim0(void) {
   // LAB 5 code
@@ -351,6 +387,60 @@ hpet_handle_interrupts_tim1(void) {
   pic_send_eoi(IRQ_CLOCK);
 }
 
+// One-shot mode of HPET timer 1, for scheduler events that can't wait
+// for the next periodic tick.  With LegacyReplacement it raises IRQ_CLOCK,
+// so it can only be used while the periodic tick is hpet0 on IRQ_TIMER
+// (and the two lines reach the kernel through different vectors).
+static bool hpet_oneshot_ready;
+
+bool
+hpet_oneshot_init(void) {
+#ifndef CONFIG_KSPACE
+  spin_lock(&timer_lock);
+  if (!hpet_oneshot_ready && hpetReg && timer_for_schedule &&
+      timer_for_schedule->handle_interrupts == hpet_handle_interrupts_tim0) {
+    hpetReg->GEN_CONF |= HPET_LEG_RT_CNF;
+    hpetReg->TIM1_CONF = 0;
+    irq_setmask_8259A(irq_mask_8259A & ~(1 << IRQ_CLOCK));
+    hpet_oneshot_ready = 1;
+  }
+  spin_unlock(&timer_lock);
+#endif
+  return hpet_oneshot_ready;
+}
+
+bool
+hpet_oneshot_enabled(void) {
+  return hpet_oneshot_ready;
+}
+
+// Raise IRQ_CLOCK once, 'ns' nanoseconds from now.
+void
+hpet_oneshot_start(uint64_t ns) {
+  // Don't let the comparator fall behind the counter before it is
+  // written, or the interrupt is lost until the counter wraps.
+  uint64_t ticks = MAX(ns * Mega / hpetFemto, hpetFreq / (100 * kilo));
+
+  spin_lock(&timer_lock);
+  hpetReg->TIM1_CONF = HPET_TN_INT_ENB_CNF;
+  hpetReg->TIM1_COMP = hpet_get_main_cnt() + ticks;
+  spin_unlock(&timer_lock);
+}
+
+void
+hpet_oneshot_stop(void) {
+  spin_lock(&timer_lock);
+  hpetReg->TIM1_CONF = 0;
+  spin_unlock(&timer_lock);
+}
+
+void
+hpet_handle_interrupts_oneshot(void) {
+  spin_lock(&timer_lock);
+  pic_send_eoi(IRQ_CLOCK);
+  spin_unlock(&timer_lock);
+}
+
 // LAB 5: Your code here.
 // Calculate CPU frequency in Hz with the help with HPET timer.
 // Hint: use hpet_get_main_cnt function and do not forget about
@@ -383,6 +473,29 @@ pmtimer_get_timeval(void) {
 
 #define PM_FREQ 3579545
 
+// Spin for 'us' microseconds measured by the HPET main counter or,
+// without an HPET, by the ACPI PM timer.  Returns false if there is
+// neither, for the caller to fall back on the TSC.
+bool
+timer_ref_delay(uint64_t us) {
+  if (hpetReg) {
+    uint64_t start = hpet_get_main_cnt(), ticks = us * hpetFreq / Mega;
+
+    while (hpet_get_main_cnt() - start < ticks)
+      asm volatile("pause");
+    return 1;
+  }
+  if (acpi_find_table("FACP")) {
+    uint32_t start = pmtimer_get_timeval(), ticks = us * PM_FREQ / Mega;
+
+    // The PM timer may be only 24 bits wide.
+    while (((pmtimer_get_timeval() - start) & 0xFFFFFF) < ticks)
+      asm volatile("pause");
+    return 1;
+  }
+  return 0;
+}
+
 // LAB 5: Your code here.
 // Calculate CPU frequency in Hz with the help with ACPI PowerManagement timer.
 // Hint: use pmtimer_get_timeval function and do not forget that ACPI PM timer
@@ -14,10 +14,11 @@ struct Timer {
   void (*timer_init)(void);        // Timer init
   uint64_t (*get_cpu_freq)(void);  // Get CPU frequency
   void (*enable_interrupts)(void); // Init timer interrupts
+  void (*disable_interrupts)(void); // Stop timer interrupts (optional)
   void (*handle_interrupts)(void);
 };
 
-#define MAX_TIMERS 5
+#define MAX_TIMERS 6
 
 extern struct Timer timertab[MAX_TIMERS];
 
@@ -26,6 +27,7 @@ extern struct Timer timer_rtc;
 extern struct Timer timer_hpet0;
 extern struct Timer timer_hpet1;
 extern struct Timer timer_acpipm;
+extern struct Timer timer_lapic;
 extern struct Timer *timer_for_schedule;
 
 #pragma pack(push, 1)
@@ -162,9 +164,41 @@ typedef struct {
   uint8_t Reserved3[3];
 } FADT;
 
+// Multiple APIC Description Table ("APIC" signature).
+typedef struct {
+  ACPISDTHeader h;
+  uint32_t LocalApicAddress;
+  uint32_t Flags;
+  // Variable-length list of interrupt controller structures,
+  // each starting with a MADTEntry header.
+  uint8_t Entries[];
+} MADT;
+
+typedef struct {
+  uint8_t Type;
+  uint8_t Length;
+} MADTEntry;
+
+#define MADT_LAPIC          0 // Processor local APIC
+#define MADT_LAPIC_OVERRIDE 5 // 64-bit local APIC address override
+
+typedef struct {
+  MADTEntry h;
+  uint8_t AcpiProcessorId;
+  uint8_t ApicId;
+  uint32_t Flags; // Bit 0: processor enabled
+} MADTLocalApic;
+
+typedef struct {
+  MADTEntry h;
+  uint16_t Reserved;
+  uint64_t Address;
+} MADTLocalApicOverride;
+
 #pragma pack(pop)
 
 void acpi_enable(void);
+void *acpi_find_table(const char *sign);
 RSDP *get_rsdp(void);
 FADT *get_fadt(void);
 HPET *get_hpet(void);
@@ -174,9 +208,19 @@ void hpet_init(void);
 void hpet_print_reg(void);
 void hpet_enable_interrupts_tim0(void);
 void hpet_enable_interrupts_tim1(void);
+void hpet_disable_interrupts_tim0(void);
+void hpet_disable_interrupts_tim1(void);
 uint64_t hpet_cpu_frequency(void);
 void hpet_handle_interrupts_tim0(void);
 void hpet_handle_interrupts_tim1(void);
+bool timer_ref_delay(uint64_t us);
+bool timer_tick_stop(void);
+void timer_tick_start(void);
+bool hpet_oneshot_init(void);
+bool hpet_oneshot_enabled(void);
+void hpet_oneshot_start(uint64_t ns);
+void hpet_oneshot_stop(void);
+void hpet_handle_interrupts_oneshot(void);
 
 uint32_t pmtimer_get_timeval(void);
 uint64_t pmtimer_cpu_frequency(void);
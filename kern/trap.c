@@ -14,9 +14,11 @@
 #include <kern/picirq.h>
 #include <kern/cpu.h>
 #include <kern/timer.h>
+#include <kern/hrtimer.h>
+#include <kern/fpu.h>
+#include <kern/spinlock.h>
 
 extern uintptr_t gdtdesc_64;
-static struct Taskstate ts;
 extern struct Segdesc gdt[];
 extern long gdt_pd;
 
@@ -63,6 +65,10 @@ trapname(int trapno) {
     return "System call";
   if (trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + 16)
     return "Hardware Interrupt";
+  if (trapno == IRQ_OFFSET + IRQ_LAPIC_TIMER)
+    return "Local APIC timer";
+  if (trapno == IRQ_OFFSET + IRQ_WAKEUP)
+    return "Wakeup IPI";
   return "(unknown trap)";
 }
 
@@ -84,6 +90,7 @@ trap_init(void) {
 	extern void (*gpflt_thdlr)(void);
 	extern void (*pgflt_thdlr)(void);
 	extern void (*fperr_thdlr)(void);
+	extern void (*simderr_thdlr)(void);
 
   
     
@@ -103,10 +110,19 @@ trap_init(void) {
 	SETGATE(idt[T_GPFLT], 0, GD_KT, (uint64_t) &gpflt_thdlr, 0);
 	SETGATE(idt[T_PGFLT], 0, GD_KT, (uint64_t) &pgflt_thdlr, 0);
 	SETGATE(idt[T_FPERR], 0, GD_KT, (uint64_t) &fperr_thdlr, 0);
+	SETGATE(idt[T_SIMDERR], 0, GD_KT, (uint64_t) &simderr_thdlr, 0);
     
   SETGATE(idt[T_SYSCALL], 0, GD_KT, (uint64_t) &syscall_thdlr, 3);
   // LAB 8 code
 
+  // Local APIC interrupts.
+  extern void (*spurious_thdlr)(void);
+  extern void (*lapic_timer_thdlr)(void);
+  extern void (*wakeup_thdlr)(void);
+  SETGATE(idt[IRQ_OFFSET + IRQ_SPURIOUS], 0, GD_KT, (uint64_t)&spurious_thdlr, 0);
+  SETGATE(idt[IRQ_OFFSET + IRQ_LAPIC_TIMER], 0, GD_KT, (uint64_t)&lapic_timer_thdlr, 0);
+  SETGATE(idt[IRQ_OFFSET + IRQ_WAKEUP], 0, GD_KT, (uint64_t)&wakeup_thdlr, 0);
+
   // Per-CPU setup
   trap_init_percpu();
 }
@@ -114,27 +130,63 @@ trap_init(void) {
 // Initialize and load the per-CPU TSS and IDT
 void
 trap_init_percpu(void) {
+  // The example code here sets up the Task State Segment (TSS) and
+  // the TSS descriptor for CPU 0. Every CPU gets its own TSS, pointing
+  // at its own kernel stack (see mem_init_mp()), and its own 16-byte
+  // TSS descriptor in the GDT, starting at GD_TSS0.
+  int i             = cpunum();
+  struct Taskstate *ts = &thiscpu->cpu_ts;
+
   // Setup a TSS so that we get the right stack
   // when we trap to the kernel.
-  ts.ts_esp0 = KSTACKTOP;
+  ts->ts_esp0 = KSTACKTOP_CPU(i);
 
   // Initialize the TSS slot of the gdt.
-  SETTSS((struct SystemSegdesc64 *)(&gdt[(GD_TSS0 >> 3)]), STS_T64A,
-         (uint64_t)(&ts), sizeof(struct Taskstate), 0);
+  SETTSS((struct SystemSegdesc64 *)(&gdt[(GD_TSS0 >> 3) + 2 * i]), STS_T64A,
+         (uint64_t)ts, sizeof(struct Taskstate), 0);
 
   // Load the TSS selector (like other segment selectors, the
   // bottom three bits are special; we leave them 0)
-  ltr(GD_TSS0);
+  ltr(GD_TSS0 + (i << 4));
 
   // Load the IDT
   lidt(&idt_pd);
+
+#ifndef CONFIG_KSPACE
+  // The syscall instruction enters syscall_entry with CS = GD_KT and
+  // SS = GD_KD, and interrupts and single-stepping off.  sysretq goes
+  // back to CS = STAR[63:48] + 16 and SS = STAR[63:48] + 8, hence the
+  // order of GD_UD and GD_UT in the GDT.
+  static_assert(GD_UT == GD_UD + 8, "sysretq needs GD_UT right after GD_UD");
+  extern void (*syscall_entry)(void);
+  thiscpu->cpu_kstack_top = ts->ts_esp0;
+
+  // The kernel stacks of the environments get mapped over the top of
+  // this CPU's one, see env_kstack_map().
+  thiscpu->cpu_kstack_pte = pml4e_walk(kern_pml4e, (void *)(ts->ts_esp0 - ENV_KSTKSIZE), 0);
+  assert(thiscpu->cpu_kstack_pte &&
+         PTX(ts->ts_esp0 - ENV_KSTKSIZE) + ENV_KSTKSIZE / PGSIZE <= NPTENTRIES);
+  wrmsr(MSR_STAR, (uint64_t)((GD_UD - 8) | 3) << 48 | (uint64_t)GD_KT << 32);
+  wrmsr(MSR_LSTAR, (uint64_t)&syscall_entry);
+  wrmsr(MSR_SFMASK, FL_IF | FL_TF | FL_DF | FL_AC | FL_NT);
+  wrmsr(EFER_MSR, rdmsr(EFER_MSR) | (1 << EFER_SCE));
+#endif
+
+  fpu_init_percpu();
 }
 
 void
 clock_idt_init(void) {
   extern void (*clock_thdlr)(void);
   // init idt structure
+#ifndef CONFIG_KSPACE
+  // Give IRQ_TIMER its own trap number, so that IRQ_CLOCK can be told
+  // apart and used for the HPET one-shot comparator.
+  extern void (*timer_thdlr)(void);
+  SETGATE(idt[IRQ_OFFSET + IRQ_TIMER], 0, GD_KT, (uintptr_t)(&timer_thdlr), 0);
+#else
   SETGATE(idt[IRQ_OFFSET + IRQ_TIMER], 0, GD_KT, (uintptr_t)(&clock_thdlr), 0);
+#endif
   SETGATE(idt[IRQ_OFFSET + IRQ_CLOCK], 0, GD_KT, (uintptr_t)(&clock_thdlr), 0);
   lidt(&idt_pd);
 }
@@ -203,7 +255,6 @@ trap_dispatch(struct Trapframe *tf) {
     a5                  = tf->tf_regs.reg_rsi;
     ret                 = syscall(syscallno, a1, a2, a3, a4, a5);
     tf->tf_regs.reg_rax = ret;
-    print_trapframe(tf);
     return;
   }
 
@@ -218,6 +269,13 @@ trap_dispatch(struct Trapframe *tf) {
     return;
   }
 
+  // First use of the FPU by the environment since it got the CPU,
+  // see kern/fpu.c.
+  if (tf->tf_trapno == T_DEVICE && (tf->tf_cs & 3)) {
+    fpu_trap();
+    return;
+  }
+
   // Handle spurious interrupts
   // The hardware sometimes raises these because of noise on the
   // IRQ line or other reasons. We don't care.
@@ -227,8 +285,37 @@ trap_dispatch(struct Trapframe *tf) {
     return;
   }
 
+  // Clock tick of the local APIC timer: always on the application
+  // processors, on the boot CPU with SCHED_TIMER=lapic or when woken
+  // from tickless idle.
+  if (tf->tf_trapno == IRQ_OFFSET + IRQ_LAPIC_TIMER) {
+    lapic_timer_handle();
+    timer_run_expired();
+    if (sched_tick())
+      sched_yield();
+    return;
+  }
+
+  // Another CPU queued work for this one, see sched_kick().  The
+  // scheduler runs on the way out of trap().
+  if (tf->tf_trapno == IRQ_OFFSET + IRQ_WAKEUP) {
+    lapic_eoi();
+    return;
+  }
+
+  // Kernel timer deadline, e.g. a scheduler event (budget expiry,
+  // replenishment, ...).
+  if (tf->tf_trapno == IRQ_OFFSET + IRQ_CLOCK && hpet_oneshot_enabled()) {
+    hpet_handle_interrupts_oneshot();
+    timer_run_expired();
+    if (sched_hrtick())
+      sched_yield();
+    return;
+  }
+
   // All timers are actually routed through this IRQ.
-  if (tf->tf_trapno == IRQ_OFFSET + IRQ_CLOCK) {
+  if (tf->tf_trapno == IRQ_OFFSET + IRQ_CLOCK ||
+      tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER) {
 
     // LAB 4 code
     // было изначально
@@ -241,8 +328,10 @@ trap_dispatch(struct Trapframe *tf) {
     // LAB 4 code end
 
     timer_for_schedule->handle_interrupts();
+    timer_run_expired();
 
-    sched_yield();
+    if (sched_tick())
+      sched_yield();
     return;
   }
 
@@ -277,22 +366,31 @@ trap(struct Trapframe *tf) {
 
   // cprintf("%ld", tf->tf_trapno);
 
-  assert(curenv);
-
-  // Garbage collect if current enviroment is a zombie
-  if (curenv->env_status == ENV_DYING) {
-    env_free(curenv);
-    curenv = NULL;
-    sched_yield();
+  // We may have been halted in sched_halt()
+  if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
+    sched_idle_exit();
+
+  // Without a current environment the trap can only be an interrupt
+  // that woke the CPU up in sched_halt().
+  assert(curenv || !(tf->tf_cs & 3));
+
+  if (curenv) {
+    // Garbage collect if current enviroment is a zombie
+    // (sched_yield() frees it)
+    if (curenv->env_status == ENV_DYING)
+      sched_yield();
+
+    // A trap from user mode has pushed its frame right into
+    // 'curenv->env_tf', at the top of the env's kernel stack (see
+    // env_kstack_map()), so running the environment will restart
+    // at the trap point.
+    if (tf->tf_cs & 3)
+      tf = curenv->env_tf;
+
+    // Charge the time it has just spent running to the environment.
+    sched_update_curr();
   }
 
-  // Copy trap frame (which is currently on the stack)
-  // into 'curenv->env_tf', so that running the environment
-  // will restart at the trap point.
-  curenv->env_tf = *tf;
-  // The trapframe on the stack should be ignored from here on.
-  tf = &curenv->env_tf;
-
   // Record that tf is the last real trapframe so
   // print_trapframe can print some additional information.
   last_tf = tf;
@@ -303,11 +401,44 @@ trap(struct Trapframe *tf) {
   // If we made it to this point, then no other environment was
   // scheduled, so we should return to the current environment
   // if doing so makes sense.
+  sched_lock_this();
   if (curenv && curenv->env_status == ENV_RUNNING)
     env_run(curenv);
-  else
+  sched_unlock_this();
+  sched_yield();
+}
+
+#ifndef CONFIG_KSPACE
+static_assert(offsetof(struct CpuInfo, cpu_kstack_top) == 8 &&
+                  offsetof(struct CpuInfo, cpu_user_rsp) == 16,
+              "syscall_entry uses these offsets");
+
+// Called from syscall_entry in kern/trapentry.S.  Handles a system
+// call made with the syscall instruction like trap() handles T_SYSCALL,
+// but skips what can't happen on that path and returns with sysretq
+// while the calling environment still has the CPU.
+void
+syscall_trap(struct Trapframe *tf) {
+  struct Env *cur = curenv;
+
+  if (cur->env_status == ENV_DYING)
     sched_yield();
+
+  tf = cur->env_tf;
+  sched_update_curr();
+  last_tf = tf;
+
+  tf->tf_regs.reg_rax = syscall(tf->tf_regs.reg_rax, tf->tf_regs.reg_rdx,
+                                tf->tf_regs.reg_rcx, tf->tf_regs.reg_rbx,
+                                tf->tf_regs.reg_rdi, tf->tf_regs.reg_rsi);
+
+  sched_lock_this();
+  if (curenv == cur && cur->env_status == ENV_RUNNING)
+    env_run_sysret(cur);
+  sched_unlock_this();
+  sched_yield();
 }
+#endif
 
 void
 page_fault_handler(struct Trapframe *tf) {
@@ -1,11 +1,14 @@
 /* This file mostly get from linux: arch/x86/kern/tsc.c */
 
 #include <inc/x86.h>
+#include <inc/assert.h>
 #include <inc/stdio.h>
 #include <inc/string.h>
+#include <inc/mmu.h>
 
 #include <kern/tsc.h>
 #include <kern/timer.h>
+#include <kern/kclock.h>
 
 /* The clock frequency of the i8253/i8254 PIT */
 #define PIT_TICK_RATE 1193182ul
@@ -188,6 +191,38 @@ tsc_calibrate(void) {
   return cpu_freq * 1000;
 }
 
+// Convert between TSC cycles and nanoseconds.
+uint64_t
+tsc_to_ns(uint64_t cycles) {
+  return (__uint128_t)cycles * 1000000000 / tsc_calibrate();
+}
+
+uint64_t
+ns_to_tsc(uint64_t ns) {
+  return (__uint128_t)ns * tsc_calibrate() / 1000000000;
+}
+
+// Environments read the clocks from this page, mapped read-only at
+// UTIME, see inc/time.h and clock_gettime_ns().
+union TimePageFrame time_page __attribute__((aligned(PGSIZE)));
+static_assert(sizeof(time_page) == PGSIZE, "time page shares its page");
+
+// Fill in the time page, with the wall clock from the RTC.  The TSC is
+// calibrated only once, so the page is written only here, at boot
+// before any environment runs, and needs no locking (see inc/time.h).
+void
+time_init(void) {
+  uint64_t freq = tsc_calibrate();
+  uint64_t tsc  = read_tsc();
+
+  time_page.tp.tsc_freq     = freq;
+  time_page.tp.shift        = 32;
+  time_page.tp.mult         = (1000000000ULL << 32) / freq;
+  time_page.tp.base_tsc     = tsc;
+  time_page.tp.mono_base_ns = tsc_to_ns(tsc);
+  time_page.tp.wall_base_ns = rtc_read_time() * 1000000000ULL;
+}
+
 void
 print_time(unsigned seconds) {
   cprintf("%u\n", seconds);
@@ -216,7 +251,8 @@ timer_start(const char *name) {
 
   // LAB 5 code
   for (int i = 0; i < MAX_TIMERS; i++) {
-    if (timertab[i].timer_name && !strcmp(timertab[i].timer_name, name)) {
+    if (timertab[i].timer_name && !strcmp(timertab[i].timer_name, name) &&
+        timertab[i].get_cpu_freq) {
       timer_id = i;
       timer_started = 1;
       timer = read_tsc();
@@ -248,7 +284,8 @@ void
 timer_cpu_frequency(const char *name) {
   // LAB 5 code
   for (int i = 0; i < MAX_TIMERS; i++) {
-    if (timertab[i].timer_name && !strcmp(timertab[i].timer_name, name)) {
+    if (timertab[i].timer_name && !strcmp(timertab[i].timer_name, name) &&
+        timertab[i].get_cpu_freq) {
       cprintf("%lu\n", timertab[i].get_cpu_freq());
       return;
     }
@@ -6,9 +6,24 @@
 #error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/mmu.h>
+#include <inc/time.h>
+
+// The time page mapped at UTIME.  All of its page is mapped for user
+// environments, so it is padded to keep other kernel data off it.
+union TimePageFrame {
+  struct TimePage tp;
+  uint8_t pad[PGSIZE];
+};
+
+extern union TimePageFrame time_page;
+
 uint64_t tsc_calibrate(void);
+uint64_t tsc_to_ns(uint64_t cycles);
+uint64_t ns_to_tsc(uint64_t ns);
 void timer_start(const char *name);
 void timer_stop(void);
 void timer_cpu_frequency(const char *name);
+void time_init(void);
 
 #endif // !JOS_KERN_TSC_H
@@ -27,6 +27,8 @@ static const char *const error_string[MAXERROR] =
         [E_NO_FREE_ENV] = "out of environments",
         [E_BAD_DWARF]   = "corrupted debug info",
         [E_FAULT]       = "segmentation fault",
+        [E_BUSY]        = "resource busy",
+        [E_AGAIN]       = "try again",
 };
 
 /*
@@ -0,0 +1,150 @@
+// Single-producer, single-consumer byte rings in shared memory.
+//
+// The producer only ever writes 'head' and the consumer 'tail', each
+// on its own cache line, so neither side takes a lock: a side publishes
+// its progress with a release store and reads the other's with an
+// acquire load.  Both indices run freely and wrap around, the ring
+// size being a power of 2.
+//
+// A side that can't make progress spins for a while, then sleeps in
+// the kernel.  Each side has a wake word that only the other side
+// bumps: a side reads its wake word, raises its 'waiting' flag and
+// checks the ring once more before sys_futex_wait() on the word.  The
+// other side checks that flag after moving its index, with a full
+// barrier on both sides, and bumps the word before waking it up, so
+// the sleeper either sees the new index or does not stay asleep.
+
+#include <inc/lib.h>
+
+// Tries before a blocked side goes to sleep in the kernel.
+#define RING_SPIN 128
+
+static inline uint32_t
+load_acquire(volatile uint32_t *p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void
+store_release(volatile uint32_t *p, uint32_t v) {
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+// Set up a ring in the 'len' bytes of shared memory at 'r'.  Only one
+// of the environments sharing it should do this, before the other
+// starts using it.
+int
+ring_init(struct Ring *r, size_t len) {
+  size_t size;
+
+  if (len < sizeof(*r) + 1)
+    return -E_INVAL;
+  for (size = 1; size * 2 <= len - sizeof(*r); size *= 2)
+    ;
+  memset(r, 0, sizeof(*r));
+  r->size = size;
+  return 0;
+}
+
+// Wait until the index at 'idx', moved by the other side, is no
+// longer 'seen', or the ring is closed.  'waiting' and 'wake' are the
+// flag and wake word of this side.
+static void
+ring_wait(struct Ring *r, volatile uint32_t *idx, uint32_t seen,
+          volatile uint32_t *waiting, volatile uint32_t *wake) {
+  uint32_t seq;
+
+  for (int i = 0; i < RING_SPIN; i++)
+    if (load_acquire(idx) != seen || load_acquire(&r->closed))
+      return;
+
+  seq = load_acquire(wake);
+  store_release(waiting, 1);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (load_acquire(idx) == seen && !load_acquire(&r->closed))
+    sys_futex_wait(wake, seq);
+  store_release(waiting, 0);
+}
+
+// Wake the other side up if it waits, see ring_wait().
+static void
+ring_notify(volatile uint32_t *waiting, volatile uint32_t *wake) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (load_acquire(waiting)) {
+    __atomic_fetch_add(wake, 1, __ATOMIC_RELEASE);
+    sys_futex_wake(wake, 1);
+  }
+}
+
+// Append all 'n' bytes at 'buf' to the ring, waiting for room as needed.
+// Returns n.
+size_t
+ring_write(struct Ring *r, const void *buf, size_t n) {
+  const uint8_t *p = buf;
+  uint32_t head    = r->head;
+  size_t done      = 0;
+
+  while (done < n) {
+    uint32_t tail = load_acquire(&r->tail);
+    uint32_t room = r->size - (head - tail);
+    uint32_t off  = head & (r->size - 1);
+    size_t chunk  = MIN(MIN((size_t)room, n - done), (size_t)(r->size - off));
+
+    if (!chunk) {
+      ring_wait(r, &r->tail, tail, &r->prod_waiting, &r->prod_wake);
+      continue;
+    }
+
+    memcpy(r->data + off, p + done, chunk);
+    head += chunk;
+    done += chunk;
+    store_release(&r->head, head);
+    ring_notify(&r->cons_waiting, &r->cons_wake);
+  }
+  return n;
+}
+
+// Take up to 'n' bytes out of the ring into 'buf', waiting until there
+// is at least one.  Returns the number of bytes read, 0 once the ring
+// is closed and empty.
+size_t
+ring_read(struct Ring *r, void *buf, size_t n) {
+  uint8_t *p    = buf;
+  uint32_t tail = r->tail;
+  size_t done   = 0;
+
+  while (!done && n) {
+    uint32_t head  = load_acquire(&r->head);
+    uint32_t avail = head - tail;
+
+    if (!avail) {
+      // 'head' is final once 'closed' is set, but may have moved
+      // since it was read above.
+      if (load_acquire(&r->closed) && load_acquire(&r->head) == tail)
+        return 0;
+      ring_wait(r, &r->head, head, &r->cons_waiting, &r->cons_wake);
+      continue;
+    }
+
+    // Up to two copies: the data may wrap around the end.
+    while (avail && done < n) {
+      uint32_t off = tail & (r->size - 1);
+      size_t chunk = MIN(MIN((size_t)avail, n - done), (size_t)(r->size - off));
+
+      memcpy(p + done, r->data + off, chunk);
+      tail += chunk;
+      avail -= chunk;
+      done += chunk;
+    }
+    store_release(&r->tail, tail);
+    ring_notify(&r->prod_waiting, &r->prod_wake);
+  }
+  return done;
+}
+
+// Mark the end of the stream.  Called by the producer; the consumer
+// reads what is left, then gets 0 from ring_read().
+void
+ring_close(struct Ring *r) {
+  store_release(&r->closed, 1);
+  ring_notify(&r->cons_waiting, &r->cons_wake);
+}
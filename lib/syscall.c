@@ -9,7 +9,11 @@ syscall(int64_t num, int64_t check, int64_t a1, int64_t a2, int64_t a3, int64_t
 
   // Generic system call: pass system call number in AX,
   // up to five parameters in DX, CX, BX, DI, SI.
-  // Interrupt kernel with T_SYSCALL.
+  // Enter the kernel with the syscall instruction.  It keeps the
+  // return address and flags in CX and R11, so the second parameter
+  // goes in R10 instead, which the kernel takes for CX.  Building with
+  // -DJOS_SYSCALL_INT falls back to interrupting the kernel with
+  // T_SYSCALL, which is slower but passes everything as described.
   //
   // The "volatile" tells the assembler not to optimize
   // this instruction away just because we don't use the
@@ -19,6 +23,7 @@ syscall(int64_t num, int64_t check, int64_t a1, int64_t a2, int64_t a3, int64_t
   // potentially change the condition codes and arbitrary
   // memory locations.
 
+#ifdef JOS_SYSCALL_INT
   asm volatile("int %1\n"
                : "=a"(ret)
                : "i"(T_SYSCALL),
@@ -29,6 +34,19 @@ syscall(int64_t num, int64_t check, int64_t a1, int64_t a2, int64_t a3, int64_t
                  "D"(a4),
                  "S"(a5)
                : "cc", "memory");
+#else
+  register int64_t r10 asm("r10") = a2;
+
+  asm volatile("syscall\n"
+               : "=a"(ret)
+               : "a"(num),
+                 "d"(a1),
+                 "r"(r10),
+                 "b"(a3),
+                 "D"(a4),
+                 "S"(a5)
+               : "rcx", "r11", "cc", "memory");
+#endif
 
   if (check && ret > 0)
     panic("syscall %ld returned %ld (> 0)", (long)num, (long)ret);
@@ -55,3 +73,125 @@ envid_t
 sys_getenvid(void) {
   return syscall(SYS_getenvid, 0, 0, 0, 0, 0, 0);
 }
+
+int
+sys_env_set_priority(envid_t envid, int priority) {
+  return syscall(SYS_env_set_priority, 1, envid, priority, 0, 0, 0);
+}
+
+int
+sys_env_set_sched_class(envid_t envid, int sched_class) {
+  return syscall(SYS_env_set_sched_class, 1, envid, sched_class, 0, 0, 0);
+}
+
+int
+sys_env_set_deadline(envid_t envid, uint64_t runtime_ns,
+                     uint64_t deadline_ns, uint64_t period_ns) {
+  return syscall(SYS_env_set_deadline, 1, envid, runtime_ns, deadline_ns, period_ns, 0);
+}
+
+#ifndef JOS_PROG
+void
+sys_yield(void) {
+  syscall(SYS_yield, 0, 0, 0, 0, 0, 0);
+}
+#endif
+
+int
+sys_sleep_ns(uint64_t ns) {
+  return syscall(SYS_sleep_ns, 1, ns, 0, 0, 0, 0);
+}
+
+int
+sys_ipc_send(envid_t to, const uint64_t msg[IPC_MSG_WORDS]) {
+  return syscall(SYS_ipc_send, 0, to, msg[0], msg[1], msg[2], msg[3]);
+}
+
+int
+sys_ipc_send_page(envid_t to, void *srcva, int perm, uint64_t w0, uint64_t w1) {
+  return syscall(SYS_ipc_send_page, 0, to, (uint64_t)srcva, perm, w0, w1);
+}
+
+// The kernel returns the message in registers: the sender in DX, the
+// words in R10, BX, DI and SI.  Not CX, which the syscall instruction
+// and sysretq clobber.
+int
+sys_ipc_recv_page(envid_t from, void *dstva, envid_t *from_store,
+                  uint64_t msg[IPC_MSG_WORDS]) {
+  int64_t ret;
+  uint64_t sender = from, w1 = 0, w2 = 0, w3 = 0;
+
+#ifdef JOS_SYSCALL_INT
+  register uint64_t w0 asm("r10") = 0;
+  uint64_t va = (uint64_t)dstva;
+
+  asm volatile("int %7\n"
+               : "=a"(ret), "+d"(sender), "+c"(va), "+r"(w0), "+b"(w1), "+D"(w2), "+S"(w3)
+               : "i"(T_SYSCALL), "a"(SYS_ipc_recv)
+               : "cc", "memory");
+#else
+  register uint64_t w0 asm("r10") = (uint64_t)dstva;
+
+  asm volatile("syscall\n"
+               : "=a"(ret), "+d"(sender), "+r"(w0), "+b"(w1), "+D"(w2), "+S"(w3)
+               : "a"(SYS_ipc_recv)
+               : "rcx", "r11", "cc", "memory");
+#endif
+
+  if (ret < 0)
+    return ret;
+  if (from_store)
+    *from_store = sender;
+  if (msg) {
+    msg[0] = w0;
+    msg[1] = w1;
+    msg[2] = w2;
+    msg[3] = w3;
+  }
+  return 0;
+}
+
+int
+sys_ipc_recv(envid_t from, envid_t *from_store, uint64_t msg[IPC_MSG_WORDS]) {
+  return sys_ipc_recv_page(from, (void *)UTOP, from_store, msg);
+}
+
+int
+sys_shm_get(uint32_t key, size_t npages) {
+  return syscall(SYS_shm_get, 0, key, npages, 0, 0, 0);
+}
+
+int
+sys_shm_map(int id, void *va, int perm) {
+  return syscall(SYS_shm_map, 1, id, (uint64_t)va, perm, 0, 0);
+}
+
+int
+sys_shm_remove(int id) {
+  return syscall(SYS_shm_remove, 1, id, 0, 0, 0, 0);
+}
+
+int
+sys_futex_wait(volatile uint32_t *addr, uint32_t expected) {
+  return syscall(SYS_futex_wait, 1, (uint64_t)addr, expected, 0, 0, 0);
+}
+
+int
+sys_futex_wake(volatile uint32_t *addr, int n) {
+  return syscall(SYS_futex_wake, 0, (uint64_t)addr, n, 0, 0, 0);
+}
+
+int
+sys_sysring_setup(struct Sysring *ring) {
+  return syscall(SYS_sysring_setup, 1, (uint64_t)ring, 0, 0, 0, 0);
+}
+
+int
+sys_enter(uint32_t n) {
+  return syscall(SYS_enter, 0, n, 0, 0, 0, 0);
+}
+
+envid_t
+sys_spawn(const char *name, const char **argv) {
+  return syscall(SYS_spawn, 0, (uint64_t)name, (uint64_t)argv, 0, 0, 0);
+}
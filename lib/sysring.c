@@ -0,0 +1,69 @@
+// Batched system calls.
+//
+// Calls queued with sysring_queue() wait in this environment's ring
+// until sysring_submit() runs them all with a single sys_enter(), or
+// the ring fills up.  Their results are then reaped in order with
+// sysring_reap().  Only calls that return right away can be batched,
+// see sys_enter() in kern/syscall.c.
+
+#include <inc/lib.h>
+
+static struct Sysring sysring __attribute__((aligned(PGSIZE)));
+static bool sysring_ready;
+
+// Queue system call 'num' with its arguments; its completion carries
+// 'user_data'.  Submits the calls queued so far if the ring is full.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BUSY if the ring is full of calls whose results are not reaped.
+//	any error of sys_sysring_setup(), on the first call.
+int
+sysring_queue(uint64_t user_data, int num, uint64_t a1, uint64_t a2,
+              uint64_t a3, uint64_t a4, uint64_t a5) {
+  uint32_t tail = sysring.sq_tail;
+  int r;
+
+  if (!sysring_ready) {
+    if ((r = sys_sysring_setup(&sysring)) < 0)
+      return r;
+    sysring_ready = 1;
+  }
+  if (tail - sysring.sq_head >= SYSRING_ENTRIES &&
+      (sysring_submit() <= 0 || tail - sysring.sq_head >= SYSRING_ENTRIES))
+    return -E_BUSY;
+
+  sysring.sq[tail % SYSRING_ENTRIES] = (struct SysringSqe){
+      .num       = num,
+      .args      = {a1, a2, a3, a4, a5},
+      .user_data = user_data,
+  };
+  sysring.sq_tail = tail + 1;
+  return 0;
+}
+
+// Run the calls queued.  Returns how many ran, which is less than
+// were queued if their results fill the completion queue.
+int
+sysring_submit(void) {
+  uint32_t n = sysring.sq_tail - sysring.sq_head;
+
+  return n ? sys_enter(n) : 0;
+}
+
+// Take the result of the oldest call run into *user_data and *ret.
+// Returns 0 if there is none.
+bool
+sysring_reap(uint64_t *user_data, int64_t *ret) {
+  uint32_t head = sysring.cq_head;
+  struct SysringCqe *cqe;
+
+  if (head == sysring.cq_tail)
+    return 0;
+  cqe = &sysring.cq[head % SYSRING_ENTRIES];
+  if (user_data)
+    *user_data = cqe->user_data;
+  if (ret)
+    *ret = cqe->ret;
+  sysring.cq_head = head + 1;
+  return 1;
+}
@@ -4,6 +4,6 @@
 
 void
 umain(int argc, char **argv) {
-  // Try to load the kernel's TSS selector into the DS register.
+  // Try to load the (execute-only) user code selector into the DS register.
   asm volatile("movw $0x38,%ax; movw %ax,%ds");
 }
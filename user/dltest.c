@@ -0,0 +1,60 @@
+// Check admission control and budget enforcement of SCHED_DEADLINE.
+//
+// Reservations that would take the total bandwidth above the limit
+// (95%) must be refused, and a changed reservation must give back the
+// old one.  Then the env spins with 10ms of runtime every 100ms, so
+// it must be throttled when its budget runs out, and run again when
+// it is replenished at the start of its next period.
+
+#include <inc/lib.h>
+
+#define MS 1000000ULL
+
+// The throttled part of a period shows up as a gap in the clock.
+#define RUNTIME_NS (10 * MS)
+#define PERIOD_NS  (100 * MS)
+#define GAP_NS     (40 * MS)
+#define SPIN_NS    (1000 * MS)
+
+static void
+expect(const char *what, int r, int want) {
+  if (r != want)
+    panic("%s: got %i, expected %i", what, r, want);
+}
+
+void
+umain(int argc, char **argv) {
+  int64_t start, last, now, ran = 0;
+  int gaps = 0;
+
+  expect("runtime below the minimum",
+         sys_env_set_deadline(0, 1000, 0, PERIOD_NS), -E_INVAL);
+  expect("runtime above the deadline",
+         sys_env_set_deadline(0, 60 * MS, 50 * MS, PERIOD_NS), -E_INVAL);
+  expect("96% of the CPU", sys_env_set_deadline(0, 96 * MS, 0, PERIOD_NS), -E_BUSY);
+  expect("20% of the CPU", sys_env_set_deadline(0, 20 * MS, 0, PERIOD_NS), 0);
+  // Only fits if the 20% reserved above is given back.
+  expect("90% of the CPU", sys_env_set_deadline(0, 90 * MS, 0, PERIOD_NS), 0);
+  expect("96% of the CPU again", sys_env_set_deadline(0, 96 * MS, 0, PERIOD_NS), -E_BUSY);
+  cprintf("dltest: admission control ok\n");
+
+  expect("10% of the CPU", sys_env_set_deadline(0, RUNTIME_NS, 0, PERIOD_NS), 0);
+  start = last = clock_gettime_ns(CLOCK_MONOTONIC);
+  while ((now = clock_gettime_ns(CLOCK_MONOTONIC)) - start < SPIN_NS) {
+    if (now - last >= GAP_NS)
+      gaps++;
+    else
+      ran += now - last;
+    last = now;
+  }
+
+  cprintf("dltest: ran %ldms of %ldms, throttled %d times\n",
+          (long)(ran / MS), (long)((now - start) / MS), gaps);
+  // Without throttling there would be no gaps, without replenishment
+  // the env would never get here.
+  if (gaps < SPIN_NS / PERIOD_NS / 2)
+    panic("throttled only %d times", gaps);
+  if (ran > SPIN_NS / 2)
+    panic("ran for %ldms, more than its reservation", (long)(ran / MS));
+  cprintf("dltest: throttled and replenished\n");
+}
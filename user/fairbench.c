@@ -0,0 +1,63 @@
+// Fair-share scheduling benchmark.
+//
+// Run several copies, e.g. `make run-fairbench-nox INIT_CFLAGS=-DTEST_NENVS=4`.
+// Every copy moves itself to the fair scheduling class with a priority
+// (and so a weight) picked from its slot in envs[], then spins.  The
+// first copy periodically prints the share of CPU time every fair
+// environment got so far, which should follow the weights 8:4:2:1.
+
+#include <inc/lib.h>
+
+#define ROUNDS     16
+#define ROUND_SPIN (1UL << 26)
+
+static void
+print_shares(int round) {
+  uint64_t total = 0;
+  int i;
+
+  for (i = 0; i < NENV; i++)
+    if (envs[i].env_status != ENV_FREE && envs[i].env_sched_class == SCHED_FAIR)
+      total += envs[i].env_sum_exec;
+  if (!total)
+    return;
+
+  cprintf("round %d:\n", round);
+  for (i = 0; i < NENV; i++) {
+    if (envs[i].env_status != ENV_FREE && envs[i].env_sched_class == SCHED_FAIR)
+      cprintf("  [%08x] prio %d runtime %lu share %lu.%lu%%\n",
+              envs[i].env_id, envs[i].env_priority,
+              (unsigned long)envs[i].env_sum_exec,
+              (unsigned long)(envs[i].env_sum_exec * 100 / total),
+              (unsigned long)(envs[i].env_sum_exec * 1000 / total % 10));
+  }
+}
+
+void
+umain(int argc, char **argv) {
+  volatile unsigned long spin;
+  int self = ENVX(thisenv->env_id), first = 1;
+  int prio = 0, i, r;
+
+  // Slots are handed out in order, so the copies get consecutive ones.
+  for (i = 0; i < self; i++)
+    if (envs[i].env_status != ENV_FREE && envs[i].env_type == ENV_TYPE_USER) {
+      first = 0;
+      prio++;
+    }
+  prio %= NPRIO;
+
+  if ((r = sys_env_set_priority(0, prio)) < 0)
+    panic("sys_env_set_priority: %i", r);
+  if ((r = sys_env_set_sched_class(0, SCHED_FAIR)) < 0)
+    panic("sys_env_set_sched_class: %i", r);
+
+  for (int round = 0; round < ROUNDS; round++) {
+    for (spin = 0; spin < ROUND_SPIN; spin++)
+      ;
+    if (first)
+      print_shares(round);
+  }
+  cprintf("[%08x] prio %d done, runtime %lu\n", thisenv->env_id, prio,
+          (unsigned long)thisenv->env_sum_exec);
+}
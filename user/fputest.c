@@ -0,0 +1,39 @@
+// Check that the FPU and vector registers survive context switches.
+//
+// Run several copies: `make run-fputest-nox INIT_CFLAGS=-DTEST_NENVS=2`.
+// Each copy keeps its own values in XMM registers and MXCSR while it
+// yields the CPU to the others, and checks them after every yield.
+// (User programs are built with -mno-sse, so the compiler leaves these
+// registers alone.)
+
+#include <inc/lib.h>
+
+#define ROUNDS 1000
+
+void
+umain(int argc, char **argv) {
+  uint64_t x0 = 0x0123456789abcdefULL ^ thisenv->env_id;
+  uint64_t x7 = ~x0;
+  uint32_t mxcsr = 0x1f80 | (ENVX(thisenv->env_id) & 3) << 13; // Rounding
+  uint64_t y0, y7;
+  uint32_t got;
+
+  asm volatile("movq %0, %%xmm0\n"
+               "movq %1, %%xmm7\n"
+               "ldmxcsr %2\n"
+               :
+               : "r"(x0), "r"(x7), "m"(mxcsr));
+
+  for (int i = 0; i < ROUNDS; i++) {
+    sys_yield();
+    asm volatile("movq %%xmm0, %0\n"
+                 "movq %%xmm7, %1\n"
+                 "stmxcsr %2\n"
+                 : "=r"(y0), "=r"(y7), "=m"(got));
+    if (y0 != x0 || y7 != x7 || got != mxcsr)
+      panic("round %d: xmm0 %lx xmm7 %lx mxcsr %x, expected %lx %lx %x", i,
+            (unsigned long)y0, (unsigned long)y7, got,
+            (unsigned long)x0, (unsigned long)x7, mxcsr);
+  }
+  cprintf("fputest: [%08x] registers kept over %d yields\n", thisenv->env_id, ROUNDS);
+}
@@ -0,0 +1,109 @@
+// Synchronous IPC ping-pong benchmark.
+//
+// Run two copies: `make run-ipcbench-nox INIT_CFLAGS=-DTEST_NENVS=2`.
+// The first copy sends a message to the second one and waits for it
+// to be sent back, ROUNDS times, then prints the average round trip
+// in TSC cycles.  The second copy echoes every message it gets.
+// Then the first copy sends XFER_PAGES pages of a buffer, which the
+// second one gets mapped at XFER_VA, to time bulk transfers.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define ROUNDS     100000
+#define STOP       (~0ULL)
+#define XFER_PAGES 256 // 1 MB
+#define XFER_VA    0x10000000UL
+
+static uint8_t xfer_buf[XFER_PAGES * PGSIZE] __attribute__((aligned(PGSIZE)));
+
+static void
+pong(void) {
+  uint64_t msg[IPC_MSG_WORDS];
+  envid_t from;
+  int r, i;
+
+  for (i = 0;; i++) {
+    if ((r = sys_ipc_recv_page(0, (void *)(XFER_VA + i % XFER_PAGES * PGSIZE),
+                               &from, msg)) < 0)
+      panic("sys_ipc_recv_page: %i", r);
+    if (thisenv->env_ipc_perm &&
+        *(uint64_t *)(XFER_VA + i % XFER_PAGES * PGSIZE) != msg[0])
+      panic("page %lu: wrong contents", (unsigned long)msg[0]);
+    if ((r = sys_ipc_send(from, msg)) < 0)
+      panic("sys_ipc_send: %i", r);
+    if (msg[0] == STOP)
+      return;
+  }
+}
+
+static void
+transfer(envid_t peer) {
+  uint64_t msg[IPC_MSG_WORDS];
+  uint64_t start, cycles;
+  int r;
+
+  for (int i = 0; i < XFER_PAGES; i++)
+    *(uint64_t *)(xfer_buf + i * PGSIZE) = i;
+
+  start = read_tsc();
+  for (int i = 0; i < XFER_PAGES; i++) {
+    if ((r = sys_ipc_send_page(peer, xfer_buf + i * PGSIZE, PTE_P | PTE_U, i, 0)) < 0)
+      panic("sys_ipc_send_page: %i", r);
+    if ((r = sys_ipc_recv(peer, NULL, msg)) < 0)
+      panic("sys_ipc_recv: %i", r);
+  }
+  cycles = read_tsc() - start;
+
+  cprintf("ipcbench: %d KB in pages, %lu cycles per page\n",
+          XFER_PAGES * PGSIZE / 1024, (unsigned long)(cycles / XFER_PAGES));
+}
+
+static void
+ping(envid_t peer) {
+  uint64_t msg[IPC_MSG_WORDS] = {0, 1, 2, 3};
+  uint64_t start, cycles;
+  int r;
+
+  start = read_tsc();
+  for (int i = 0; i < ROUNDS; i++) {
+    msg[0] = i;
+    if ((r = sys_ipc_send(peer, msg)) < 0)
+      panic("sys_ipc_send: %i", r);
+    if ((r = sys_ipc_recv(peer, NULL, msg)) < 0)
+      panic("sys_ipc_recv: %i", r);
+    if (msg[0] != (uint64_t)i || msg[3] != 3)
+      panic("round %d: got message %lu back", i, (unsigned long)msg[0]);
+  }
+  cycles = read_tsc() - start;
+
+  cprintf("ipcbench: %d round trips, %lu cycles each\n", ROUNDS,
+          (unsigned long)(cycles / ROUNDS));
+
+  transfer(peer);
+
+  msg[0] = STOP;
+  sys_ipc_send(peer, msg);
+  sys_ipc_recv(peer, NULL, msg);
+}
+
+void
+umain(int argc, char **argv) {
+  int self = ENVX(thisenv->env_id);
+  envid_t peer = 0;
+
+  // Slots are handed out in order: the copy in the lower one pings.
+  for (int i = 0; i < NENV; i++)
+    if (i != self && envs[i].env_status != ENV_FREE &&
+        envs[i].env_type == ENV_TYPE_USER) {
+      peer = envs[i].env_id;
+      break;
+    }
+  if (!peer)
+    panic("ipcbench needs a second copy, see the comment on top");
+
+  if (self < ENVX(peer))
+    ping(peer);
+  else
+    pong();
+}
@@ -0,0 +1,96 @@
+// Shared memory ring throughput benchmark.
+//
+// Run two copies: `make run-ringbench-nox INIT_CFLAGS=-DTEST_NENVS=2`.
+// Both map the same shared memory segment.  The copy in the lower
+// envs[] slot sets up a ring in it, tells the other copy over IPC and
+// streams TOTAL_BYTES through it; the other copy reads and checks them.
+// Both block on futexes, not spin, when the ring is full or empty.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define SHM_KEY     0x52494e47 // "RING"
+#define SHM_PAGES   16
+#define SHM_VA      0x20000000UL
+#define CHUNK       4096
+#define TOTAL_BYTES (64UL << 20)
+
+static uint64_t chunk[CHUNK / sizeof(uint64_t)];
+
+static void
+produce(struct Ring *r, envid_t peer) {
+  uint64_t msg[IPC_MSG_WORDS] = {0};
+  uint64_t start, cycles, seq = 0;
+  int err;
+
+  if ((err = ring_init(r, SHM_PAGES * PGSIZE)) < 0)
+    panic("ring_init: %i", err);
+  if ((err = sys_ipc_send(peer, msg)) < 0)
+    panic("sys_ipc_send: %i", err);
+
+  start = read_tsc();
+  for (size_t sent = 0; sent < TOTAL_BYTES; sent += CHUNK) {
+    for (size_t i = 0; i < CHUNK / sizeof(uint64_t); i++)
+      chunk[i] = seq++;
+    ring_write(r, chunk, CHUNK);
+  }
+  ring_close(r);
+  cycles = read_tsc() - start;
+
+  cprintf("ringbench: %lu MB through a %u byte ring, %lu cycles per KB\n",
+          TOTAL_BYTES >> 20, r->size, (unsigned long)(cycles / (TOTAL_BYTES >> 10)));
+}
+
+static void
+consume(struct Ring *r) {
+  uint64_t msg[IPC_MSG_WORDS];
+  uint64_t seq = 0, total = 0;
+  size_t n, have = 0;
+  int err;
+
+  if ((err = sys_ipc_recv(0, NULL, msg)) < 0)
+    panic("sys_ipc_recv: %i", err);
+
+  // Reads need not end on a word boundary: keep the partial word.
+  while ((n = ring_read(r, (uint8_t *)chunk + have, CHUNK - have))) {
+    size_t words = (have + n) / sizeof(uint64_t);
+
+    for (size_t i = 0; i < words; i++)
+      if (chunk[i] != seq++)
+        panic("byte %lu: data out of order", (unsigned long)total);
+    total += n;
+    have = (have + n) % sizeof(uint64_t);
+    memmove(chunk, (uint8_t *)chunk + words * sizeof(uint64_t), have);
+  }
+  if (total != TOTAL_BYTES)
+    panic("got %lu bytes, expected %lu", (unsigned long)total, TOTAL_BYTES);
+  cprintf("ringbench: consumer got %lu bytes\n", (unsigned long)total);
+}
+
+void
+umain(int argc, char **argv) {
+  int self = ENVX(thisenv->env_id);
+  envid_t peer = 0;
+  int id, r;
+
+  for (int i = 0; i < NENV; i++)
+    if (i != self && envs[i].env_status != ENV_FREE &&
+        envs[i].env_type == ENV_TYPE_USER) {
+      peer = envs[i].env_id;
+      break;
+    }
+  if (!peer)
+    panic("ringbench needs a second copy, see the comment on top");
+
+  if ((id = sys_shm_get(SHM_KEY, SHM_PAGES)) < 0)
+    panic("sys_shm_get: %i", id);
+  if ((r = sys_shm_map(id, (void *)SHM_VA, PTE_P | PTE_U | PTE_W)) < 0)
+    panic("sys_shm_map: %i", r);
+
+  if (self < ENVX(peer)) {
+    produce((struct Ring *)SHM_VA, peer);
+    sys_shm_remove(id);
+  } else {
+    consume((struct Ring *)SHM_VA);
+  }
+}
@@ -0,0 +1,83 @@
+// Check what sys_spawn() hands to the child and how it fails.
+//
+// Spawns itself with a few arguments, one of them empty, and has the
+// child check in umain() that they arrived and report back over IPC.
+// Then checks that an unknown program name and arguments that don't
+// fit on the child's stack are refused without using up an env.
+
+#include <inc/lib.h>
+
+static const char *child_args[] = {"spawnargs", "child", "two words", "", "last", NULL};
+#define CHILD_ARGC 5
+
+// Twice this is more than the top page of the stack holds.
+static char big[3000];
+
+static void
+child(int argc, char **argv) {
+  uint64_t msg[IPC_MSG_WORDS] = {0};
+  int r;
+
+  cprintf("spawnargs: child argc %d\n", argc);
+  if (argc != CHILD_ARGC)
+    panic("child got %d arguments, not %d", argc, CHILD_ARGC);
+  for (int i = 0; i < argc; i++) {
+    cprintf("spawnargs: argv[%d] '%s'\n", i, argv[i]);
+    if (strcmp(argv[i], child_args[i]))
+      panic("argv[%d] is '%s', not '%s'", i, argv[i], child_args[i]);
+  }
+  if (argv[argc])
+    panic("argv[%d] is not NULL", argc);
+
+  msg[0] = argc;
+  if ((r = sys_ipc_send(thisenv->env_parent_id, msg)) < 0)
+    panic("sys_ipc_send: %i", r);
+}
+
+static int
+count_envs(void) {
+  int n = 0;
+
+  for (int i = 0; i < NENV; i++)
+    if (envs[i].env_status != ENV_FREE)
+      n++;
+  return n;
+}
+
+void
+umain(int argc, char **argv) {
+  uint64_t msg[IPC_MSG_WORDS];
+  const char *too_big[] = {"spawnargs", big, big, NULL};
+  envid_t id;
+  int nenv, r;
+
+  if (argc > 1) {
+    child(argc, argv);
+    return;
+  }
+
+  if ((id = sys_spawn("spawnargs", child_args)) < 0)
+    panic("sys_spawn: %i", id);
+  if ((r = sys_ipc_recv(id, NULL, msg)) < 0)
+    panic("sys_ipc_recv: %i", r);
+  if (msg[0] != CHILD_ARGC)
+    panic("child %08x saw %lu arguments", id, (unsigned long)msg[0]);
+  cprintf("spawnargs: child %08x got its arguments\n", id);
+
+  // Let it exit first, so that it is not counted.
+  while (envs[ENVX(id)].env_id == id && envs[ENVX(id)].env_status != ENV_FREE)
+    sys_yield();
+  nenv = count_envs();
+  if ((r = sys_spawn("nosuchprogram", child_args)) != -E_INVALID_EXE)
+    panic("sys_spawn of an unknown program: %i", r);
+  cprintf("spawnargs: unknown program refused\n");
+
+  memset(big, 'x', sizeof(big) - 1);
+  if ((r = sys_spawn("spawnargs", too_big)) != -E_INVAL)
+    panic("sys_spawn with oversized arguments: %i", r);
+  cprintf("spawnargs: oversized arguments refused\n");
+
+  if (count_envs() != nenv)
+    panic("%d envs in use, %d before the failed sys_spawn()s", count_envs(), nenv);
+  cprintf("spawnargs: no env leaked\n");
+}
@@ -0,0 +1,64 @@
+// Spawn latency benchmark.
+//
+// Run it with `make run-spawnbench-nox`.  Spawns ROUNDS copies of
+// itself with sys_spawn(), passing "child" and the round number as
+// arguments.  Each child checks them and tells its parent over IPC
+// that it runs, then exits.  Prints the best and the average cycles
+// of the sys_spawn() call itself and until the child reported in.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define ROUNDS 32
+
+static void
+child(int argc, char **argv) {
+  uint64_t msg[IPC_MSG_WORDS] = {0};
+  int r;
+
+  if (argc != 3 || strcmp(argv[1], "child"))
+    panic("child got %d arguments", argc);
+  msg[0] = strtol(argv[2], NULL, 10);
+  if ((r = sys_ipc_send(thisenv->env_parent_id, msg)) < 0)
+    panic("sys_ipc_send: %i", r);
+}
+
+void
+umain(int argc, char **argv) {
+  uint64_t msg[IPC_MSG_WORDS];
+  uint64_t start, spawned, running;
+  uint64_t best_spawn = ~0ULL, best_run = ~0ULL;
+  uint64_t total_spawn = 0, total_run = 0;
+  char round_str[16];
+  const char *args[] = {"spawnbench", "child", round_str, NULL};
+  envid_t id;
+  int r;
+
+  if (argc > 1) {
+    child(argc, argv);
+    return;
+  }
+
+  for (int round = 0; round < ROUNDS; round++) {
+    snprintf(round_str, sizeof(round_str), "%d", round);
+    start = read_tsc();
+    if ((id = sys_spawn("spawnbench", args)) < 0)
+      panic("sys_spawn: %i", id);
+    spawned = read_tsc();
+    if ((r = sys_ipc_recv(id, NULL, msg)) < 0)
+      panic("sys_ipc_recv: %i", r);
+    running = read_tsc();
+    if (msg[0] != round)
+      panic("child %08x got round %lu, not %d", id, (unsigned long)msg[0], round);
+
+    best_spawn = MIN(best_spawn, spawned - start);
+    best_run   = MIN(best_run, running - start);
+    total_spawn += spawned - start;
+    total_run += running - start;
+  }
+
+  cprintf("spawnbench: sys_spawn    best %lu, average %lu cycles\n",
+          (unsigned long)best_spawn, (unsigned long)(total_spawn / ROUNDS));
+  cprintf("spawnbench: until it ran best %lu, average %lu cycles\n",
+          (unsigned long)best_run, (unsigned long)(total_run / ROUNDS));
+}
@@ -0,0 +1,110 @@
+// Null system call latency benchmark.
+//
+// Run it with `make run-sysbench-nox`.  Times sys_getenvid(), which
+// does no work in the kernel, entering the kernel with the T_SYSCALL
+// interrupt gate, with the syscall instruction and in batches of
+// SYSRING_ENTRIES calls through sys_enter(), and prints the best of
+// ROUNDS rounds of each in cycles per call.  For comparison, also
+// times clock_gettime_ns(), which does not enter the kernel.
+
+#include <inc/lib.h>
+#include <inc/trap.h>
+#include <inc/x86.h>
+
+#define ROUNDS 8
+#define CALLS  100000
+
+static inline int64_t
+getenvid_int(void) {
+  int64_t ret;
+
+  asm volatile("int %1\n"
+               : "=a"(ret)
+               : "i"(T_SYSCALL), "a"(SYS_getenvid)
+               : "cc", "memory");
+  return ret;
+}
+
+static inline int64_t
+getenvid_syscall(void) {
+  int64_t ret;
+
+  asm volatile("syscall\n"
+               : "=a"(ret)
+               : "a"(SYS_getenvid)
+               : "rcx", "r11", "cc", "memory");
+  return ret;
+}
+
+static uint64_t
+bench(const char *name, int64_t (*call)(void)) {
+  uint64_t best = ~0ULL;
+
+  for (int round = 0; round < ROUNDS; round++) {
+    uint64_t start = read_tsc();
+    for (int i = 0; i < CALLS; i++)
+      if (call() != thisenv->env_id)
+        panic("%s: wrong env id", name);
+    best = MIN(best, (read_tsc() - start) / CALLS);
+  }
+  cprintf("sysbench: %-8s %lu cycles per null syscall\n", name, (unsigned long)best);
+  return best;
+}
+
+static uint64_t
+bench_batch(void) {
+  uint64_t best = ~0ULL;
+  int64_t ret;
+  int r;
+
+  for (int round = 0; round < ROUNDS; round++) {
+    uint64_t start = read_tsc();
+    for (int i = 0; i < CALLS; i += SYSRING_ENTRIES) {
+      for (int j = 0; j < SYSRING_ENTRIES; j++)
+        if ((r = sysring_queue(j, SYS_getenvid, 0, 0, 0, 0, 0)) < 0)
+          panic("sysring_queue: %i", r);
+      if ((r = sysring_submit()) != SYSRING_ENTRIES)
+        panic("sysring_submit: %i", r);
+      while (sysring_reap(NULL, &ret))
+        if (ret != thisenv->env_id)
+          panic("batch: wrong env id");
+    }
+    best = MIN(best, (read_tsc() - start) / CALLS);
+  }
+  cprintf("sysbench: %-8s %lu cycles per null syscall\n", "batch", (unsigned long)best);
+  return best;
+}
+
+static uint64_t
+bench_clock(void) {
+  uint64_t best = ~0ULL;
+  int64_t last  = 0, now;
+
+  for (int round = 0; round < ROUNDS; round++) {
+    uint64_t start = read_tsc();
+    for (int i = 0; i < CALLS; i++) {
+      if ((now = clock_gettime_ns(CLOCK_MONOTONIC)) < last)
+        panic("clock_gettime_ns went back from %ld to %ld", (long)last, (long)now);
+      last = now;
+    }
+    best = MIN(best, (read_tsc() - start) / CALLS);
+  }
+  cprintf("sysbench: %-8s %lu cycles per clock_gettime_ns\n", "clock", (unsigned long)best);
+  return best;
+}
+
+void
+umain(int argc, char **argv) {
+  uint64_t slow = bench("int", getenvid_int);
+  uint64_t fast = bench("syscall", getenvid_syscall);
+  uint64_t batch = bench_batch();
+
+  bench_clock();
+
+  if (fast)
+    cprintf("sysbench: syscall is %lu.%lux faster\n",
+            (unsigned long)(slow / fast), (unsigned long)(slow * 10 / fast % 10));
+  if (batch)
+    cprintf("sysbench: batch is %lu.%lux faster\n",
+            (unsigned long)(slow / batch), (unsigned long)(slow * 10 / batch % 10));
+}